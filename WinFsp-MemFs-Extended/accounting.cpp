@@ -0,0 +1,70 @@
+#include "globalincludes.h"
+#include "accounting.h"
+
+using namespace Memfs;
+
+void ShardedCounter::Add(const INT64 delta) {
+	if (delta == 0) {
+		return;
+	}
+
+	// Windows thread ids are multiples of 4, so their low bits would leave most shards unused
+	this->shards[(GetCurrentThreadId() >> 2) % SHARD_COUNT].Value.fetch_add(delta, std::memory_order_relaxed);
+}
+
+INT64 ShardedCounter::Sum() const {
+	INT64 sum = 0;
+	for (const Shard& shard : this->shards) {
+		sum += shard.Value.load(std::memory_order_relaxed);
+	}
+
+	return sum;
+}
+
+void MetadataCounter::Add(const INT64 delta) {
+	this->bytes.Add(delta);
+	METADATA_BYTES.Add(delta);
+}
+
+UINT64 MetadataCounter::Sum() const {
+	const INT64 sum = this->bytes.Sum();
+	return sum > 0 ? (UINT64)sum : 0;
+}
+
+
+static UINT64 GetMetadataBytes() {
+	const INT64 metadataBytes = METADATA_BYTES.Sum();
+	return metadataBytes > 0 ? (UINT64)metadataBytes : 0;
+}
+
+MemoryBudget::MemoryBudget(const UINT64 limit) : limit(limit) {}
+
+bool MemoryBudget::Reserve(const UINT64 bytes) {
+	const UINT64 metadataBytes = GetMetadataBytes();
+	UINT64 reserved = this->reservedBytes.load(std::memory_order_relaxed);
+
+	do {
+		if (reserved + bytes + metadataBytes > this->limit) {
+			return false;
+		}
+	} while (!this->reservedBytes.compare_exchange_weak(reserved, reserved + bytes, std::memory_order_relaxed));
+
+	return true;
+}
+
+void MemoryBudget::ForceReserve(const UINT64 bytes) {
+	this->reservedBytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void MemoryBudget::Release(const UINT64 bytes) {
+	this->reservedBytes.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+UINT64 MemoryBudget::GetAvailableBytes() const {
+	const UINT64 usedBytes = this->reservedBytes.load(std::memory_order_relaxed) + GetMetadataBytes();
+	return usedBytes < this->limit ? this->limit - usedBytes : 0;
+}
+
+UINT64 MemoryBudget::GetLimit() const {
+	return this->limit;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "globalincludes.h"
+
+namespace Memfs {
+	/**
+	 * \brief Counter which is updated from many threads. Every thread adds to its own cache line and a read sums up the fixed number of shards.
+	 */
+	class ShardedCounter {
+	public:
+		static constexpr size_t SHARD_COUNT = 16;
+
+		void Add(const INT64 delta);
+		[[nodiscard]] INT64 Sum() const;
+
+	private:
+		struct alignas(MEMFS_CACHE_LINE_SIZE) Shard {
+			std::atomic<INT64> Value{0};
+		};
+
+		Shard shards[SHARD_COUNT];
+	};
+
+	// Bytes of all node-owned metadata allocations of the process: nodes with their names, cold data, EAs, reparse data, sector tables, map entries and security descriptors
+	inline ShardedCounter METADATA_BYTES;
+
+	/**
+	 * \brief Metadata bytes of one volume, which its own size limit is charged with; Every change is added to METADATA_BYTES as well, which the budget of the process (-B) totals
+	 */
+	class MetadataCounter {
+	public:
+		void Add(const INT64 delta);
+		// Never negative, even though a concurrent free might be seen before its allocation
+		[[nodiscard]] UINT64 Sum() const;
+
+	private:
+		ShardedCounter bytes;
+	};
+
+	/**
+	 * \brief Memory, which all volumes of the process share (-B), so that no two volumes promise the same bytes.
+	 * Sectors are reserved from it before they are allocated; The metadata of the process (METADATA_BYTES) counts against it as well.
+	 */
+	class MemoryBudget {
+	public:
+		explicit MemoryBudget(const UINT64 limit);
+
+		// Returns false if the bytes do not fit anymore
+		bool Reserve(const UINT64 bytes);
+		// For bytes that are already in use, e.g. the sectors of a re-attached hot restart state
+		void ForceReserve(const UINT64 bytes);
+		void Release(const UINT64 bytes);
+
+		[[nodiscard]] UINT64 GetAvailableBytes() const;
+		[[nodiscard]] UINT64 GetLimit() const;
+
+	private:
+		const UINT64 limit;
+		std::atomic<UINT64> reservedBytes{0};
+	};
+}
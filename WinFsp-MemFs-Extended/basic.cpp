@@ -1,6 +1,7 @@
 #include "globalincludes.h"
 #include "memfs.h"
 #include "memfs-interface.h"
+#include "accounting.h"
 
 using namespace Memfs;
 
@@ -25,6 +26,33 @@ SectorManager& MemFs::GetSectorManager() {
 	return this->sectors;
 }
 
+MemoryMonitor& MemFs::GetMemoryMonitor() {
+	return this->memoryMonitor;
+}
+
+NegativeLookupCache& MemFs::GetNegativeLookups() {
+	return this->negativeLookups;
+}
+
+SecurityDescriptorTable& MemFs::GetSecurityDescriptors() {
+	return this->securityDescriptors;
+}
+
+MetadataCounter& MemFs::GetMetadata() {
+	return this->metadata;
+}
+
+void MemFs::GetStatistics(MemfsStatistics& statistics) {
+	statistics.FileNodeCount = this->fileMap.size();
+	statistics.UniqueSecurityDescriptors = this->securityDescriptors.GetUniqueCount();
+	statistics.MetadataBytes = this->metadata.Sum();
+	statistics.SectorBytes = this->sectors.GetAllocatedSectors() * sizeof(Sector);
+	statistics.AvailableMemoryBytes = this->memoryMonitor.GetAvailableBytes();
+	statistics.MemoryLimitBytes = this->memoryMonitor.GetLimitBytes();
+	statistics.MemoryPressureLevel = (UINT64)this->memoryMonitor.GetPressureLevel();
+	statistics.InlineBytes = this->sectors.GetInlineBytes();
+}
+
 void MemFs::RecreateSectorManager() {
-	this->sectors = SectorManager();
+	this->sectors = SectorManager(this->metadata);
 }
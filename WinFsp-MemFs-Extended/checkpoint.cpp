@@ -0,0 +1,700 @@
+#include "globalincludes.h"
+#include "exceptions.h"
+#include "checkpoint.h"
+
+#include "memfs.h"
+#include "memfs-interface.h"
+
+using namespace Memfs;
+
+static UINT64 AlignRecord(const UINT64 size) {
+	return (size + 7) / 8 * 8;
+}
+
+static std::optional<UINT64> QueryFileSize(const std::wstring& path) {
+	const HANDLE file = CreateFileW(path.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return {};
+	}
+
+	LARGE_INTEGER fileSize;
+	const BOOL success = GetFileSizeEx(file, &fileSize);
+	CloseHandle(file);
+
+	if (!success) {
+		return {};
+	}
+	return (UINT64)fileSize.QuadPart;
+}
+
+static void SerializeNode(FileNode& node, const SnapshotNodeKind kind, CheckpointNode& record, std::vector<byte>& blob) {
+	record = {};
+	blob.clear();
+
+	record.Node.FileInfo = node.fileInfo;
+	record.Node.Kind = kind;
+	record.Node.MainIndex = SNAPSHOT_NO_INDEX;
+	record.Node.SecurityIndex = SNAPSHOT_NO_INDEX;
+
+	UINT64 nameLength;
+	AppendSnapshotBlob(blob, node.fileName.c_str(), node.fileName.length() * sizeof(WCHAR), record.Node.NameOffset, nameLength);
+	record.Node.NameLength = (UINT32)node.fileName.length();
+
+	if (kind == SnapshotNodeKind::Link) {
+		record.Node.MainIndex = node.GetLinkTarget()->fileInfo.IndexNumber;
+		return;
+	}
+
+	if (!node.IsMainNode()) {
+		record.Node.MainIndex = node.GetMainNode()->fileInfo.IndexNumber;
+	} else {
+		AppendSnapshotEas(node, blob, record.Node.EaOffset, record.Node.EaLength);
+	}
+
+	if (node.fileSecurity.HoldsStruct()) {
+		AppendSnapshotBlob(blob, node.fileSecurity.Struct(), node.fileSecurity.WantedByteSize(), record.SecurityOffset, record.SecurityLength);
+	}
+
+	const DynamicStruct<byte>& reparseData = node.GetReparseData();
+	if (reparseData.HoldsStruct()) {
+		AppendSnapshotBlob(blob, reparseData.Struct(), reparseData.WantedByteSize(), record.Node.ReparseOffset, record.Node.ReparseLength);
+	}
+}
+
+static bool WriteAll(const HANDLE file, const byte* data, size_t size) {
+	while (size > 0) {
+		const DWORD writeNow = (DWORD)min(size, (size_t)SnapshotWriter::BUFFER_SIZE);
+		DWORD written;
+		if (!WriteFile(file, data, writeNow, &written, nullptr) || written != writeNow) {
+			return false;
+		}
+
+		data += writeNow;
+		size -= writeNow;
+	}
+
+	return true;
+}
+
+static bool HasSectors(const FileNode& node) {
+	return !node.IsLink() && !(node.fileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+
+CheckpointLog::CheckpointLog(MemFs& memfs, const DWORD intervalSeconds) : memfs(memfs), intervalSeconds(intervalSeconds) {
+	this->logPath = memfs.GetSnapshotPath() + L".log";
+}
+
+CheckpointLog::~CheckpointLog() {
+	this->Stop();
+
+	if (this->logFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(this->logFile);
+	}
+}
+
+NTSTATUS CheckpointLog::Replay() {
+	this->sequence = this->memfs.GetRestoredCheckpointSequence();
+	this->logSize = 0;
+
+	const HANDLE file = CreateFileW(this->logPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return ERROR_FILE_NOT_FOUND == GetLastError() ? STATUS_SUCCESS : FspNtStatusFromWin32(GetLastError());
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || 0 == fileSize.QuadPart) {
+		CloseHandle(file);
+		return STATUS_SUCCESS; // Nothing was logged since the image was written
+	}
+
+	const HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (mapping == nullptr) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	const byte* log = static_cast<const byte*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	CloseHandle(mapping);
+	if (log == nullptr) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	const UINT64 size = (UINT64)fileSize.QuadPart;
+	UINT64 maxIndexNumber = 0;
+	NTSTATUS result = STATUS_SUCCESS;
+
+	try {
+		std::unordered_map<UINT64, FileNode*> nodesById;
+		for (const auto& [node, kind] : this->CollectNodes()) {
+			nodesById.emplace(node->fileInfo.IndexNumber, node);
+		}
+
+		for (UINT64 position = 0; NT_SUCCESS(result) && size - position >= sizeof(CheckpointBlockHeader);) {
+			const CheckpointBlockHeader& blockHeader = *reinterpret_cast<const CheckpointBlockHeader*>(log + position);
+			if (blockHeader.Magic != CHECKPOINT_BLOCK_MAGIC) {
+				break;
+			}
+
+			// Only a block, which reached its end record, was completely written
+			UINT64 blockEnd = 0;
+			for (UINT64 recordOffset = position + sizeof(CheckpointBlockHeader); size - recordOffset >= sizeof(CheckpointRecord);) {
+				const CheckpointRecord& record = *reinterpret_cast<const CheckpointRecord*>(log + recordOffset);
+				if (record.Size < sizeof(CheckpointRecord) || record.Size % 8 != 0 || record.Size > size - recordOffset) {
+					break;
+				}
+
+				recordOffset += record.Size;
+				if (record.Type == CheckpointRecordType::End) {
+					blockEnd = record.FileId == blockHeader.Sequence ? recordOffset : 0;
+					break;
+				}
+			}
+
+			if (blockEnd == 0) {
+				break; // Torn by a crash; Cut off by OpenLog
+			}
+
+			// Older blocks are already in the image, if the log could not be emptied after the last compaction
+			if (blockHeader.Sequence > this->sequence) {
+				result = this->ApplyBlock(log + position, blockEnd - position, nodesById, maxIndexNumber);
+				this->sequence = blockHeader.Sequence;
+			}
+
+			position = blockEnd;
+			this->logSize = blockEnd;
+		}
+	} catch (FileNameTooLongException&) {
+		result = STATUS_FILE_CORRUPT_ERROR;
+	} catch (CreateException& ex) {
+		result = ex.Which();
+	} catch (std::bad_alloc&) {
+		result = STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	UnmapViewOfFile(log);
+
+	FileNode::ReserveIndexNumbers(maxIndexNumber);
+	this->memfs.GetNegativeLookups().Clear();
+	return result;
+}
+
+NTSTATUS CheckpointLog::ApplyBlock(const byte* block, const UINT64 size, std::unordered_map<UINT64, FileNode*>& nodesById, UINT64& maxIndexNumber) {
+	std::vector<const CheckpointRecord*> removeRecords;
+	std::vector<const CheckpointRecord*> nodeRecords;
+	std::vector<const CheckpointRecord*> dataRecords;
+
+	for (UINT64 offset = sizeof(CheckpointBlockHeader); offset < size;) {
+		const CheckpointRecord* record = reinterpret_cast<const CheckpointRecord*>(block + offset);
+		offset += record->Size;
+
+		if (record->Type == CheckpointRecordType::Remove) {
+			removeRecords.push_back(record);
+		} else if (record->Type == CheckpointRecordType::Node) {
+			nodeRecords.push_back(record);
+		} else if (record->Type == CheckpointRecordType::Data) {
+			dataRecords.push_back(record);
+		}
+	}
+
+	// Removed nodes go first, because their names might have been taken by the other records
+	std::vector<FileNode*> removedNodes;
+	for (const CheckpointRecord* record : removeRecords) {
+		const auto iter = nodesById.find(record->FileId);
+		if (iter != nodesById.end()) {
+			iter->second->Reference();
+			removedNodes.push_back(iter->second);
+			nodesById.erase(iter);
+		}
+	}
+	for (FileNode* node : removedNodes) {
+		this->memfs.RemoveNode(*node);
+	}
+	for (FileNode* node : removedNodes) {
+		node->Dereference(true);
+	}
+
+	struct NodeUpdate {
+		UINT64 FileId;
+		const SnapshotNode* Record;
+		const byte* Blob;
+		std::wstring_view Name;
+		SharedSecurityDescriptor Security;
+		FileNode* Node; // Nullptr for new nodes
+		bool Reinsert;
+	};
+
+	// Existing nodes leave the map before any node is inserted, so that renames can swap names
+	std::vector<NodeUpdate> updates;
+	std::vector<FileNode*> movedNodes;
+	updates.reserve(nodeRecords.size());
+
+	for (const CheckpointRecord* record : nodeRecords) {
+		const UINT64 payloadSize = record->Size - sizeof(CheckpointRecord);
+		if (payloadSize < sizeof(CheckpointNode)) {
+			return STATUS_FILE_CORRUPT_ERROR;
+		}
+
+		const CheckpointNode& nodeRecord = *reinterpret_cast<const CheckpointNode*>(record + 1);
+		const SnapshotNode& snapshotNode = nodeRecord.Node;
+		const byte* blob = reinterpret_cast<const byte*>(&nodeRecord + 1);
+		const UINT64 blobSize = payloadSize - sizeof(CheckpointNode);
+
+		const auto inBlob = [blobSize](const UINT64 offset, const UINT64 length) {
+			return offset <= blobSize && length <= blobSize - offset;
+		};
+
+		if (!inBlob(snapshotNode.NameOffset, (UINT64)snapshotNode.NameLength * sizeof(WCHAR)) || !inBlob(snapshotNode.EaOffset, snapshotNode.EaLength)
+			|| !inBlob(snapshotNode.ReparseOffset, snapshotNode.ReparseLength) || !inBlob(nodeRecord.SecurityOffset, nodeRecord.SecurityLength)
+			|| snapshotNode.Kind > SnapshotNodeKind::Link || (snapshotNode.Kind == SnapshotNodeKind::Link && snapshotNode.MainIndex == SNAPSHOT_NO_INDEX)) {
+			return STATUS_FILE_CORRUPT_ERROR;
+		}
+
+		NodeUpdate& update = updates.emplace_back();
+		update.FileId = record->FileId;
+		update.Record = &snapshotNode;
+		update.Blob = blob;
+		update.Name = std::wstring_view(reinterpret_cast<const wchar_t*>(blob + snapshotNode.NameOffset), snapshotNode.NameLength);
+		if (nodeRecord.SecurityLength > 0) {
+			update.Security = this->memfs.GetSecurityDescriptors().Intern((PSECURITY_DESCRIPTOR)(blob + nodeRecord.SecurityOffset), nodeRecord.SecurityLength);
+		}
+		maxIndexNumber = max(maxIndexNumber, update.FileId);
+
+		const auto iter = nodesById.find(update.FileId);
+		update.Node = iter != nodesById.end() ? iter->second : nullptr;
+		update.Reinsert = false;
+		if (update.Node == nullptr) {
+			continue;
+		}
+
+		FileNode& node = *update.Node;
+		if (node.IsLink() != (snapshotNode.Kind == SnapshotNodeKind::Link)) {
+			return STATUS_FILE_CORRUPT_ERROR;
+		}
+
+		const bool renamed = !(node.fileName == update.Name);
+		const bool inMap = node.IsLink() || this->memfs.HasOwnName(node);
+		const bool wantsMap = snapshotNode.Kind != SnapshotNodeKind::Hidden;
+
+		if (inMap && (renamed || !wantsMap)) {
+			node.Reference();
+			this->memfs.RemoveNode(node, false);
+			movedNodes.push_back(&node);
+		} else if (!inMap && wantsMap) {
+			node.Reference();
+			movedNodes.push_back(&node);
+		}
+
+		update.Reinsert = wantsMap && (renamed || !inMap);
+		if (renamed) {
+			node.fileName.Assign(update.Name);
+		}
+
+		if (!node.IsLink()) {
+			ApplySnapshotMetadata(node, snapshotNode, blob, update.Security.HoldsStruct() ? &update.Security : nullptr);
+
+			if (HasSectors(node) && !this->memfs.GetSectorManager().ReAllocate(node.GetSectorNode(), node.fileInfo.AllocationSize)) {
+				return STATUS_INSUFFICIENT_RESOURCES;
+			}
+		}
+	}
+
+	// Records come in the order of the checkpoint: Named nodes, then hidden nodes, then the links to them
+	std::vector<FileNodePtr> hiddenNodes; // Owned here until the links reference them
+	for (NodeUpdate& update : updates) {
+		if (update.Node != nullptr) {
+			if (update.Reinsert) {
+				const auto [insertResult, insertedNode] = this->memfs.InsertNode(update.Node);
+				if (!NT_SUCCESS(insertResult) || insertedNode != update.Node) {
+					return NT_SUCCESS(insertResult) ? STATUS_FILE_CORRUPT_ERROR : insertResult;
+				}
+			}
+			continue;
+		}
+
+		const SnapshotNode& record = *update.Record;
+		FileNode* mainNode = nullptr;
+		if (record.MainIndex != SNAPSHOT_NO_INDEX) {
+			const auto mainIter = nodesById.find(record.MainIndex);
+			if (mainIter == nodesById.end() || mainIter->second->IsLink()) {
+				return STATUS_FILE_CORRUPT_ERROR;
+			}
+			mainNode = mainIter->second;
+		}
+
+		FileNodePtr nodePtr;
+		if (record.Kind == SnapshotNodeKind::Link) {
+			nodePtr = FileNode::CreateLink(update.Name, *mainNode);
+			nodePtr->fileInfo.IndexNumber = update.FileId;
+		} else {
+			nodePtr = FileNode::Create(update.Name, this->memfs.GetMetadata());
+			if (mainNode != nullptr) {
+				nodePtr->SetMainNode(mainNode);
+			}
+
+			ApplySnapshotMetadata(*nodePtr, record, update.Blob, update.Security.HoldsStruct() ? &update.Security : nullptr);
+			if (0 != nodePtr->fileInfo.AllocationSize && !this->memfs.GetSectorManager().ReAllocate(nodePtr->GetSectorNode(), nodePtr->fileInfo.AllocationSize)) {
+				return STATUS_INSUFFICIENT_RESOURCES;
+			}
+		}
+
+		FileNode* node = nodePtr.get();
+		if (record.Kind == SnapshotNodeKind::Hidden) {
+			hiddenNodes.push_back(std::move(nodePtr));
+		} else {
+			const auto [insertResult, insertedNode] = this->memfs.InsertNode(std::move(nodePtr));
+			if (!NT_SUCCESS(insertResult) || &insertedNode != node) {
+				return NT_SUCCESS(insertResult) ? STATUS_FILE_CORRUPT_ERROR : insertResult;
+			}
+		}
+
+		nodesById[update.FileId] = node;
+	}
+
+	for (FileNodePtr& hiddenNode : hiddenNodes) {
+		if (hiddenNode->GetReferenceCount() > 0) {
+			hiddenNode.release(); // Kept alive by its links
+		} else {
+			nodesById.erase(hiddenNode->fileInfo.IndexNumber);
+		}
+	}
+	for (FileNode* node : movedNodes) {
+		node->Dereference();
+	}
+
+	// The data goes last, when all nodes have their final allocation sizes
+	for (const CheckpointRecord* record : dataRecords) {
+		const UINT64 payloadSize = record->Size - sizeof(CheckpointRecord);
+		const auto iter = nodesById.find(record->FileId);
+		if (payloadSize < sizeof(UINT64) || iter == nodesById.end() || !HasSectors(*iter->second)) {
+			continue;
+		}
+
+		FileNode& node = *iter->second;
+		const byte* payload = reinterpret_cast<const byte*>(record + 1);
+		const UINT64 offset = *reinterpret_cast<const UINT64*>(payload);
+		const UINT64 allocatedSize = SectorManager::AlignSize(node.fileInfo.AllocationSize);
+
+		// Sectors beyond the allocation were cut off after they had been written
+		if (offset % FULL_SECTOR_SIZE != 0 || offset >= allocatedSize) {
+			continue;
+		}
+
+		const UINT64 length = min((payloadSize - sizeof(UINT64)) / FULL_SECTOR_SIZE * FULL_SECTOR_SIZE, allocatedSize - offset);
+		SectorManager::ReadWrite<false>(node.GetSectorNode(), (void*)(payload + sizeof(UINT64)), length, offset);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS CheckpointLog::Start() {
+	std::lock_guard lock(this->checkpointMutex);
+
+	const std::optional<UINT64> imageSize = this->memfs.GetSnapshotPath().empty() ? std::nullopt : QueryFileSize(this->memfs.GetSnapshotPath());
+	this->hasImage = imageSize.has_value();
+	this->imageSize = imageSize.value_or(0);
+	if (!this->hasImage) {
+		this->logSize = 0; // Without its image, an old log cannot be applied
+	}
+
+	const NTSTATUS result = this->OpenLog(false);
+	if (!NT_SUCCESS(result)) {
+		return result;
+	}
+
+	try {
+		this->loggedFileIds = this->ClearChanges();
+	} catch (std::bad_alloc&) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	// The log only ever applies to an image; If this fails, the checkpoints try again
+	if (!this->hasImage) {
+		this->CompactLocked();
+	}
+
+	this->stopping = false;
+	try {
+		this->thread = std::thread(&CheckpointLog::Run, this);
+	} catch (std::system_error&) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+void CheckpointLog::Stop() {
+	if (!this->thread.joinable()) {
+		return;
+	}
+
+	{
+		std::lock_guard lock(this->stopMutex);
+		this->stopping = true;
+	}
+
+	this->stopCondition.notify_all();
+	this->thread.join();
+}
+
+void CheckpointLog::Run() {
+	std::unique_lock lock(this->stopMutex);
+
+	while (!this->stopCondition.wait_for(lock, std::chrono::seconds(this->intervalSeconds), [this] { return this->stopping; })) {
+		lock.unlock();
+
+		const NTSTATUS result = this->Checkpoint();
+		if (!NT_SUCCESS(result)) {
+			FspDebugLog(__FUNCTION__ ": checkpoint failed (Status=%lx)\n", result);
+		}
+
+		lock.lock();
+	}
+}
+
+NTSTATUS CheckpointLog::Checkpoint() {
+	std::lock_guard lock(this->checkpointMutex);
+
+	if (!this->hasImage || this->needsCompaction || this->logSize > this->imageSize) {
+		const NTSTATUS result = this->CompactLocked();
+		if (NT_SUCCESS(result) || !this->hasImage) {
+			return result;
+		}
+	}
+
+	return this->AppendCheckpoint();
+}
+
+NTSTATUS CheckpointLog::Compact() {
+	std::lock_guard lock(this->checkpointMutex);
+	return this->CompactLocked();
+}
+
+NTSTATUS CheckpointLog::CompactLocked() {
+	std::unordered_set<UINT64> newFileIds;
+	SnapshotPlan plan;
+	NTSTATUS result;
+	try {
+		Interface::OperationGuard guard(this->memfs.GetRawFileSystem(), false);
+
+		// Taken before the image is written, so that changes racing with it are logged by the next checkpoint
+		newFileIds = this->ClearChanges();
+		result = this->memfs.PrepareSnapshot(plan, ++this->sequence);
+	} catch (std::bad_alloc&) {
+		result = STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if (NT_SUCCESS(result)) {
+		result = this->memfs.WriteSnapshot(this->memfs.GetSnapshotPath(), plan);
+	}
+
+	if (!NT_SUCCESS(result)) {
+		// The old image and log stay valid; Everything that changed since them is logged again
+		this->logEverything = true;
+		this->needsCompaction = true;
+		return result;
+	}
+
+	this->loggedFileIds = std::move(newFileIds);
+	this->logEverything = false;
+	this->needsCompaction = false;
+	this->hasImage = true;
+	this->imageSize = QueryFileSize(this->memfs.GetSnapshotPath()).value_or(0);
+
+	// A log, which cannot be emptied, is skipped on replay, because the image holds a newer sequence
+	this->OpenLog(true);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS CheckpointLog::AppendCheckpoint() {
+	const UINT64 blockSequence = this->sequence + 1;
+	std::unordered_set<UINT64> newFileIds;
+	std::vector<byte> block; // Collected under the operation guard, but written and flushed without it
+
+	try {
+		Interface::OperationGuard guard(this->memfs.GetRawFileSystem(), false);
+
+		const auto append = [&block](const void* data, const size_t size) {
+			block.insert(block.end(), static_cast<const byte*>(data), static_cast<const byte*>(data) + size);
+		};
+
+		// The block header is only added with the first change, so that an idle volume does not grow the log; Returns the padded end of the record
+		const auto beginRecord = [&](const CheckpointRecordType type, const UINT64 fileId, const UINT64 payloadSize) {
+			if (block.empty()) {
+				const CheckpointBlockHeader blockHeader{CHECKPOINT_BLOCK_MAGIC, blockSequence};
+				append(&blockHeader, sizeof(CheckpointBlockHeader));
+			}
+
+			const CheckpointRecord record{type, 0, AlignRecord(sizeof(CheckpointRecord) + payloadSize), fileId};
+			const size_t recordEnd = block.size() + (size_t)record.Size;
+			append(&record, sizeof(CheckpointRecord));
+			return recordEnd;
+		};
+
+		// Each word of the bitmap is taken as a whole, and its runs of dirty sectors are copied straight from the sectors
+		const auto appendDirtySectors = [&](FileNode& node) {
+			SectorNode& sectorNode = node.GetSectorNode();
+			std::shared_lock sectorsLock(sectorNode.SectorsMutex);
+			const size_t sectorCount = sectorNode.GetSectors().size();
+
+			for (size_t word = 0; word < sectorNode.DirtySectors.size(); word++) {
+				UINT64 bits = SectorManager::TakeDirtySectors(sectorNode, word);
+				if (this->logEverything) {
+					bits = ~0ULL;
+				}
+
+				while (bits != 0) {
+					const int first = std::countr_zero(bits);
+					const int count = std::countr_one(bits >> first);
+					bits = count + first == 64 ? 0 : bits & (~0ULL << (first + count));
+
+					const size_t begin = word * 64 + first;
+					const size_t end = min(begin + count, sectorCount);
+					if (begin >= end) {
+						break;
+					}
+
+					const UINT64 offset = (UINT64)begin * FULL_SECTOR_SIZE;
+					const size_t recordEnd = beginRecord(CheckpointRecordType::Data, node.fileInfo.IndexNumber, sizeof(UINT64) + (end - begin) * FULL_SECTOR_SIZE);
+					append(&offset, sizeof(UINT64));
+					for (size_t i = begin; i < end; i++) {
+						append(sectorNode.GetSectors()[i]->Bytes, FULL_SECTOR_SIZE);
+					}
+					block.resize(recordEnd);
+				}
+			}
+		};
+
+		CheckpointNode nodeRecord;
+		std::vector<byte> blob;
+		for (const auto& [node, kind] : this->CollectNodes()) {
+			const UINT64 fileId = node->fileInfo.IndexNumber;
+			newFileIds.insert(fileId);
+
+			// The flag is taken before the node is serialized, so that a change racing with it is logged by the next checkpoint
+			const bool changed = node->TakeMetadataChanged();
+			if (changed || this->logEverything || !this->loggedFileIds.contains(fileId)) {
+				SerializeNode(*node, kind, nodeRecord, blob);
+
+				const size_t recordEnd = beginRecord(CheckpointRecordType::Node, fileId, sizeof(CheckpointNode) + blob.size());
+				append(&nodeRecord, sizeof(CheckpointNode));
+				append(blob.data(), blob.size());
+				block.resize(recordEnd);
+			}
+
+			if (HasSectors(*node)) {
+				appendDirtySectors(*node);
+			}
+		}
+
+		for (const UINT64 fileId : this->loggedFileIds) {
+			if (!newFileIds.contains(fileId)) {
+				block.resize(beginRecord(CheckpointRecordType::Remove, fileId, 0));
+			}
+		}
+
+		if (!block.empty()) {
+			block.resize(beginRecord(CheckpointRecordType::End, blockSequence, 0));
+		}
+	} catch (std::bad_alloc&) {
+		// The taken changes are only found again by logging everything
+		this->logEverything = true;
+		this->needsCompaction = true;
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if (!block.empty()) {
+		LARGE_INTEGER position;
+		position.QuadPart = (LONGLONG)this->logSize;
+
+		if (!SetFilePointerEx(this->logFile, position, nullptr, FILE_BEGIN) || !WriteAll(this->logFile, block.data(), block.size()) || !FlushFileBuffers(this->logFile)) {
+			const NTSTATUS result = FspNtStatusFromWin32(GetLastError());
+
+			// The logged file IDs still describe what the log holds, but the taken changes are lost
+			this->logEverything = true;
+			this->needsCompaction = true;
+			this->OpenLog(false);
+			return result;
+		}
+
+		this->logSize += block.size();
+		this->sequence = blockSequence;
+	}
+
+	this->loggedFileIds = std::move(newFileIds);
+	this->logEverything = false;
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS CheckpointLog::OpenLog(const bool truncate) {
+	if (this->logFile == INVALID_HANDLE_VALUE) {
+		this->logFile = CreateFileW(this->logPath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (this->logFile == INVALID_HANDLE_VALUE) {
+			return FspNtStatusFromWin32(GetLastError());
+		}
+	}
+
+	const UINT64 size = truncate ? 0 : this->logSize;
+	LARGE_INTEGER position;
+	position.QuadPart = (LONGLONG)size;
+	if (!SetFilePointerEx(this->logFile, position, nullptr, FILE_BEGIN) || !SetEndOfFile(this->logFile)) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	this->logSize = size;
+	return STATUS_SUCCESS;
+}
+
+std::vector<std::pair<FileNode*, SnapshotNodeKind>> CheckpointLog::CollectNodes() {
+	std::vector<std::pair<FileNode*, SnapshotNodeKind>> nodes;
+	std::vector<FileNode*> links;
+	std::unordered_set<FileNode*> hiddenNodes;
+
+	const auto rootNode = this->memfs.FindFile(L"\\");
+	if (!rootNode.has_value()) {
+		return nodes;
+	}
+
+	for (FileNode* node : this->memfs.EnumerateDescendants(rootNode.value(), false)) {
+		if (node->IsLink()) {
+			links.push_back(node);
+		} else {
+			nodes.emplace_back(node, SnapshotNodeKind::Named);
+		}
+	}
+
+	for (FileNode* link : links) {
+		FileNode* target = link->GetLinkTarget();
+		if (!this->memfs.HasOwnName(*target) && hiddenNodes.insert(target).second) {
+			nodes.emplace_back(target, SnapshotNodeKind::Hidden);
+		}
+	}
+
+	for (FileNode* link : links) {
+		nodes.emplace_back(link, SnapshotNodeKind::Link);
+	}
+
+	return nodes;
+}
+
+std::unordered_set<UINT64> CheckpointLog::ClearChanges() {
+	std::unordered_set<UINT64> fileIds;
+
+	for (const auto& [node, kind] : this->CollectNodes()) {
+		fileIds.insert(node->fileInfo.IndexNumber);
+		node->TakeMetadataChanged();
+
+		if (!HasSectors(*node)) {
+			continue;
+		}
+
+		SectorNode& sectorNode = node->GetSectorNode();
+		std::shared_lock sectorsLock(sectorNode.SectorsMutex);
+		for (size_t word = 0; word < sectorNode.DirtySectors.size(); word++) {
+			SectorManager::TakeDirtySectors(sectorNode, word);
+		}
+	}
+
+	return fileIds;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "globalincludes.h"
+
+#include "snapshot.h"
+
+namespace Memfs {
+	class MemFs;
+	class FileNode;
+
+	/*
+	 * The checkpoint log is appended next to the snapshot image (<image>.log) and replayed on top of it.
+	 * Each checkpoint is one block: Header | Records | End record. A block without its end record was torn by a crash and ends the replay.
+	 * Records are keyed by the file ID (FSP_FSCTL_FILE_INFO::IndexNumber), which every node, stream and link entry has on its own.
+	 */
+	static constexpr UINT64 CHECKPOINT_BLOCK_MAGIC = 0x4B4C424B50434D4DULL; // "MMCPKBLK"
+
+	struct CheckpointBlockHeader {
+		UINT64 Magic;
+		UINT64 Sequence;
+	};
+
+	enum class CheckpointRecordType : UINT32 {
+		Node = 1, // CheckpointNode, followed by its blob
+		Remove = 2, // Node is no longer reachable
+		Data = 3, // UINT64 file offset, followed by whole sectors
+		End = 4 // FileId holds the sequence of the block
+	};
+
+	struct CheckpointNode {
+		SnapshotNode Node; // Offsets point into the blob behind this struct; MainIndex holds the file ID of the main node or link target, SecurityIndex is unused
+		UINT64 SecurityOffset;
+		UINT64 SecurityLength;
+	};
+
+	struct CheckpointRecord {
+		CheckpointRecordType Type;
+		UINT32 Reserved;
+		UINT64 Size; // Including this header, padded to 8 bytes
+		UINT64 FileId;
+	};
+
+	/**
+	 * \brief Periodically appends the changes since the last checkpoint to the log: Metadata of changed nodes (FileNode::MarkMetadataChanged), removed nodes and dirty sectors.
+	 * The log is compacted into a new snapshot image once it outgrows the image.
+	 */
+	class CheckpointLog {
+	public:
+		CheckpointLog(MemFs& memfs, const DWORD intervalSeconds);
+		~CheckpointLog();
+
+		CheckpointLog(const CheckpointLog& other) = delete;
+		CheckpointLog(CheckpointLog&& other) noexcept = delete;
+		CheckpointLog& operator=(const CheckpointLog& other) = delete;
+		CheckpointLog& operator=(CheckpointLog&& other) noexcept = delete;
+
+		/**
+		 * \brief Applies the complete checkpoints of the log, which are newer than the restored image; Only used before the file system is started
+		 */
+		NTSTATUS Replay();
+		// Starts logging from the current state, which the image and the replayed log already hold
+		NTSTATUS Start();
+		void Stop();
+
+		NTSTATUS Checkpoint();
+		// Writes a new snapshot image and empties the log
+		NTSTATUS Compact();
+
+	private:
+		void Run();
+		NTSTATUS CompactLocked();
+		NTSTATUS AppendCheckpoint();
+		NTSTATUS ApplyBlock(const byte* block, const UINT64 size, std::unordered_map<UINT64, FileNode*>& nodesById, UINT64& maxIndexNumber);
+		// Truncates the log to its valid size, which cuts off a torn checkpoint
+		NTSTATUS OpenLog(const bool truncate);
+		// Collects all reachable nodes: Named nodes, nodes only reachable through links, then the links
+		std::vector<std::pair<FileNode*, SnapshotNodeKind>> CollectNodes();
+		// Clears the changed flags and dirty sectors of all reachable nodes and returns their file IDs
+		std::unordered_set<UINT64> ClearChanges();
+
+		MemFs& memfs;
+		DWORD intervalSeconds;
+		std::wstring logPath;
+		HANDLE logFile{INVALID_HANDLE_VALUE};
+		UINT64 logSize{0}; // End of the last complete checkpoint
+		UINT64 imageSize{0};
+		bool hasImage{false};
+		bool needsCompaction{false};
+		bool logEverything{false}; // After a failed write, the changes it took are only found again by logging all nodes and sectors
+		UINT64 sequence{0};
+
+		// File IDs of all reachable nodes as of the last checkpoint; Those which are gone get a remove record
+		std::unordered_set<UINT64> loggedFileIds;
+		std::mutex checkpointMutex; // Taken before the operation guard
+
+		std::thread thread;
+		std::mutex stopMutex;
+		std::condition_variable stopCondition;
+		bool stopping{false};
+	};
+}
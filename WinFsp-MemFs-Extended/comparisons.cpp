@@ -122,8 +122,107 @@ namespace Memfs::Utils {
 		return res;
 	}
 
-	bool EaLess::operator()(const std::string_view& a, const std::string_view& b) const {
-		return 0 > EaNameCompare(a.data(), b.data());
+	static constexpr wchar_t DOS_STAR = L'<';
+	static constexpr wchar_t DOS_QM = L'>';
+	static constexpr wchar_t DOS_DOT = L'"';
+
+	WildcardMatcher::WildcardMatcher(const std::wstring_view& pattern, const bool caseInsensitive) : pattern(pattern), caseInsensitive(caseInsensitive) {
+		for (wchar_t& c : this->pattern) {
+			c = this->Fold(c);
+		}
+
+		this->states.resize(this->pattern.length() + 1);
+		this->nextStates.resize(this->pattern.length() + 1);
+	}
+
+	wchar_t WildcardMatcher::Fold(const wchar_t c) const {
+		if (!this->caseInsensitive) {
+			return c;
+		}
+
+		return c < 0x80 ? (wchar_t)UpperChar(c) : (wchar_t)towupper(c);
+	}
+
+	bool WildcardMatcher::Matches(const std::wstring_view& name) {
+		// Simulates the pattern as an NFA: State i is active, if the name prefix read so far can be matched by pattern[0, i)
+		const size_t patternLength = this->pattern.length();
+		const size_t lastDot = name.find_last_of(L'.');
+
+		std::ranges::fill(this->states, 0);
+		this->states[0] = 1;
+
+		for (size_t pos = 0;; pos++) {
+			const bool atEnd = pos == name.length();
+			const wchar_t c = atEnd ? L'\0' : this->Fold(name[pos]);
+
+			// Empty matches only advance forward, so one pass suffices
+			for (size_t i = 0; i < patternLength; i++) {
+				if (!this->states[i]) {
+					continue;
+				}
+
+				const wchar_t p = this->pattern[i];
+				if (p == L'*' || p == DOS_STAR || (p == DOS_QM && (atEnd || c == L'.')) || (p == DOS_DOT && atEnd)) {
+					this->states[i + 1] = 1;
+				}
+			}
+
+			if (atEnd) {
+				return this->states[patternLength];
+			}
+
+			std::ranges::fill(this->nextStates, 0);
+			bool anyActive = false;
+
+			for (size_t i = 0; i < patternLength; i++) {
+				if (!this->states[i]) {
+					continue;
+				}
+
+				const wchar_t p = this->pattern[i];
+				size_t next = SIZE_MAX;
+
+				if (p == L'*') {
+					next = i;
+				} else if (p == DOS_STAR) {
+					// DOS_STAR consumes everything except the final dot of the name
+					if (pos != lastDot) {
+						next = i;
+					}
+				} else if (p == L'?') {
+					next = i + 1;
+				} else if (p == DOS_QM) {
+					if (c != L'.') {
+						next = i + 1;
+					}
+				} else if (p == DOS_DOT) {
+					if (c == L'.') {
+						next = i + 1;
+					}
+				} else if (p == c) {
+					next = i + 1;
+				}
+
+				if (next != SIZE_MAX) {
+					this->nextStates[next] = 1;
+					anyActive = true;
+				}
+			}
+
+			if (!anyActive) {
+				return false;
+			}
+
+			std::swap(this->states, this->nextStates);
+		}
+	}
+
+	bool WildcardMatcher::HasWildcards(const std::wstring_view& pattern) {
+		return pattern.find_first_of(L"*?<>\"") != std::wstring_view::npos;
+	}
+
+	bool WildcardMatcher::MatchesAll(const std::wstring_view& pattern) {
+		return pattern == L"*";
 	}
 
 	bool FileLess::operator()(const std::wstring_view& a, const std::wstring_view& b) const {
@@ -7,10 +7,26 @@ namespace Memfs::Utils {
 	BOOLEAN FileNameHasPrefix(const PCWSTR a, const PCWSTR b, const BOOLEAN caseInsensitive);
 	int EaNameCompare(const PCSTR a, const PCSTR b);
 
-	struct EaLess {
-		using is_transparent = std::true_type;
+	/**
+	 * \brief Matches file names against a Windows wildcard expression (*, ?, DOS_STAR, DOS_QM and DOS_DOT) with the semantics of FsRtlIsNameInExpression
+	 */
+	class WildcardMatcher {
+	public:
+		WildcardMatcher(const std::wstring_view& pattern, const bool caseInsensitive);
 
-		bool operator()(const std::string_view& a, const std::string_view& b) const;
+		[[nodiscard]] bool Matches(const std::wstring_view& name);
+
+		[[nodiscard]] static bool HasWildcards(const std::wstring_view& pattern);
+		[[nodiscard]] static bool MatchesAll(const std::wstring_view& pattern);
+
+	private:
+		[[nodiscard]] wchar_t Fold(const wchar_t c) const;
+
+		std::wstring pattern;
+		bool caseInsensitive;
+
+		// Active states of the pattern automaton, reused between matches to avoid allocations
+		std::vector<UINT8> states, nextStates;
 	};
 
 	struct FileLess {
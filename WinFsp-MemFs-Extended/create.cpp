@@ -6,11 +6,8 @@
 
 using namespace Memfs;
 
-MemFs::MemFs(ULONG flags, UINT64 maxFsSize, const wchar_t* fileSystemName, const wchar_t* volumePrefix, const wchar_t* volumeLabel, const wchar_t* rootSddl) : maxFsSize(maxFsSize) {
-	if (MEMFS_SINGLETON != nullptr) {
-		throw std::runtime_error("There can only be one memfs.");
-	}
-
+MemFs::MemFs(ULONG flags, UINT64 maxFsSize, const wchar_t* fileSystemName, const wchar_t* volumePrefix, const wchar_t* volumeLabel, const wchar_t* rootSddl) : maxFsSize(maxFsSize), sectors(this->metadata), securityDescriptors(this->metadata),
+                                                                                                                                                                fileIds(this->metadata), negativeLookups(!!(flags & MemfsCaseInsensitive)) {
 	const bool caseInsensitive = !!(flags & MemfsCaseInsensitive);
 	const bool flushAndPurgeOnCleanup = !!(flags & MemfsFlushAndPurgeOnCleanup);
 	const bool supportsPosixUnlinkRename = !(flags & MemfsLegacyUnlinkRename);
@@ -36,6 +33,7 @@ MemFs::MemFs(ULONG flags, UINT64 maxFsSize, const wchar_t* fileSystemName, const
 	volumeParams.Version = sizeof(FSP_FSCTL_VOLUME_PARAMS);
 	volumeParams.SectorSize = MEMFS_SECTOR_SIZE;
 	volumeParams.SectorsPerAllocationUnit = MEMFS_SECTORS_PER_ALLOCATION_UNIT;
+	volumeParams.MaxComponentLength = MEMFS_MAX_COMPONENT_LENGTH;
 	volumeParams.VolumeCreationTime = Utils::GetSystemTime();
 	volumeParams.VolumeSerialNumber = static_cast<UINT32>(Utils::GetSystemTime() / (1010000ULL * 1000ULL));
 	volumeParams.FileInfoTimeout = 15000; // Use cache manager; Timeout is in milliseconds
@@ -49,6 +47,7 @@ MemFs::MemFs(ULONG flags, UINT64 maxFsSize, const wchar_t* fileSystemName, const
 	volumeParams.PostCleanupWhenModifiedOnly = true;
 	volumeParams.PostDispositionWhenNecessaryOnly = true;
 	volumeParams.PassQueryDirectoryFileName = true;
+	volumeParams.PassQueryDirectoryPattern = true;
 	volumeParams.ExtendedAttributes = true;
 	volumeParams.FlushAndPurgeOnCleanup = flushAndPurgeOnCleanup;
 	volumeParams.DeviceControl = 1;
@@ -82,13 +81,11 @@ MemFs::MemFs(ULONG flags, UINT64 maxFsSize, const wchar_t* fileSystemName, const
 
 	// Create root directory.
 
-	FileNode rootNodeVal(L"\\");
-	rootNode = &rootNodeVal;
+	FileNodePtr rootNodeVal = FileNode::Create(L"\\", this->metadata);
+	rootNode = rootNodeVal.get();
 
 	rootNode->fileInfo.FileAttributes = FILE_ATTRIBUTE_DIRECTORY;
-	rootNode->fileSecurity = DynamicStruct<SECURITY_DESCRIPTOR>(rootSecuritySize);
-
-	memcpy_s(rootNode->fileSecurity.Struct(), rootNode->fileSecurity.ByteSize(), rootSecurity, rootSecuritySize);
+	rootNode->fileSecurity = this->securityDescriptors.Intern(rootSecurity, rootSecuritySize);
 
 	const auto [insertStatus, _] = this->InsertNode(std::move(rootNodeVal));
 	status = insertStatus;
@@ -99,18 +96,26 @@ MemFs::MemFs(ULONG flags, UINT64 maxFsSize, const wchar_t* fileSystemName, const
 	}
 
 	LocalFree(rootSecurity);
-	MEMFS_SINGLETON = this;
+
+	this->memoryMonitor.AddPressureHandler([this](const MemoryPressureLevel level) {
+		this->ReclaimMemory(level);
+	});
+	this->memoryMonitor.Start();
 }
 
 MemFs::~MemFs() {
 	this->Destroy();
-	
-	if (MEMFS_SINGLETON == this) {
-		MEMFS_SINGLETON = nullptr;
-	}
+	this->negativeLookups.Clear(); // Releases the referenced parents while the sector manager is still reachable
+	this->ReleaseDirectoryBuffers();
 }
 
 void MemFs::Destroy() {
+	this->memoryMonitor.Stop(); // Reclaiming takes the operation guard of the file system
+
+	if (this->checkpoints) {
+		this->checkpoints->Stop(); // Checkpoints take the operation guard of the file system
+	}
+
 	if (this->fileSystem) {
 		FspFileSystemDelete(this->fileSystem.get());
 		this->fileSystem.release();
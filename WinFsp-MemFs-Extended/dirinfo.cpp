@@ -1,15 +1,82 @@
 #include "memfs-interface.h"
 #include "utils.h"
+#include "comparisons.h"
 
 namespace Memfs::Interface {
-	NTSTATUS ReadDirectory(FSP_FILE_SYSTEM* fileSystem,
-	                       PVOID fileNode0, PWSTR pattern, PWSTR marker,
-	                       PVOID buffer, ULONG length, PULONG pBytesTransferred) {
-		assert(nullptr == pattern);
+	// One aligned dir info and its entry in the sorted index of the buffer; WinFsp grows the buffer by doubling, so it may hold more
+	static size_t DirectoryBufferEntryBytes(const std::wstring_view& fileName) {
+		return FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof(FSP_FSCTL_DIR_INFO) + fileName.length() * sizeof(WCHAR)) + sizeof(ULONG);
+	}
 
-		MemFs* memfs = GetMemFs(fileSystem);
-		FileNode* fileNode = GetFileNode(fileNode0);
+	static NTSTATUS FillDirectoryBuffer(MemFs* memfs, FileNode* fileNode, DirectoryBuffer& dirBuffer) {
+		NTSTATUS result = STATUS_SUCCESS;
+		size_t bytes = 0;
+
+		if (L'\0' != fileNode->fileName[1]) {
+			/* if this is not the root directory, add the dot entries */
+
+			auto const [parentResult, parent] = memfs->FindParent(fileNode->fileName);
+			if (!parent.has_value()) {
+				return parentResult;
+			}
+			const FileNode& parentNode = parent.value();
+
+			if (!CompatFillDirectoryBuffer(fileNode, L".", dirBuffer, &result) ||
+				!CompatFillDirectoryBuffer(&parentNode, L"..", dirBuffer, &result)) {
+				return result;
+			}
+			bytes += DirectoryBufferEntryBytes(L".") + DirectoryBufferEntryBytes(L"..");
+		}
+
+		memfs->EnumerateDirChildren(*fileNode, nullptr, [&](FileNode* child) {
+			const std::wstring_view childName = Utils::PathSuffix(child->fileName).Suffix;
+			bytes += DirectoryBufferEntryBytes(childName);
+			return CompatFillDirectoryBuffer(child, childName, dirBuffer, &result);
+		});
+
+		dirBuffer.SetFilledBytes(bytes);
+		return result;
+	}
+
+	static NTSTATUS ReadDirectoryExact(MemFs* memfs, FileNode* fileNode, const std::wstring_view& name, PWSTR marker,
+	                                   PVOID buffer, ULONG length, PULONG pBytesTransferred) {
+		// A continuation means that the only possible entry has already been returned
+		if (marker == nullptr) {
+			const bool isRoot = L'\0' == fileNode->fileName[1];
+			const FileNode* match = nullptr;
+			std::wstring_view matchName = name;
+
+			if (name == L"." || name == L"..") {
+				if (!isRoot) {
+					auto const [parentResult, parent] = memfs->FindParent(fileNode->fileName);
+					if (!parent.has_value()) {
+						return parentResult;
+					}
+
+					match = name.length() == 1 ? fileNode : &parent.value().get();
+				}
+			} else if (name.find_first_of(L"\\:") == std::wstring_view::npos && fileNode->fileName.length() + name.length() + 1 < MEMFS_MAX_PATH) {
+				const std::wstring childName = fileNode->fileName.ToString() + (isRoot ? L"" : L"\\") + std::wstring(name);
+
+				const auto childOpt = memfs->FindFile(childName);
+				if (childOpt.has_value()) {
+					match = &childOpt.value().get();
+					matchName = Utils::PathSuffix(match->fileName).Suffix;
+				}
+			}
+
+			if (match != nullptr && !CompatAddDirInfo(match, matchName, buffer, length, pBytesTransferred)) {
+				return STATUS_SUCCESS; // Without end
+			}
+		}
+
+		FspFileSystemAddDirInfo(nullptr, buffer, length, pBytesTransferred); // List end
+		return STATUS_SUCCESS;
+	}
 
+	// Emits the entries directly, so that a continuation can resume from the enumeration cursor; Without a matcher, every entry is emitted
+	static NTSTATUS ReadDirectoryEntries(MemFs* memfs, FileNode* fileNode, Utils::WildcardMatcher* matcher, PWSTR marker,
+	                                     PVOID buffer, ULONG length, PULONG pBytesTransferred) {
 		if (L'\0' != fileNode->fileName[1]) {
 			/* if this is not the root directory, add the dot entries */
 
@@ -17,32 +84,97 @@ namespace Memfs::Interface {
 			if (!parent.has_value()) {
 				return parentResult;
 			}
-			FileNode& parentNode = parent.value();
+			const FileNode& parentNode = parent.value();
+
+			const bool afterDot = marker != nullptr && L'.' == marker[0] && L'\0' == marker[1];
+			const bool afterDotDot = marker != nullptr && L'.' == marker[0] && L'.' == marker[1] && L'\0' == marker[2];
 
-			if (marker == nullptr) {
+			if (marker == nullptr && (matcher == nullptr || matcher->Matches(L"."))) {
 				if (!CompatAddDirInfo(fileNode, L".", buffer, length, pBytesTransferred)) {
 					return STATUS_SUCCESS;
 				}
 			}
 
-			if (marker == nullptr || (L'.' == marker[0] && L'\0' == marker[1])) {
+			if ((marker == nullptr || afterDot) && (matcher == nullptr || matcher->Matches(L".."))) {
 				if (!CompatAddDirInfo(&parentNode, L"..", buffer, length, pBytesTransferred)) {
 					return STATUS_SUCCESS;
 				}
+			}
+
+			if (afterDot || afterDotDot) {
 				marker = nullptr;
 			}
 		}
 
-		for (const auto& child : memfs->EnumerateDirChildren(*fileNode, marker)) {
-			if (!CompatAddDirInfo(child, nullptr, buffer, length, pBytesTransferred)) {
-				return STATUS_SUCCESS; // Without end
+		const bool listEnded = memfs->EnumerateDirChildren(*fileNode, marker, [&](FileNode* child) {
+			const std::wstring_view childName = Utils::PathSuffix(child->fileName).Suffix;
+			if (matcher != nullptr && !matcher->Matches(childName)) {
+				return true;
 			}
+
+			return !!CompatAddDirInfo(child, childName, buffer, length, pBytesTransferred);
+		});
+		if (!listEnded) {
+			return STATUS_SUCCESS; // Without end
 		}
 
 		FspFileSystemAddDirInfo(nullptr, buffer, length, pBytesTransferred); // List end
 		return STATUS_SUCCESS;
 	}
 
+	static NTSTATUS ReadDirectoryFiltered(MemFs* memfs, FileNode* fileNode, const std::wstring_view& pattern, PWSTR marker,
+	                                      PVOID buffer, ULONG length, PULONG pBytesTransferred) {
+		if (!Utils::WildcardMatcher::HasWildcards(pattern)) {
+			return ReadDirectoryExact(memfs, fileNode, pattern, marker, buffer, length, pBytesTransferred);
+		}
+
+		Utils::WildcardMatcher matcher(pattern, memfs->IsCaseInsensitive());
+		return ReadDirectoryEntries(memfs, fileNode, &matcher, marker, buffer, length, pBytesTransferred);
+	}
+
+	NTSTATUS ReadDirectory(FSP_FILE_SYSTEM* fileSystem,
+	                       PVOID fileNode0, PWSTR pattern, PWSTR marker,
+	                       PVOID buffer, ULONG length, PULONG pBytesTransferred) {
+		MemFs* memfs = GetMemFs(fileSystem);
+		FileNode* fileNode = GetFileNode(fileNode0);
+
+		if (pattern != nullptr && !Utils::WildcardMatcher::MatchesAll(pattern)) {
+			return ReadDirectoryFiltered(memfs, fileNode, pattern, marker, buffer, length, pBytesTransferred);
+		}
+
+		DirectoryBuffer* dirBufferPtr;
+		try {
+			dirBufferPtr = &fileNode->GetDirectoryBuffer();
+		} catch (...) {
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		DirectoryBuffer& dirBuffer = *dirBufferPtr;
+		// The listing is only rebuilt after a change in the directory, otherwise it is served from the sorted buffer
+		// Every batch of an unfiltered enumeration goes through the buffer, so the marker always refers to the same order
+		const long generation = dirBuffer.Generation;
+		NTSTATUS result = STATUS_SUCCESS;
+
+		if (FspFileSystemAcquireDirectoryBuffer(&dirBuffer.Buffer, generation != dirBuffer.FilledGeneration, &result)) {
+			result = FillDirectoryBuffer(memfs, fileNode, dirBuffer);
+			FspFileSystemReleaseDirectoryBuffer(&dirBuffer.Buffer);
+
+			if (NT_SUCCESS(result)) {
+				InterlockedExchange(&dirBuffer.FilledGeneration, generation);
+				memfs->TrackDirectoryBuffer(*fileNode);
+			} else {
+				dirBuffer.Invalidate();
+			}
+		}
+
+		if (!NT_SUCCESS(result)) {
+			return result;
+		}
+
+		FspFileSystemReadDirectoryBuffer(&dirBuffer.Buffer, marker, buffer, length, pBytesTransferred);
+		return STATUS_SUCCESS;
+	}
+
 	NTSTATUS GetDirInfoByName(FSP_FILE_SYSTEM* fileSystem,
 	                          PVOID parentNode0, PWSTR fileName, FSP_FSCTL_DIR_INFO* dirInfo) {
 		MemFs* memfs = GetMemFs(fileSystem);
@@ -55,7 +187,7 @@ namespace Memfs::Interface {
 		}
 
 		const bool needsSlash = 1 < parentLength;
-		std::wstring fileNameStr = parentNode->fileName + (needsSlash ? L"\\" : L"") + fileName;
+		const std::wstring fileNameStr = parentNode->fileName.ToString() + (needsSlash ? L"\\" : L"") + fileName;
 
 		const auto fileNodeOpt = memfs->FindFile(fileNameStr);
 		if (!fileNodeOpt.has_value()) {
@@ -64,11 +196,10 @@ namespace Memfs::Interface {
 		const FileNode& fileNode = fileNodeOpt.value();
 
 		const Utils::SuffixView suffixView = Utils::PathSuffix(fileNode.fileName);
-		fileNameStr = suffixView.Suffix;
 
-		dirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + fileNameStr.length() * sizeof(WCHAR));
-		dirInfo->FileInfo = fileNode.fileInfo;
-		memcpy(dirInfo->FileNameBuf, fileNameStr.c_str(), dirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
+		dirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + suffixView.Suffix.length() * sizeof(WCHAR));
+		dirInfo->FileInfo = fileNode.ResolveLink().fileInfo;
+		memcpy(dirInfo->FileNameBuf, suffixView.Suffix.data(), dirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
 
 		return STATUS_SUCCESS;
 	}
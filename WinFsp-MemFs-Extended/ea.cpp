@@ -1,5 +1,3 @@
-#include <ranges>
-
 #include "memfs-interface.h"
 
 namespace Memfs::Interface {
@@ -8,15 +6,12 @@ namespace Memfs::Interface {
 	                      PFILE_FULL_EA_INFORMATION ea, ULONG eaLength, PULONG pBytesTransferred) {
 		FileNode* fileNode = GetFileNode(fileNode0);
 
-		const auto eaMapOpt = fileNode->GetEaMapOpt();
-		if (eaMapOpt.has_value()) {
-			const auto& eaMap = eaMapOpt.value().get();
-
-			for (const auto eaEntry : eaMap | std::views::values) {
-				if (!FspFileSystemAddEa((PFILE_FULL_EA_INFORMATION)eaEntry.Struct(), ea, eaLength, pBytesTransferred)) {
-					return STATUS_SUCCESS; // Without end
-				}
-			}
+		// The attributes are already packed, so they are handed out without any conversion
+		const bool listEnded = fileNode->GetEas().ForEach([&](const FILE_FULL_EA_INFORMATION* eaEntry) {
+			return FspFileSystemAddEa((PFILE_FULL_EA_INFORMATION)eaEntry, ea, eaLength, pBytesTransferred);
+		});
+		if (!listEnded) {
+			return STATUS_SUCCESS; // Without end
 		}
 
 		FspFileSystemAddEa(nullptr, ea, eaLength, pBytesTransferred); // List end
@@ -27,13 +22,23 @@ namespace Memfs::Interface {
 	                      PVOID fileNode0,
 	                      PFILE_FULL_EA_INFORMATION ea, ULONG eaLength,
 	                      FSP_FSCTL_FILE_INFO* fileInfo) {
+		MemFs* memfs = GetMemFs(fileSystem);
 		FileNode* fileNode = GetFileNode(fileNode0);
 
+		if (IsReadOnly(memfs, *fileNode)) {
+			return STATUS_MEDIA_WRITE_PROTECTED;
+		}
+
 		const NTSTATUS result = FspFileSystemEnumerateEa(fileSystem, CompatFspFileNodeSetEa, fileNode, ea, eaLength);
 		if (!NT_SUCCESS(result)) {
 			return result;
 		}
 
+		{
+			// WinFsp does not guard this operation, but the parent lookup reads the file map
+			OperationGuard guard(fileSystem, false);
+			memfs->InvalidateParentDirBuffer(*fileNode);
+		}
 		fileNode->CopyFileInfo(fileInfo);
 		return STATUS_SUCCESS;
 	}
@@ -0,0 +1,230 @@
+#include <climits>
+
+#include "globalincludes.h"
+#include "eastorage.h"
+
+using namespace Memfs;
+
+static constexpr size_t EA_ALIGNMENT = sizeof(ULONG);
+
+static size_t AlignEaOffset(const size_t offset) {
+	return (offset + EA_ALIGNMENT - 1) & ~(EA_ALIGNMENT - 1);
+}
+
+static size_t EaEntrySize(const FILE_FULL_EA_INFORMATION* ea) {
+	return FIELD_OFFSET(FILE_FULL_EA_INFORMATION, EaName) + ea->EaNameLength + 1 + ea->EaValueLength;
+}
+
+// Well-known attributes, which WSL sets on nearly every file; Fixed-size values without flags are stored natively
+struct LxssField {
+	std::string_view Name;
+	USHORT ValueLength;
+};
+
+static constexpr LxssField LXSS_FIELDS[] = {
+	{"$LXUID", sizeof(ULONG)},
+	{"$LXGID", sizeof(ULONG)},
+	{"$LXMOD", sizeof(ULONG)},
+	{"$LXDEV", 2 * sizeof(ULONG)}, // Major and minor device number
+};
+
+static constexpr size_t LXSS_MAX_NAME_LENGTH = 6;
+
+struct LxssEaBuffer {
+	alignas(FILE_FULL_EA_INFORMATION) byte Bytes[FIELD_OFFSET(FILE_FULL_EA_INFORMATION, EaName) + LXSS_MAX_NAME_LENGTH + 1 + 2 * sizeof(ULONG)];
+
+	FILE_FULL_EA_INFORMATION* Build(const LxssField& field, const byte* value) {
+		FILE_FULL_EA_INFORMATION* ea = reinterpret_cast<FILE_FULL_EA_INFORMATION*>(this->Bytes);
+
+		ea->NextEntryOffset = 0;
+		ea->Flags = 0;
+		ea->EaNameLength = (UCHAR)field.Name.length();
+		ea->EaValueLength = field.ValueLength;
+		memcpy(ea->EaName, field.Name.data(), field.Name.length());
+		ea->EaName[field.Name.length()] = '\0';
+		memcpy(ea->EaName + field.Name.length() + 1, value, field.ValueLength);
+
+		return ea;
+	}
+};
+
+static std::optional<size_t> FindLxssField(const std::string_view& foldedName) {
+	for (size_t i = 0; i < std::size(LXSS_FIELDS); i++) {
+		if (LXSS_FIELDS[i].Name == foldedName) {
+			return i;
+		}
+	}
+
+	return {};
+}
+
+static char FoldEaChar(const char c) {
+	/* EA names are always case-insensitive in MEMFS (to be inline with NTFS) */
+	return 'a' <= c && c <= 'z' ? (char)(c - 'a' + 'A') : c;
+}
+
+FILE_FULL_EA_INFORMATION* EaStorage::EntryAt(const size_t offset) {
+	return reinterpret_cast<FILE_FULL_EA_INFORMATION*>(this->packed.data() + offset);
+}
+
+const FILE_FULL_EA_INFORMATION* EaStorage::First() const {
+	if (this->packed.empty()) {
+		return nullptr;
+	}
+
+	return reinterpret_cast<const FILE_FULL_EA_INFORMATION*>(this->packed.data());
+}
+
+const FILE_FULL_EA_INFORMATION* EaStorage::Next(const FILE_FULL_EA_INFORMATION* ea) {
+	if (ea->NextEntryOffset == 0) {
+		return nullptr;
+	}
+
+	return reinterpret_cast<const FILE_FULL_EA_INFORMATION*>(reinterpret_cast<const byte*>(ea) + ea->NextEntryOffset);
+}
+
+std::optional<size_t> EaStorage::Find(const std::string_view& foldedName) {
+	for (const FILE_FULL_EA_INFORMATION* entry = this->First(); entry != nullptr; entry = Next(entry)) {
+		if (entry->EaNameLength == foldedName.length() && 0 == memcmp(entry->EaName, foldedName.data(), foldedName.length())) {
+			return reinterpret_cast<const byte*>(entry) - this->packed.data();
+		}
+	}
+
+	return {};
+}
+
+void EaStorage::Erase(const size_t offset) {
+	const FILE_FULL_EA_INFORMATION* entry = this->EntryAt(offset);
+
+	if (entry->NextEntryOffset != 0) {
+		// The following entries are chained relatively, so they can simply be moved down
+		const auto begin = this->packed.begin() + (ptrdiff_t)offset;
+		this->packed.erase(begin, begin + entry->NextEntryOffset);
+		return;
+	}
+
+	// The last entry is removed, so its predecessor becomes the last one
+	FILE_FULL_EA_INFORMATION* previous = nullptr;
+	for (size_t previousOffset = 0; previousOffset != offset; previousOffset += previous->NextEntryOffset) {
+		previous = this->EntryAt(previousOffset);
+	}
+
+	if (previous != nullptr) {
+		previous->NextEntryOffset = 0;
+	}
+	this->packed.resize(offset);
+}
+
+LONG EaStorage::Set(const FILE_FULL_EA_INFORMATION* ea) {
+	LONG sizeDifference = 0;
+
+	char foldedNameBuf[UCHAR_MAX + 1];
+	for (UCHAR i = 0; i < ea->EaNameLength; i++) {
+		foldedNameBuf[i] = FoldEaChar(ea->EaName[i]);
+	}
+	const std::string_view foldedName(foldedNameBuf, ea->EaNameLength);
+
+	const std::optional<size_t> lxssIndex = FindLxssField(foldedName);
+	const bool storeAsLxss = lxssIndex.has_value() && 0 == ea->Flags && LXSS_FIELDS[lxssIndex.value()].ValueLength == ea->EaValueLength;
+
+	// Reserve before anything is removed, so that a failed allocation leaves the old attribute intact
+	const size_t entrySize = EaEntrySize(ea);
+	if (0 != ea->EaValueLength && !storeAsLxss) {
+		this->packed.reserve(AlignEaOffset(this->packed.size()) + entrySize);
+	}
+
+	if (lxssIndex.has_value() && 0 != (this->lxssPresent & (1 << lxssIndex.value()))) {
+		LxssEaBuffer existing;
+		sizeDifference -= (LONG)FspFileSystemGetEaPackedSize(existing.Build(LXSS_FIELDS[lxssIndex.value()], this->lxssValues[lxssIndex.value()]));
+
+		this->lxssPresent &= ~(1 << lxssIndex.value());
+	}
+
+	const std::optional<size_t> existingOffset = this->Find(foldedName);
+	if (existingOffset.has_value()) {
+		FILE_FULL_EA_INFORMATION* existing = this->EntryAt(existingOffset.value());
+
+		sizeDifference -= (LONG)FspFileSystemGetEaPackedSize(existing);
+		if (0 != (existing->Flags & FILE_NEED_EA)) {
+			this->needEaCount--;
+		}
+
+		this->Erase(existingOffset.value());
+	}
+
+	if (0 != ea->EaValueLength && storeAsLxss) {
+		const LxssField& field = LXSS_FIELDS[lxssIndex.value()];
+		memcpy(this->lxssValues[lxssIndex.value()], ea->EaName + ea->EaNameLength + 1, field.ValueLength);
+		this->lxssPresent |= 1 << lxssIndex.value();
+
+		LxssEaBuffer added;
+		sizeDifference += (LONG)FspFileSystemGetEaPackedSize(added.Build(field, this->lxssValues[lxssIndex.value()]));
+	} else if (0 != ea->EaValueLength) {
+		const size_t lastOffset = this->packed.empty() ? SIZE_MAX : [this] {
+			size_t offset = 0;
+			for (const FILE_FULL_EA_INFORMATION* entry = this->First(); entry->NextEntryOffset != 0; entry = Next(entry)) {
+				offset += entry->NextEntryOffset;
+			}
+			return offset;
+		}();
+		const size_t newOffset = AlignEaOffset(this->packed.size());
+
+		this->packed.resize(newOffset + entrySize);
+
+		FILE_FULL_EA_INFORMATION* newEntry = this->EntryAt(newOffset);
+		memcpy(newEntry, ea, entrySize);
+		memcpy(newEntry->EaName, foldedName.data(), foldedName.length());
+		newEntry->NextEntryOffset = 0;
+
+		if (lastOffset != SIZE_MAX) {
+			this->EntryAt(lastOffset)->NextEntryOffset = (ULONG)(newOffset - lastOffset);
+		}
+
+		sizeDifference += (LONG)FspFileSystemGetEaPackedSize(newEntry);
+		if (0 != (newEntry->Flags & FILE_NEED_EA)) {
+			this->needEaCount++;
+		}
+	}
+
+	return sizeDifference;
+}
+
+void EaStorage::Clear() {
+	this->packed.clear();
+	this->packed.shrink_to_fit();
+	this->needEaCount = 0;
+	this->lxssPresent = 0;
+}
+
+bool EaStorage::NeedsEa() const {
+	return this->needEaCount != 0;
+}
+
+bool EaStorage::IsEmpty() const {
+	return this->packed.empty() && 0 == this->lxssPresent;
+}
+
+bool EaStorage::ForEach(const std::function<bool(const FILE_FULL_EA_INFORMATION*)>& function) const {
+	for (const FILE_FULL_EA_INFORMATION* entry = this->First(); entry != nullptr; entry = Next(entry)) {
+		if (!function(entry)) {
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < std::size(LXSS_FIELDS); i++) {
+		if (0 == (this->lxssPresent & (1 << i))) {
+			continue;
+		}
+
+		LxssEaBuffer synthesized;
+		if (!function(synthesized.Build(LXSS_FIELDS[i], this->lxssValues[i]))) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+size_t EaStorage::ByteSize() const {
+	return this->packed.capacity();
+}
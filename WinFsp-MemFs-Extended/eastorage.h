@@ -0,0 +1,56 @@
+#pragma once
+
+#include "globalincludes.h"
+
+namespace Memfs {
+	/**
+	 * \brief Extended attributes of a node, packed into one buffer of chained FILE_FULL_EA_INFORMATION entries.
+	 * Names are stored in upper case like on NTFS, so that lookups are plain memory comparisons.
+	 * The WSL metadata attributes ($LXUID, $LXGID, $LXMOD and $LXDEV) are kept in fixed fields and synthesized on enumeration.
+	 */
+	class EaStorage {
+	public:
+		EaStorage() = default;
+		~EaStorage() = default;
+
+		EaStorage(const EaStorage& other) = default;
+		EaStorage(EaStorage&& other) noexcept = default;
+		EaStorage& operator=(const EaStorage& other) = default;
+		EaStorage& operator=(EaStorage&& other) noexcept = default;
+
+		/**
+		 * \brief Adds, replaces or (with an empty value) removes an extended attribute
+		 * \param ea Single extended attribute
+		 * \return Change of the packed size of all extended attributes
+		 */
+		LONG Set(const FILE_FULL_EA_INFORMATION* ea);
+		void Clear();
+
+		[[nodiscard]] bool NeedsEa() const;
+		[[nodiscard]] bool IsEmpty() const;
+		[[nodiscard]] size_t ByteSize() const;
+
+		/**
+		 * \brief Calls the function for every extended attribute, including the synthesized WSL metadata
+		 * \return False if the function stopped the enumeration
+		 */
+		bool ForEach(const std::function<bool(const FILE_FULL_EA_INFORMATION*)>& function) const;
+
+	private:
+		static constexpr size_t LXSS_FIELD_COUNT = 4;
+		static constexpr size_t LXSS_MAX_VALUE_LENGTH = 2 * sizeof(ULONG);
+
+		[[nodiscard]] const FILE_FULL_EA_INFORMATION* First() const;
+		[[nodiscard]] static const FILE_FULL_EA_INFORMATION* Next(const FILE_FULL_EA_INFORMATION* ea);
+
+		[[nodiscard]] FILE_FULL_EA_INFORMATION* EntryAt(const size_t offset);
+		[[nodiscard]] std::optional<size_t> Find(const std::string_view& foldedName);
+		void Erase(const size_t offset);
+
+		std::vector<byte> packed;
+		UINT32 needEaCount{0}; // Number of entries with FILE_NEED_EA
+
+		byte lxssValues[LXSS_FIELD_COUNT][LXSS_MAX_VALUE_LENGTH]{};
+		UINT8 lxssPresent{0}; // Bit mask of the set WSL metadata fields
+	};
+}
@@ -16,6 +16,10 @@ namespace Memfs::Interface {
 			return STATUS_OBJECT_NAME_INVALID;
 		}
 
+		if (memfs->IsInVolumeSnapshots(fileName0)) {
+			return STATUS_MEDIA_WRITE_PROTECTED;
+		}
+
 		if (createOptions & FILE_DIRECTORY_FILE) {
 			allocationSize = 0;
 		}
@@ -35,7 +39,7 @@ namespace Memfs::Interface {
 		// if (MemfsFileNodeMapCount(Memfs->FileNodeMap) >= Memfs->MaxFileNodes)
 		//    return STATUS_CANNOT_MAKE;
 
-		if (allocationSize > memfs->CalculateAvailableTotalSize()) {
+		if (allocationSize > memfs->CalculateAvailableTotalSize() || memfs->IsMemoryCritical()) {
 			return STATUS_DISK_FULL;
 		}
 
@@ -51,17 +55,23 @@ namespace Memfs::Interface {
 				return STATUS_OBJECT_NAME_INVALID;
 			}
 
-			fileName = parentNode.fileName + (bSlashLength ? L"\\" : L"") + std::wstring(pathView.Suffix);
+			fileName = parentNode.fileName.ToString() + (bSlashLength ? L"\\" : L"") + std::wstring(pathView.Suffix);
 		} else {
 			fileName = fileName0;
 		}
 
 
 		try {
-			FileNode fileNode(fileName);
+			FileNodePtr fileNodePtr = FileNode::Create(fileName, memfs->GetMetadata());
+			FileNode& fileNode = *fileNodePtr;
 
 			const auto mainNode = memfs->FindMainFromStream(fileName);
 			if (mainNode.has_value()) {
+				// Streams of a hard linked file would only be reachable through one of its names
+				if (mainNode.value()->IsLink() || !mainNode.value()->GetLinks().empty()) {
+					return STATUS_ACCESS_DENIED;
+				}
+
 				fileNode.SetMainNode(mainNode.value());
 			}
 
@@ -70,9 +80,7 @@ namespace Memfs::Interface {
 			if (securityDescriptor != nullptr) {
 				try {
 					const size_t securityDescriptorLength = GetSecurityDescriptorLength(securityDescriptor);
-					fileNode.fileSecurity = DynamicStruct<SECURITY_DESCRIPTOR>(securityDescriptorLength);
-
-					memcpy_s(fileNode.fileSecurity.Struct(), fileNode.fileSecurity.ByteSize(), securityDescriptor, securityDescriptorLength);
+					fileNode.fileSecurity = memfs->GetSecurityDescriptors().Intern(securityDescriptor, securityDescriptorLength);
 				} catch (...) {
 					memfs->RemoveNode(fileNode);
 					return STATUS_INSUFFICIENT_RESOURCES;
@@ -92,12 +100,12 @@ namespace Memfs::Interface {
 
 				if (extraBufferIsReparsePoint) {
 					try {
-						fileNode.reparseData = DynamicStruct<byte>(extraLength);
+						DynamicStruct<byte> reparseData(extraLength);
+						memcpy_s(reparseData.Struct(), reparseData.ByteSize(), extraBuffer, extraLength);
+						fileNode.SetReparseData(std::move(reparseData));
 
 						fileNode.fileInfo.FileAttributes |= FILE_ATTRIBUTE_REPARSE_POINT;
 						fileNode.fileInfo.ReparseTag = *(PULONG)extraBuffer;
-
-						memcpy_s(fileNode.reparseData.Struct(), fileNode.reparseData.ByteSize(), extraBuffer, extraLength);
 					} catch (...) {
 						memfs->RemoveNode(fileNode);
 						return STATUS_INSUFFICIENT_RESOURCES;
@@ -107,13 +115,18 @@ namespace Memfs::Interface {
 
 			fileNode.fileInfo.AllocationSize = allocationSize;
 			if (0 != fileNode.fileInfo.AllocationSize) {
-				if (!memfs->GetSectorManager().ReAllocate(fileNode.GetSectorNode(), fileNode.fileInfo.AllocationSize)) {
+				try {
+					if (!memfs->GetSectorManager().ReAllocate(fileNode.GetSectorNode(), fileNode.fileInfo.AllocationSize)) {
+						memfs->RemoveNode(fileNode);
+						return STATUS_INSUFFICIENT_RESOURCES;
+					}
+				} catch (...) {
 					memfs->RemoveNode(fileNode);
 					return STATUS_INSUFFICIENT_RESOURCES;
 				}
 			}
 
-			auto [insertResult, newFileNode] = memfs->InsertNode(std::move(fileNode));
+			auto [insertResult, newFileNode] = memfs->InsertNode(std::move(fileNodePtr));
 			result = insertResult;
 
 			if (!NT_SUCCESS(result)) {
@@ -139,6 +152,8 @@ namespace Memfs::Interface {
 			return STATUS_SUCCESS;
 		} catch (FileNameTooLongException& ex) {
 			return STATUS_OBJECT_NAME_INVALID;
+		} catch (std::bad_alloc&) {
+			return STATUS_INSUFFICIENT_RESOURCES;
 		}
 	}
 
@@ -158,7 +173,8 @@ namespace Memfs::Interface {
 			const auto [parentStatus, _] = memfs->FindParent(fileName);
 			return parentStatus ? parentStatus : result;
 		}
-		FileNode& fileNode = fileNodeOpt.value();
+		FileNode& entry = fileNodeOpt.value();
+		FileNode& fileNode = entry.ResolveLink();
 
 		/* if the OP specified no EA's check the need EA count, but only if accessing main stream */
 		if (0 != (createOptions & FILE_NO_EA_KNOWLEDGE) && (fileNode.IsMainNode())) {
@@ -176,8 +192,8 @@ namespace Memfs::Interface {
 			FSP_FSCTL_OPEN_FILE_INFO* openFileInfo = FspFileSystemGetOpenFileInfo(fileInfo);
 
 			wcscpy_s(openFileInfo->NormalizedName, openFileInfo->NormalizedNameSize / sizeof(WCHAR),
-			         fileNode.fileName.c_str());
-			openFileInfo->NormalizedNameSize = (UINT16)(fileNode.fileName.length() * sizeof(WCHAR));
+			         entry.fileName.c_str());
+			openFileInfo->NormalizedNameSize = (UINT16)(entry.fileName.length() * sizeof(WCHAR));
 		}
 
 		return STATUS_SUCCESS;
@@ -189,6 +205,10 @@ namespace Memfs::Interface {
 		MemFs* memfs = GetMemFs(fileSystem);
 		FileNode* fileNode = GetFileNode(fileNode0);
 
+		if (IsReadOnly(memfs, *fileNode)) {
+			return STATUS_MEDIA_WRITE_PROTECTED;
+		}
+
 		NTSTATUS result;
 
 		for (const auto& namedStream : memfs->EnumerateNamedStreams(*fileNode, true)) {
@@ -199,7 +219,7 @@ namespace Memfs::Interface {
 			}
 		}
 
-		fileNode->DeleteEaMap();
+		fileNode->DeleteEas();
 		if (ea != nullptr) {
 			result = FspFileSystemEnumerateEa(fileSystem, CompatFspFileNodeSetEa, fileNode, ea, eaLength);
 			if (!NT_SUCCESS(result)) {
@@ -207,6 +227,9 @@ namespace Memfs::Interface {
 			}
 		}
 
+		// The lower contents are replaced anyway, so they are never hydrated
+		memfs->DiscardHydration(*fileNode);
+
 		result = CompatSetFileSizeInternal(fileSystem, fileNode, allocationSize, true);
 		if (!NT_SUCCESS(result)) {
 			return result;
@@ -223,6 +246,8 @@ namespace Memfs::Interface {
 			fileNode->fileInfo.LastWriteTime =
 			fileNode->fileInfo.ChangeTime = Utils::GetSystemTime();
 
+		fileNode->MarkMetadataChanged();
+		memfs->InvalidateParentDirBuffer(*fileNode);
 		fileNode->CopyFileInfo(fileInfo);
 		return STATUS_SUCCESS;
 	}
@@ -0,0 +1,57 @@
+#include "globalincludes.h"
+#include "fileidindex.h"
+
+#include "accounting.h"
+
+using namespace Memfs;
+
+// Hash node with its next pointer and cached hash, plus the bucket pointer
+static constexpr INT64 FILE_ID_ENTRY_SIZE = 3 * sizeof(void*) + sizeof(std::unordered_map<UINT64, FileNode*>::value_type);
+
+FileIdIndex::FileIdIndex(MetadataCounter& metadata) : metadata(metadata) {}
+
+FileIdIndex::~FileIdIndex() {
+	this->Clear();
+}
+
+FileIdIndex::Shard& FileIdIndex::GetShard(const UINT64 fileId) {
+	return this->shards[fileId % SHARD_COUNT];
+}
+
+void FileIdIndex::Insert(FileNode& node) {
+	Shard& shard = this->GetShard(node.fileInfo.IndexNumber);
+	std::unique_lock lock(shard.Mutex);
+
+	const auto [iter, inserted] = shard.Nodes.insert_or_assign(node.fileInfo.IndexNumber, &node);
+	if (inserted) {
+		this->metadata.Add(FILE_ID_ENTRY_SIZE);
+	}
+}
+
+void FileIdIndex::Erase(const FileNode& node) {
+	Shard& shard = this->GetShard(node.fileInfo.IndexNumber);
+	std::unique_lock lock(shard.Mutex);
+
+	const auto iter = shard.Nodes.find(node.fileInfo.IndexNumber);
+	if (iter != shard.Nodes.end() && iter->second == &node) {
+		shard.Nodes.erase(iter);
+		this->metadata.Add(-FILE_ID_ENTRY_SIZE);
+	}
+}
+
+FileNode* FileIdIndex::Find(const UINT64 fileId) {
+	Shard& shard = this->GetShard(fileId);
+	std::shared_lock lock(shard.Mutex);
+
+	const auto iter = shard.Nodes.find(fileId);
+	return iter != shard.Nodes.end() ? iter->second : nullptr;
+}
+
+void FileIdIndex::Clear() {
+	for (Shard& shard : this->shards) {
+		std::unique_lock lock(shard.Mutex);
+
+		this->metadata.Add(-(INT64)shard.Nodes.size() * FILE_ID_ENTRY_SIZE);
+		shard.Nodes.clear();
+	}
+}
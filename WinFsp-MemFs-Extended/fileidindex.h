@@ -0,0 +1,45 @@
+#pragma once
+
+#include "globalincludes.h"
+
+#include "nodes.h"
+
+namespace Memfs {
+	/**
+	 * \brief Maps file IDs to the nodes owning them. The IDs are spread over independently locked shards, so that lookups never wait for unrelated inserts.
+	 */
+	class FileIdIndex {
+	public:
+		static constexpr size_t SHARD_COUNT = 16;
+
+		explicit FileIdIndex(MetadataCounter& metadata);
+		~FileIdIndex();
+
+		FileIdIndex(const FileIdIndex& other) = delete;
+		FileIdIndex(FileIdIndex&& other) noexcept = delete;
+		FileIdIndex& operator=(const FileIdIndex& other) = delete;
+		FileIdIndex& operator=(FileIdIndex&& other) noexcept = delete;
+
+		/**
+		 * \brief Adds or replaces the entry for the file ID of the node
+		 * \throws std::bad_alloc If no memory is left
+		 */
+		void Insert(FileNode& node);
+		void Erase(const FileNode& node);
+		// Not referenced; The caller has to keep the namespace from changing while it uses the node
+		[[nodiscard]] FileNode* Find(const UINT64 fileId);
+		void Clear();
+
+	private:
+		struct alignas(MEMFS_CACHE_LINE_SIZE) Shard {
+			std::unordered_map<UINT64, FileNode*> Nodes;
+			std::shared_mutex Mutex;
+		};
+
+		// IDs are allocated sequentially, so the low bits spread them evenly
+		Shard& GetShard(const UINT64 fileId);
+
+		Shard shards[SHARD_COUNT];
+		MetadataCounter& metadata;
+	};
+}
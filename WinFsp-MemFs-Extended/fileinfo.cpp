@@ -1,4 +1,5 @@
 #include "memfs-interface.h"
+#include "utils.h"
 
 namespace Memfs::Interface {
 	NTSTATUS GetFileInfo(FSP_FILE_SYSTEM* fileSystem, PVOID fileNode0, FSP_FSCTL_FILE_INFO* fileInfo) {
@@ -10,12 +11,17 @@ namespace Memfs::Interface {
 	NTSTATUS SetBasicInfo(FSP_FILE_SYSTEM* fileSystem,
 	                      PVOID fileNode0, UINT32 fileAttributes,
 	                      UINT64 creationTime, UINT64 lastAccessTime, UINT64 lastWriteTime, UINT64 changeTime, FSP_FSCTL_FILE_INFO* fileInfo) {
+		MemFs* memfs = GetMemFs(fileSystem);
 		FileNode* fileNode = GetFileNode(fileNode0);
 
 		if (!fileNode->IsMainNode()) {
 			fileNode = fileNode->GetMainNode();
 		}
 
+		if (IsReadOnly(memfs, *fileNode)) {
+			return STATUS_MEDIA_WRITE_PROTECTED;
+		}
+
 		if (INVALID_FILE_ATTRIBUTES != fileAttributes) {
 			fileNode->fileInfo.FileAttributes = fileAttributes;
 		}
@@ -32,6 +38,12 @@ namespace Memfs::Interface {
 			fileNode->fileInfo.ChangeTime = changeTime;
 		}
 
+		fileNode->MarkMetadataChanged();
+		{
+			// WinFsp does not guard this operation, but the parent lookup reads the file map
+			OperationGuard guard(fileSystem, false);
+			memfs->InvalidateParentDirBuffer(*fileNode);
+		}
 		fileNode->CopyFileInfo(fileInfo);
 		return STATUS_SUCCESS;
 	}
@@ -41,6 +53,10 @@ namespace Memfs::Interface {
 	                     FSP_FSCTL_FILE_INFO* fileInfo) {
 		FileNode* fileNode = GetFileNode(fileNode0);
 
+		if (IsReadOnly(GetMemFs(fileSystem), *fileNode)) {
+			return STATUS_MEDIA_WRITE_PROTECTED;
+		}
+
 		const NTSTATUS result = CompatSetFileSizeInternal(fileSystem, fileNode, newSize, setAllocationSize);
 		if (!NT_SUCCESS(result)) {
 			return result;
@@ -54,6 +70,10 @@ namespace Memfs::Interface {
 		MemFs* memfs = GetMemFs(fileSystem);
 		const FileNode* fileNode = GetFileNode(fileNode0);
 
+		if (IsReadOnly(memfs, *fileNode)) {
+			return STATUS_MEDIA_WRITE_PROTECTED;
+		}
+
 		if (memfs->HasChild(*fileNode)) {
 			return STATUS_DIRECTORY_NOT_EMPTY;
 		}
@@ -64,7 +84,13 @@ namespace Memfs::Interface {
 	NTSTATUS Rename(FSP_FILE_SYSTEM* fileSystem, PVOID fileNode0,
 	                PWSTR fileName, PWSTR newFileName, BOOLEAN replaceIfExists) {
 		MemFs* memfs = GetMemFs(fileSystem);
-		FileNode* fileNode = GetFileNode(fileNode0);
+		// Renaming a hard linked file renames the link it was opened through
+		FileNode* fileNode = &memfs->FindEntry(*GetFileNode(fileNode0), fileName);
+
+		// Neither out of nor into the snapshots
+		if (IsReadOnly(memfs, *fileNode) || memfs->IsInVolumeSnapshots(newFileName)) {
+			return STATUS_MEDIA_WRITE_PROTECTED;
+		}
 
 		const auto newFileNodeOpt = memfs->FindFile(newFileName);
 		if (newFileNodeOpt.has_value() && fileNode != &newFileNodeOpt.value().get()) {
@@ -82,7 +108,10 @@ namespace Memfs::Interface {
 		const ULONG fileNameLen = (ULONG)fileNode->fileName.length();
 		const ULONG newFileNameLen = (ULONG)wcslen(newFileName);
 
-		// Check for max path
+		// Check for max path; Only the last component of the renamed node changes, the ones below keep theirs
+		if (Utils::PathSuffix(newFileName).Suffix.length() > MEMFS_MAX_ENTRY_NAME_LENGTH) {
+			return STATUS_OBJECT_NAME_INVALID;
+		}
 		const auto descendants = memfs->EnumerateDescendants(*fileNode, true);
 		for (const auto& descendant : descendants) {
 			if (MEMFS_MAX_PATH <= descendant->fileName.length() - fileNameLen + newFileNameLen) {
@@ -90,9 +119,28 @@ namespace Memfs::Interface {
 			}
 		}
 
+		// Contents, which are still in a lower host directory, are only found there by the old names
+		try {
+			for (const auto& descendant : descendants) {
+				memfs->KeepLowerName(*descendant);
+			}
+		} catch (std::bad_alloc&) {
+			for (const auto& descendant : descendants) {
+				descendant->Dereference();
+			}
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
 		if (newFileNodeOpt.has_value()) {
 			FileNode& newFileNode = newFileNodeOpt.value();
 
+			// The replaced file takes its named streams with it
+			if (&newFileNode != fileNode) {
+				for (const auto& namedStream : memfs->EnumerateNamedStreams(newFileNode, false)) {
+					memfs->RemoveNode(*namedStream);
+				}
+			}
+
 			newFileNode.Reference();
 			memfs->RemoveNode(newFileNode);
 			newFileNode.Dereference(true);
@@ -102,8 +150,9 @@ namespace Memfs::Interface {
 		for (const auto& descendant : descendants) {
 			memfs->RemoveNode(*descendant, false);
 
-			std::wstring oldFileNameDesc = descendant->fileName;
-			descendant->fileName = newFileName + oldFileNameDesc.substr(fileNameLen);
+			const std::wstring oldFileNameDesc = descendant->fileName.ToString();
+			descendant->fileName.Assign(newFileName + oldFileNameDesc.substr(fileNameLen));
+			descendant->MarkMetadataChanged();
 
 			const auto [result,_] = memfs->InsertNode(descendant);
 			if (!NT_SUCCESS(result)) {
@@ -1,9 +1,14 @@
 #include "globalincludes.h"
 #include "utils.h"
 #include "memfs.h"
+#include "accounting.h"
 
 using namespace Memfs;
 
+static constexpr size_t MAX_DIR_CURSORS = 256;
+// Tree node of the file map: Three links, color and nil flags and the key value pair
+static constexpr INT64 FILE_MAP_ENTRY_SIZE = 4 * sizeof(void*) + sizeof(FileNodeMap::value_type);
+
 bool MemFs::IsCaseInsensitive() const {
 	return this->fileMap.key_comp().CaseInsensitive;
 }
@@ -60,6 +65,29 @@ void MemFs::TouchParent(const FileNode& node) {
 		FileNode& parent = snd.value();
 
 		parent.fileInfo.LastAccessTime = parent.fileInfo.LastWriteTime = parent.fileInfo.ChangeTime = Utils::GetSystemTime();
+		parent.MarkMetadataChanged();
+		parent.InvalidateDirectoryBuffer();
+		parent.BumpChildrenGeneration();
+	}
+}
+
+void MemFs::InvalidateParentDirBuffer(const FileNode& node) {
+	if (node.fileName.empty() || node.fileName == L"\\") {
+		return;
+	}
+
+	const auto [fst, snd] = this->FindParent(node.fileName);
+	if (snd.has_value()) {
+		FileNode& parent = snd.value();
+		parent.InvalidateDirectoryBuffer();
+	}
+
+	// Listings of the links show the same file info
+	for (const FileNode* link : node.GetLinks()) {
+		const auto [linkResult, linkParent] = this->FindParent(link->fileName);
+		if (linkParent.has_value()) {
+			linkParent.value().get().InvalidateDirectoryBuffer();
+		}
 	}
 }
 
@@ -67,7 +95,7 @@ bool MemFs::HasChild(const FileNode& node) {
 	bool result = false;
 
 	for (auto iter = this->fileMap.upper_bound(node.fileName); this->fileMap.end() != iter; ++iter) {
-		if (iter->second->fileName.find(L':') != std::wstring::npos) {
+		if (std::wstring_view(iter->second->fileName).find(L':') != std::wstring_view::npos) {
 			continue;
 		}
 
@@ -81,9 +109,33 @@ bool MemFs::HasChild(const FileNode& node) {
 
 std::pair<NTSTATUS, FileNode*> MemFs::InsertNode(FileNode* node) {
 	try {
-		const auto [iter, success] = this->fileMap.emplace(node->fileName, node);
+		const auto [iter, success] = this->fileMap.emplace(std::wstring_view(node->fileName), node);
 
 		if (success) {
+			this->metadata.Add(FILE_MAP_ENTRY_SIZE);
+
+			try {
+				if (node->IsLink()) {
+					FileNode& target = *node->GetLinkTarget();
+					target.AddLink(node);
+
+					try {
+						this->fileIds.Insert(target); // The target might have lost its own name and be reachable through this link only
+					} catch (...) {
+						target.RemoveLink(node);
+						throw;
+					}
+				} else if (!node->IsMainNode()) {
+					node->GetMainNode()->AddNamedStream(node);
+				} else {
+					this->fileIds.Insert(*node);
+				}
+			} catch (...) {
+				this->fileMap.erase(iter);
+				this->metadata.Add(-FILE_MAP_ENTRY_SIZE);
+				throw;
+			}
+
 			iter->second->Reference();
 			this->TouchParent(*iter->second);
 		}
@@ -94,15 +146,45 @@ std::pair<NTSTATUS, FileNode*> MemFs::InsertNode(FileNode* node) {
 	}
 }
 
-std::pair<NTSTATUS, FileNode&> MemFs::InsertNode(FileNode&& node) {
-	FileNode* allocatedNode{new FileNode(std::move(node))};
-	const auto [status, ptr] = this->InsertNode(allocatedNode);
+std::pair<NTSTATUS, FileNode&> MemFs::InsertNode(FileNodePtr&& node) {
+	const auto [status, ptr] = this->InsertNode(node.get());
+	if (NT_SUCCESS(status) && ptr == node.get()) {
+		node.release(); // Now owned by the map
+	}
+
 	return {status, *ptr};
 }
 
 void MemFs::RemoveNode(FileNode& node, const bool reportDeletedSize) {
-	if (!this->fileMap.erase(node.fileName)) {
-		return;
+	const auto iter = this->fileMap.find(node.fileName);
+	if (iter == this->fileMap.end() || iter->second != &node) {
+		return; // Also if the name was reused, after links kept the removed node alive
+	}
+
+	this->InvalidateDirCursors(node, iter);
+	{
+		// The buffer goes with the node
+		std::lock_guard lock(this->bufferedDirectoriesMutex);
+		if (this->bufferedDirectories.erase(&node) != 0) {
+			node.Dereference();
+		}
+	}
+	this->fileMap.erase(iter);
+	this->metadata.Add(-FILE_MAP_ENTRY_SIZE);
+	node.BumpChildrenGeneration();
+	node.MarkMetadataChanged(); // A target, which loses its own name, is only reachable through its links from now on
+
+	if (node.IsLink()) {
+		FileNode& target = *node.GetLinkTarget();
+		target.RemoveLink(&node);
+
+		if (target.GetLinks().empty() && !this->HasOwnName(target)) {
+			this->fileIds.Erase(target);
+		}
+	} else if (!node.IsMainNode()) {
+		node.GetMainNode()->RemoveNamedStream(&node);
+	} else if (node.GetLinks().empty()) {
+		this->fileIds.Erase(node);
 	}
 
 	this->TouchParent(node);
@@ -110,18 +192,13 @@ void MemFs::RemoveNode(FileNode& node, const bool reportDeletedSize) {
 }
 
 std::vector<FileNode*> MemFs::EnumerateNamedStreams(const FileNode& node, const bool references) {
-	std::vector<FileNode*> namedStreams;
+	// Copied, because the callers usually remove streams while iterating
+	std::vector<FileNode*> namedStreams = node.GetNamedStreams();
 
-	for (auto iter = this->fileMap.upper_bound(node.fileName); this->fileMap.end() != iter; ++iter) {
-		if (!Utils::FileNameHasPrefix(iter->second->fileName.c_str(), node.fileName.c_str(), this->IsCaseInsensitive()))
-			break;
-		if (L':' != iter->second->fileName[node.fileName.length()])
-			break;
-
-		if (references) {
-			iter->second->Reference();
+	if (references) {
+		for (FileNode* namedStream : namedStreams) {
+			namedStream->Reference();
 		}
-		namedStreams.push_back(iter->second);
 	}
 
 	return namedStreams;
@@ -143,17 +220,10 @@ std::vector<FileNode*> MemFs::EnumerateDescendants(const FileNode& node, const b
 	return descendants;
 }
 
-std::vector<FileNode*> MemFs::EnumerateDirChildren(const FileNode& node, const wchar_t* marker) {
-	std::vector<FileNode*> children;
-	FileNodeMap::iterator iter;
-
-	if (marker) {
-		const bool needsSlash = node.fileName.length() != 1 || node.fileName[0] != L'\\';
-		iter = this->fileMap.upper_bound(node.fileName + (needsSlash ? L"\\" : L"") + marker);
-	} else
-		iter = this->fileMap.upper_bound(node.fileName);
+bool MemFs::EnumerateDirChildren(const FileNode& node, const wchar_t* marker, const std::function<bool(FileNode*)>& callback) {
+	FileNodeMap::iterator lastChild = this->fileMap.end();
 
-	for (; this->fileMap.end() != iter; ++iter) {
+	for (FileNodeMap::iterator iter = this->SeekDirChildren(node, marker); this->fileMap.end() != iter; ++iter) {
 		if (!Utils::FileNameHasPrefix(iter->second->fileName.c_str(), node.fileName.c_str(), this->IsCaseInsensitive()))
 			break;
 
@@ -162,10 +232,79 @@ std::vector<FileNode*> MemFs::EnumerateDirChildren(const FileNode& node, const w
 		bool isDirectoryChild = 0 == Utils::FileNameCompare(suffixView.RemainPrefix.data(), suffixView.RemainPrefix.length(), node.fileName.c_str(), node.fileName.length(), this->IsCaseInsensitive());
 		isDirectoryChild = isDirectoryChild && suffixView.Suffix.find(L':') == std::string::npos;
 
-		if (isDirectoryChild) {
-			children.push_back(iter->second);
+		if (!isDirectoryChild) {
+			continue;
+		}
+
+		if (!callback(iter->second)) {
+			// The next call will receive the name of the last accepted child as its marker
+			if (lastChild != this->fileMap.end()) {
+				std::lock_guard lock(this->dirCursorsMutex);
+
+				if (this->dirCursors.size() >= MAX_DIR_CURSORS && !this->dirCursors.contains(&node)) {
+					this->dirCursors.erase(this->dirCursors.begin());
+				}
+				this->dirCursors.insert_or_assign(&node, lastChild);
+			}
+
+			return false;
+		}
+
+		lastChild = iter;
+	}
+
+	return true;
+}
+
+FileNodeMap::iterator MemFs::SeekDirChildren(const FileNode& node, const wchar_t* marker) {
+	if (!marker) {
+		return this->fileMap.upper_bound(node.fileName);
+	}
+
+	{
+		std::lock_guard lock(this->dirCursorsMutex);
+
+		// The cursor stays valid as long as the child it points to is in the map, see InvalidateDirCursors
+		const auto cursor = this->dirCursors.find(&node);
+		if (cursor != this->dirCursors.end() && Utils::PathSuffix(cursor->second->second->fileName).Suffix == marker) {
+			return std::next(cursor->second);
 		}
 	}
 
-	return children;
+	const bool needsSlash = node.fileName.length() != 1 || node.fileName[0] != L'\\';
+	return this->fileMap.upper_bound(node.fileName.ToString() + (needsSlash ? L"\\" : L"") + marker);
+}
+
+void MemFs::TrackDirectoryBuffer(FileNode& node) {
+	const auto iter = this->fileMap.find(node.fileName);
+	if (iter == this->fileMap.end() || iter->second != &node) {
+		return; // Removed, but still listed through an open handle
+	}
+
+	std::lock_guard lock(this->bufferedDirectoriesMutex);
+	try {
+		if (this->bufferedDirectories.insert(&node).second) {
+			node.Reference();
+		}
+	} catch (std::bad_alloc&) {
+		// Only freed with the node then
+	}
+}
+
+void MemFs::ReleaseDirectoryBuffers() {
+	std::lock_guard lock(this->bufferedDirectoriesMutex);
+
+	for (FileNode* directory : this->bufferedDirectories) {
+		directory->GetDirectoryBuffer().Release();
+		directory->Dereference();
+	}
+	this->bufferedDirectories.clear();
+}
+
+void MemFs::InvalidateDirCursors(const FileNode& node, const FileNodeMap::iterator& iter) {
+	std::lock_guard lock(this->dirCursorsMutex);
+
+	std::erase_if(this->dirCursors, [&node, &iter](const auto& cursor) {
+		return cursor.first == &node || cursor.second == iter;
+	});
 }
@@ -4,14 +4,25 @@
 #include <winfsp/winfsp.h>
 
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
 #include <concurrent_unordered_map.h>
 #include <memory>
 #include <optional>
 #include <string>
 #include <string_view>
 #include <shared_mutex>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
 #include <vector>
+#include <array>
 #include <type_traits>
+#include <utility>
+#include <bit>
 #include <exception>
 #include <cstdint>
 #include <cassert>
@@ -25,10 +36,14 @@ namespace std {
 
 namespace Memfs {
 	static constexpr int MEMFS_MAX_PATH = 32766;
+	static constexpr UINT16 MEMFS_MAX_COMPONENT_LENGTH = 255;
+	// Last component of a path, optionally followed by a stream name (name:stream), as it is emitted in dir and stream infos
+	static constexpr size_t MEMFS_MAX_ENTRY_NAME_LENGTH = MEMFS_MAX_COMPONENT_LENGTH * 2 + 1;
 	static constexpr UINT64 MEMFS_SECTOR_SIZE = 512;
 	static constexpr UINT64 MEMFS_SECTORS_PER_ALLOCATION_UNIT = 1;
 
 	static constexpr size_t FULL_SECTOR_SIZE = MEMFS_SECTOR_SIZE * MEMFS_SECTORS_PER_ALLOCATION_UNIT;
+	static constexpr size_t MEMFS_CACHE_LINE_SIZE = 64;
 
 	enum {
 		MemfsDisk = 0x00000000,
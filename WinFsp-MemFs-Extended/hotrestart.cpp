@@ -0,0 +1,73 @@
+#include "globalincludes.h"
+#include "memfs.h"
+#include "sectorarena.h"
+#include "utils.h"
+
+using namespace Memfs;
+
+// Only valid until the volume changes, so it is deleted as soon as it was attached
+static std::wstring GetHotRestartStatePath(const std::wstring& path) {
+	return path + L".state";
+}
+
+NTSTATUS MemFs::EnableHotRestart(const std::wstring& path, bool& restarted) {
+	restarted = false;
+
+	// Without a size limit, the volume can at most grow to the physical memory
+	UINT64 capacity = this->maxFsSize;
+	if (0 == capacity) {
+		MEMORYSTATUSEX memoryStatus{};
+		memoryStatus.dwLength = sizeof(MEMORYSTATUSEX);
+		if (!GlobalMemoryStatusEx(&memoryStatus)) {
+			return FspNtStatusFromWin32(GetLastError());
+		}
+		capacity = memoryStatus.ullTotalPhys;
+	}
+
+	try {
+		std::unique_ptr<SectorArena> arena = std::make_unique<SectorArena>(path);
+		const NTSTATUS result = arena->Open(capacity);
+		if (!NT_SUCCESS(result)) {
+			return result;
+		}
+
+		this->sectors.UseArena(std::move(arena));
+		this->hotRestartPath = path;
+	} catch (std::bad_alloc&) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	// Missing after the first start and after a crash, which leaves the sectors unusable; The image (-R) is restored instead then
+	const std::wstring statePath = GetHotRestartStatePath(path);
+
+	// The sectors are not flushed on stop, so after a restart of the host the state may refer to sectors, which never reached the file
+	WIN32_FILE_ATTRIBUTE_DATA stateAttributes{};
+	const UINT64 bootTime = Utils::GetSystemTime() - GetTickCount64() * 10000;
+	if (GetFileAttributesExW(statePath.c_str(), GetFileExInfoStandard, &stateAttributes) && ((PLARGE_INTEGER)&stateAttributes.ftLastWriteTime)->QuadPart < (LONGLONG)bootTime) {
+		DeleteFileW(statePath.c_str());
+		return STATUS_SUCCESS;
+	}
+	const NTSTATUS result = this->LoadSnapshot(statePath, SnapshotData::SectorTables);
+	if (STATUS_OBJECT_NAME_NOT_FOUND == result) {
+		return STATUS_SUCCESS;
+	}
+	if (!NT_SUCCESS(result)) {
+		return result;
+	}
+
+	if (!DeleteFileW(statePath.c_str())) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	restarted = true;
+	return STATUS_SUCCESS;
+}
+
+bool MemFs::IsHotRestartEnabled() const {
+	return !this->hotRestartPath.empty();
+}
+
+NTSTATUS MemFs::SaveHotRestartState() {
+	// The pages of the mapping stay in the system cache for the next process, so they are not flushed; The system writes them in the background
+	return this->SaveSnapshot(GetHotRestartStatePath(this->hotRestartPath), 0, SnapshotData::SectorTables);
+}
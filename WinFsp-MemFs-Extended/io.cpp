@@ -14,9 +14,18 @@ namespace Memfs::Interface {
 			endOffset = fileNode->fileInfo.FileSize;
 		}
 
+		NTSTATUS result = memfs->HydrateFile(*fileNode);
+		if (!NT_SUCCESS(result)) {
+			return result;
+		}
+
 		// memefs: Read from sector
-		if (!memfs->GetSectorManager().ReadWrite<true>(fileNode->GetSectorNode(), buffer, endOffset - offset, offset)) {
-			return STATUS_UNSUCCESSFUL;
+		try {
+			if (!memfs->GetSectorManager().ReadWrite<true>(fileNode->GetSectorNode(), buffer, endOffset - offset, offset)) {
+				return STATUS_UNSUCCESSFUL;
+			}
+		} catch (std::bad_alloc&) {
+			return STATUS_INSUFFICIENT_RESOURCES;
 		}
 
 		*pBytesTransferred = (ULONG)(endOffset - offset);
@@ -30,8 +39,15 @@ namespace Memfs::Interface {
 		MemFs* memfs = GetMemFs(fileSystem);
 		FileNode* fileNode = GetFileNode(fileNode0);
 
+		if (IsReadOnly(memfs, *fileNode)) {
+			return STATUS_MEDIA_WRITE_PROTECTED;
+		}
+
 		UINT64 endOffset;
-		NTSTATUS result;
+		NTSTATUS result = memfs->HydrateFile(*fileNode);
+		if (!NT_SUCCESS(result)) {
+			return result;
+		}
 
 		if (constrainedIo) {
 			if (offset >= fileNode->fileInfo.FileSize) {
@@ -54,9 +70,13 @@ namespace Memfs::Interface {
 			}
 		}
 
-		// memefs: Write to sector
-		if (!memfs->GetSectorManager().ReadWrite<false>(fileNode->GetSectorNode(), buffer, endOffset - offset, offset)) {
-			return STATUS_UNSUCCESSFUL;
+		// memefs: Write to sector; Empty writes must not allocate the sector storage of an empty file
+		try {
+			if (endOffset > offset && !memfs->GetSectorManager().ReadWrite<false>(fileNode->GetSectorNode(), buffer, endOffset - offset, offset)) {
+				return STATUS_UNSUCCESSFUL;
+			}
+		} catch (std::bad_alloc&) {
+			return STATUS_INSUFFICIENT_RESOURCES;
 		}
 
 		*pBytesTransferred = (ULONG)(endOffset - offset);
@@ -0,0 +1,133 @@
+#include "globalincludes.h"
+
+#include <random>
+
+#include "exceptions.h"
+#include "utils.h"
+#include "memfs.h"
+
+using namespace Memfs;
+
+NTSTATUS MemFs::CreateLink(FileNode& target, const std::wstring_view& linkName, const UINT64 ticket) {
+	if (linkName.empty() || linkName[0] != L'\\' || MEMFS_MAX_PATH <= linkName.length()) {
+		return STATUS_OBJECT_NAME_INVALID;
+	}
+
+	// Streams are not linked, they would only be reachable through one of the names
+	if (linkName.find(L':') != std::wstring_view::npos || !target.IsMainNode() || !target.GetNamedStreams().empty()) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (target.fileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+		return STATUS_FILE_IS_A_DIRECTORY;
+	}
+
+	// A deleted file, which is only kept alive by its open handles, cannot get a new name
+	if (target.GetLinks().empty() && !this->HasOwnName(target)) {
+		return STATUS_DELETE_PENDING;
+	}
+
+	if (this->FindFile(linkName).has_value()) {
+		return STATUS_OBJECT_NAME_COLLISION;
+	}
+
+	const auto [parentResult, parentNodeOpt] = this->FindParent(linkName);
+	if (!parentNodeOpt.has_value()) {
+		return parentResult;
+	}
+	const FileNode& parentNode = parentNodeOpt.value();
+
+	// The handle of the target only proves write access to the file, the ticket proves FILE_ADD_FILE on the directory
+	bool authorized = false;
+	if (0 != ticket) {
+		std::lock_guard lock(this->linkTicketsMutex);
+		for (LinkTicket& entry : this->linkTickets) {
+			if (entry.Ticket == ticket) {
+				authorized = entry.DirectoryId == parentNode.fileInfo.IndexNumber;
+				entry = {};
+				break;
+			}
+		}
+	}
+	if (!authorized) {
+		return STATUS_ACCESS_DENIED;
+	}
+
+	std::wstring fileName;
+	if (this->IsCaseInsensitive()) {
+		const Utils::SuffixView pathView = Utils::PathSuffix(linkName);
+		const bool needsSlash = 1 < parentNode.fileName.length();
+
+		fileName = parentNode.fileName.ToString() + (needsSlash ? L"\\" : L"") + std::wstring(pathView.Suffix);
+		if (MEMFS_MAX_PATH <= fileName.length()) {
+			return STATUS_OBJECT_NAME_INVALID;
+		}
+	} else {
+		fileName = linkName;
+	}
+
+	if (this->IsInVolumeSnapshots(fileName.c_str())) {
+		return STATUS_MEDIA_WRITE_PROTECTED;
+	}
+
+	try {
+		const auto [result, _] = this->InsertNode(FileNode::CreateLink(fileName, target));
+		if (!NT_SUCCESS(result)) {
+			return result;
+		}
+	} catch (FileNameTooLongException&) {
+		return STATUS_OBJECT_NAME_INVALID;
+	} catch (std::bad_alloc&) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	target.fileInfo.ChangeTime = Utils::GetSystemTime();
+	target.MarkMetadataChanged();
+	this->InvalidateParentDirBuffer(target);
+	return STATUS_SUCCESS;
+}
+
+UINT64 MemFs::AuthorizeLink(const FileNode& directory) {
+	// std::random_device is backed by the cryptographic generator of the CRT, so tickets cannot be guessed
+	std::random_device random;
+	UINT64 ticket;
+	do {
+		ticket = (UINT64)random() << 32 | random();
+	} while (0 == ticket);
+
+	std::lock_guard lock(this->linkTicketsMutex);
+	this->linkTickets[this->nextLinkTicket] = {ticket, directory.fileInfo.IndexNumber};
+	this->nextLinkTicket = (this->nextLinkTicket + 1) % LINK_TICKET_COUNT;
+	return ticket;
+}
+
+FileNode& MemFs::FindEntry(FileNode& node, const std::wstring_view& fileName) {
+	if (node.GetLinks().empty()) {
+		return node;
+	}
+
+	const auto entry = this->FindFile(fileName);
+	if (entry.has_value() && &entry.value().get().ResolveLink() == &node) {
+		return entry.value();
+	}
+
+	return node;
+}
+
+bool MemFs::HasOwnName(const FileNode& node) {
+	const auto entry = this->FindFile(node.fileName);
+	return entry.has_value() && &entry.value().get() == &node;
+}
+
+std::refoptional<FileNode> MemFs::FindEntryById(const UINT64 fileId) {
+	FileNode* node = this->fileIds.Find(fileId);
+	if (node == nullptr) {
+		return {};
+	}
+
+	if (!node->GetLinks().empty() && !this->HasOwnName(*node)) {
+		return *node->GetLinks().front();
+	}
+
+	return *node;
+}
@@ -16,8 +16,10 @@
 
 
 #include "globalincludes.h"
+#include "accounting.h"
 #include "exceptions.h"
 #include "memfs.h"
+#include "preload.h"
 
 using namespace Memfs;
 
@@ -43,12 +45,13 @@ static UINT64 wcstoll_deflt(wchar_t* w, UINT64 deflt) {
 	return L'\0' != w[0] && L'\0' == *endp ? ull : deflt;
 }
 
-// There can only be one memfs
-static std::unique_ptr<MemFs> GlobalMemFs;
+// One service hosts every volume, whose options are separated by --
+static std::vector<std::unique_ptr<MemFs>> Volumes;
+static std::unique_ptr<MemoryBudget> GlobalBudget; // -B; Outlives the volumes
 
-NTSTATUS SvcStart(FSP_SERVICE* service, ULONG argc, PWSTR* argv) {
-	wchar_t **argp, **arge;
+static void StopVolume(MemFs* memfs);
 
+static NTSTATUS StartVolume(wchar_t** argp, wchar_t** const arge) {
 	ULONG debugFlags{0};
 	PWSTR debugLogFile{0};
 
@@ -63,13 +66,24 @@ NTSTATUS SvcStart(FSP_SERVICE* service, ULONG argc, PWSTR* argv) {
 	PWSTR volumePrefix{};
 	PWSTR rootSddl{};
 	PWSTR volumeLabel{};
+	PWSTR snapshotPath{};
+	PWSTR preloadPath{};
+	PWSTR overlayPath{};
+	PWSTR hotRestartPath{};
+	PWSTR exportPath{};
+	bool hotRestarted{false};
+	ULONG checkpointInterval{0};
+	ULONG inlineFileLimit{SectorManager::DEFAULT_INLINE_LIMIT};
+	WCHAR checkpointArgument[24]{};
+	WCHAR budgetArgument[32]{};
+	WCHAR inlineArgument[24]{};
 
 	HANDLE debugLogHandle{INVALID_HANDLE_VALUE};
 
 	NTSTATUS result{-1};
 	MemFs* memfs{};
 
-	for (argp = argv + 1, arge = argv + argc; arge > argp; argp++) {
+	for (; arge > argp; argp++) {
 		if (L'-' != argp[0][0])
 			break;
 		switch (argp[0][1]) {
@@ -108,6 +122,32 @@ NTSTATUS SvcStart(FSP_SERVICE* service, ULONG argc, PWSTR* argv) {
 		case L'l':
 			argtos(volumeLabel);
 			break;
+		case L'R':
+			argtos(snapshotPath);
+			break;
+		case L'C':
+			argtol(checkpointInterval);
+			break;
+		case L'P':
+			argtos(preloadPath);
+			break;
+		case L'O':
+			argtos(overlayPath);
+			break;
+		case L'H':
+			argtos(hotRestartPath);
+			break;
+		case L'E':
+			argtos(exportPath);
+			break;
+		case L'B':
+			// Read by SvcStart, because the budget is shared by all volumes
+			if (arge <= ++argp)
+				goto usage;
+			break;
+		case L'T':
+			argtol(inlineFileLimit);
+			break;
 		default:
 			goto usage;
 		}
@@ -119,6 +159,13 @@ NTSTATUS SvcStart(FSP_SERVICE* service, ULONG argc, PWSTR* argv) {
 	if (MemfsDisk == flags && 0 == mountPoint)
 		goto usage;
 
+	if (0 != checkpointInterval && nullptr == snapshotPath)
+		goto usage;
+
+	// The hot restart state neither holds lower contents nor a checkpoint sequence
+	if (nullptr != hotRestartPath && (nullptr != overlayPath || 0 != checkpointInterval))
+		goto usage;
+
 	if (nullptr != debugLogFile) {
 		if (0 == wcscmp(L"-", debugLogFile))
 			debugLogHandle = GetStdHandle(STD_ERROR_HANDLE);
@@ -140,13 +187,72 @@ NTSTATUS SvcStart(FSP_SERVICE* service, ULONG argc, PWSTR* argv) {
 	}
 
 	try {
-		GlobalMemFs = std::unique_ptr<MemFs>(new MemFs(flags | otherFlags, maxFsSize, fileSystemName, volumePrefix, volumeLabel, rootSddl));
+		Volumes.push_back(std::unique_ptr<MemFs>(new MemFs(flags | otherFlags, maxFsSize, fileSystemName, volumePrefix, volumeLabel, rootSddl)));
 	} catch (CreateException& _) {
 		LogFail(L"cannot create MEMFS");
 		goto exit;
 	}
 
-	memfs = GlobalMemFs.get();
+	memfs = Volumes.back().get();
+	memfs->UseMemoryBudget(GlobalBudget.get());
+	memfs->SetInlineFileLimit(inlineFileLimit); // Turned off again by -H and -C
+	if (nullptr != exportPath) {
+		memfs->SetExportDirectory(exportPath);
+	}
+
+	if (nullptr != hotRestartPath) {
+		const ULONGLONG startTicks = GetTickCount64();
+		result = memfs->EnableHotRestart(hotRestartPath, hotRestarted);
+		if (!NT_SUCCESS(result)) {
+			LogFail(L"cannot attach MEMFS sectors %s (Status=%lx)", hotRestartPath, result);
+			goto exit;
+		}
+
+		if (hotRestarted) {
+			LogInfo(L"re-attached %s in %llu ms", hotRestartPath, GetTickCount64() - startTicks);
+		}
+	}
+
+	// Indexed before the image is restored, which replaces it, because a saved image already holds the lower contents
+	if (nullptr != overlayPath) {
+		PreloadStatistics statistics{};
+		result = memfs->AttachOverlay(overlayPath, statistics);
+		if (!NT_SUCCESS(result)) {
+			LogFail(L"cannot attach overlay %s to MEMFS (Status=%lx)", overlayPath, result);
+			goto exit;
+		}
+
+		LogInfo(L"indexed overlay %s: %llu files and %llu directories with %llu MB in %llu ms; %llu entries skipped",
+		        overlayPath, statistics.Files, statistics.Directories, statistics.Bytes / (1024 * 1024), statistics.Milliseconds, statistics.Skipped);
+	}
+
+	if (nullptr != snapshotPath) {
+		memfs->SetSnapshotPath(snapshotPath);
+		if (0 != checkpointInterval) {
+			memfs->EnableCheckpoints(checkpointInterval);
+		}
+
+		// Older than the re-attached state
+		result = hotRestarted ? STATUS_SUCCESS : memfs->RestoreSnapshotImage();
+		if (!NT_SUCCESS(result)) {
+			LogFail(L"cannot restore MEMFS snapshot %s (Status=%lx)", snapshotPath, result);
+			goto exit;
+		}
+	}
+
+	// Loaded before the volume is mounted, so that it only becomes visible when complete
+	if (nullptr != preloadPath) {
+		PreloadStatistics statistics{};
+		result = HostPreloader(*memfs, preloadPath).Run(statistics);
+		if (!NT_SUCCESS(result)) {
+			LogFail(L"cannot preload %s into MEMFS (Status=%lx)", preloadPath, result);
+			goto exit;
+		}
+
+		LogInfo(L"preloaded %s: %llu files and %llu directories with %llu MB in %llu ms (%llu MB/s); %llu entries skipped",
+		        preloadPath, statistics.Files, statistics.Directories, statistics.Bytes / (1024 * 1024), statistics.Milliseconds,
+		        statistics.Bytes / (1024 * 1024) * 1000 / max(statistics.Milliseconds, 1ULL), statistics.Skipped);
+	}
 
 	FSP_FILE_SYSTEM* rawFileSystem = memfs->GetRawFileSystem();
 	FspFileSystemSetDebugLog(rawFileSystem, debugFlags);
@@ -167,22 +273,38 @@ NTSTATUS SvcStart(FSP_SERVICE* service, ULONG argc, PWSTR* argv) {
 	}
 
 	mountPoint = FspFileSystemMountPoint(rawFileSystem);
+	if (0 != checkpointInterval) {
+		swprintf_s(checkpointArgument, L" -C %lu", checkpointInterval);
+	}
+	if (nullptr != GlobalBudget) {
+		swprintf_s(budgetArgument, L" -B %llu", GlobalBudget->GetLimit());
+	}
+	if (SectorManager::DEFAULT_INLINE_LIMIT != inlineFileLimit) {
+		swprintf_s(inlineArgument, L" -T %lu", inlineFileLimit);
+	}
 
-	LogInfo(L"%s -s %lu%s%s%s%s%s%s%s%s",
+	LogInfo(L"%s -s %lu%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s",
 	        PROGNAME.c_str(), maxFsSize,
 	        rootSddl ? L" -S " : L"", rootSddl ? rootSddl : L"",
 	        nullptr != volumePrefix && L'\0' != volumePrefix[0] ? L" -u " : L"",
 	        nullptr != volumePrefix && L'\0' != volumePrefix[0] ? volumePrefix : L"",
 	        mountPoint ? L" -m " : L"", mountPoint ? mountPoint : L"",
 	        nullptr != volumeLabel && L'\0' != volumeLabel[0] ? L" -l " : L"",
-	        nullptr != volumeLabel && L'\0' != volumeLabel[0] ? volumeLabel : L"");
+	        nullptr != volumeLabel && L'\0' != volumeLabel[0] ? volumeLabel : L"",
+	        snapshotPath ? L" -R " : L"", snapshotPath ? snapshotPath : L"",
+	        checkpointArgument,
+	        preloadPath ? L" -P " : L"", preloadPath ? preloadPath : L"",
+	        overlayPath ? L" -O " : L"", overlayPath ? overlayPath : L"",
+	        hotRestartPath ? L" -H " : L"", hotRestartPath ? hotRestartPath : L"",
+	        exportPath ? L" -E " : L"", exportPath ? exportPath : L"",
+	        budgetArgument, inlineArgument);
 
-	service->UserContext = memfs;
 	result = STATUS_SUCCESS;
 
 exit:
 	if (!NT_SUCCESS(result) && memfs != nullptr) {
 		memfs->Destroy();
+		Volumes.pop_back();
 	}
 
 	return result;
@@ -202,7 +324,16 @@ usage: {
 			L"    -S RootSddl         [file rights: FA, etc; NO generic rights: GA, etc.]\n"
 			L"    -u \\Server\\Share  [UNC prefix (single backslash)]\n"
 			L"    -m MountPoint       [X:|* (required if no UNC prefix)]\n"
-			L"    -l VolumeLabel      [optional volume label name]\n";
+			L"    -l VolumeLabel      [optional volume label name]\n"
+			L"    -R SnapshotImage    [restored on start and saved on stop]\n"
+			L"    -C Seconds          [log changes next to the image; requires -R]\n"
+			L"    -P PreloadDirectory [host directory copied in before mounting]\n"
+			L"    -O LowerLayer       [host directory or snapshot image; read lazily]\n"
+			L"    -H SectorFile       [sectors kept in a mapped file for fast process restarts; not with -O or -C]\n"
+			L"    -E ExportDirectory  [host directory for archives exported through the IOCTL]\n"
+			L"    -B BudgetBytes      [memory shared by all volumes of the service; only once]\n"
+			L"    -T InlineBytes      [tiny files kept without a sector; default 0 (disabled)]\n"
+			L"    --                  [separates the options of the next volume]\n";
 
 		LogFail(usage, PROGNAME.c_str());
 	}
@@ -210,13 +341,81 @@ usage: {
 	return STATUS_UNSUCCESSFUL;
 }
 
-NTSTATUS SvcStop(FSP_SERVICE* service) {
-	MemFs* memfs = static_cast<MemFs*>(service->UserContext);
+NTSTATUS SvcStart(FSP_SERVICE* service, ULONG argc, PWSTR* argv) {
+	wchar_t** const arge = argv + argc;
+
+	// The budget has to exist before the first volume is created, so it is looked up first; Values of other options are skipped like in StartVolume
+	UINT64 budgetBytes{0};
+	bool hasBudget{false};
+	for (wchar_t** argp = argv + 1; arge > argp; argp++) {
+		if (L'-' == argp[0][0] && L'B' == argp[0][1] && arge > argp + 1) {
+			// It applies to the whole service, so a second one in the options of another volume would be ambiguous
+			if (hasBudget) {
+				LogFail(L"-B can only be given once");
+				return STATUS_INVALID_PARAMETER;
+			}
+			hasBudget = true;
+			budgetBytes = wcstoll_deflt(*++argp, budgetBytes);
+		} else if (L'-' == argp[0][0] && L'\0' != argp[0][1] && nullptr != wcschr(L"dDFmSsulRCPOHET", argp[0][1])) {
+			argp++;
+		}
+	}
+	if (0 != budgetBytes) {
+		GlobalBudget = std::make_unique<MemoryBudget>(budgetBytes);
+	}
+
+	wchar_t** volumeArgs = argv + 1;
+	for (wchar_t** argp = volumeArgs;; argp++) {
+		if (arge != argp && 0 != wcscmp(L"--", *argp)) {
+			continue;
+		}
+
+		const NTSTATUS result = StartVolume(volumeArgs, argp);
+		if (!NT_SUCCESS(result)) {
+			while (!Volumes.empty()) {
+				StopVolume(Volumes.back().get());
+				Volumes.pop_back();
+			}
+			GlobalBudget.reset();
+			return result;
+		}
+
+		if (arge == argp) {
+			break;
+		}
+		volumeArgs = argp + 1;
+	}
+
+	return STATUS_SUCCESS;
+}
 
+static void StopVolume(MemFs* memfs) {
 	memfs->Stop();
+
+	if (!memfs->GetSnapshotPath().empty()) {
+		const NTSTATUS result = memfs->SaveSnapshotImage();
+		if (!NT_SUCCESS(result)) {
+			LogFail(L"cannot save MEMFS snapshot %s (Status=%lx)", memfs->GetSnapshotPath().c_str(), result);
+		}
+	}
+
+	if (memfs->IsHotRestartEnabled()) {
+		const NTSTATUS result = memfs->SaveHotRestartState();
+		if (!NT_SUCCESS(result)) {
+			LogFail(L"cannot save MEMFS hot restart state (Status=%lx)", result);
+		}
+	}
+
 	memfs->Destroy();
+}
+
+NTSTATUS SvcStop(FSP_SERVICE* service) {
+	for (const std::unique_ptr<MemFs>& memfs : Volumes) {
+		StopVolume(memfs.get());
+	}
 
-	GlobalMemFs.reset();
+	Volumes.clear();
+	GlobalBudget.reset();
 	return STATUS_SUCCESS;
 }
 
@@ -6,6 +6,23 @@
 namespace Memfs::Interface {
 	static constexpr UINT16 MAX_VOLUME_LABEL_STR_LENGTH = 32;
 
+	// Fills a MemfsStatistics struct
+	static constexpr UINT32 MEMFS_IOCTL_QUERY_STATISTICS = CTL_CODE(0x8000 + 'M', 'S', METHOD_BUFFERED, FILE_ANY_ACCESS);
+	// Adds a hard link to the file the IOCTL is sent to; The input is a ticket of MEMFS_IOCTL_AUTHORIZE_HARD_LINK followed by the full path of the new name without a null terminator
+	static constexpr UINT32 MEMFS_IOCTL_CREATE_HARD_LINK = CTL_CODE(0x8000 + 'M', 'L', METHOD_BUFFERED, FILE_WRITE_ACCESS);
+	// Sent to the directory of a new hard link, whose handle has FILE_ADD_FILE (the same bit as FILE_WRITE_ACCESS); The output is a UINT64 ticket for a single link in it
+	static constexpr UINT32 MEMFS_IOCTL_AUTHORIZE_HARD_LINK = CTL_CODE(0x8000 + 'M', 'A', METHOD_BUFFERED, FILE_WRITE_ACCESS);
+	// Resolves a file ID (FileInternalInformation) to a full path, which can then be opened; The output has no null terminator
+	static constexpr UINT32 MEMFS_IOCTL_QUERY_FILE_PATH = CTL_CODE(0x8000 + 'M', 'I', METHOD_BUFFERED, FILE_ANY_ACCESS);
+	// Saves the snapshot image given with -R; Creating, renaming and deleting files waits until it is written, but files written meanwhile may be saved partially updated
+	static constexpr UINT32 MEMFS_IOCTL_SAVE_SNAPSHOT = CTL_CODE(0x8000 + 'M', 'W', METHOD_BUFFERED, FILE_WRITE_ACCESS);
+	// Take, delete or roll back to a read-only snapshot of the volume below \.snapshots; The input is its name without a null terminator
+	static constexpr UINT32 MEMFS_IOCTL_TAKE_VOLUME_SNAPSHOT = CTL_CODE(0x8000 + 'M', 'T', METHOD_BUFFERED, FILE_WRITE_ACCESS);
+	static constexpr UINT32 MEMFS_IOCTL_DELETE_VOLUME_SNAPSHOT = CTL_CODE(0x8000 + 'M', 'X', METHOD_BUFFERED, FILE_WRITE_ACCESS);
+	static constexpr UINT32 MEMFS_IOCTL_ROLLBACK_VOLUME_SNAPSHOT = CTL_CODE(0x8000 + 'M', 'B', METHOD_BUFFERED, FILE_WRITE_ACCESS);
+	// Streams a directory as a tar archive into a file of the export directory given with -E; The input is "<directory>\0<archive file name>" without a final null terminator, the optional output an ExportStatistics struct
+	static constexpr UINT32 MEMFS_IOCTL_EXPORT_ARCHIVE = CTL_CODE(0x8000 + 'M', 'E', METHOD_BUFFERED, FILE_WRITE_ACCESS);
+
 	static inline MemFs* GetMemFs(const FSP_FILE_SYSTEM* fileSystem) {
 		return static_cast<MemFs*>(fileSystem->UserContext);
 	}
@@ -14,6 +31,38 @@ namespace Memfs::Interface {
 		return static_cast<FileNode*>(fileNode0);
 	}
 
+	// Everything inside of the volume snapshots is read-only, like on a write protected medium
+	static inline bool IsReadOnly(const MemFs* memfs, const FileNode& fileNode) {
+		return memfs->IsInVolumeSnapshots(fileNode.fileName.c_str());
+	}
+
+	// WinFsp does not serialize DeviceControl, so IOCTLs using the namespace take the lock it holds for Create, Rename and deletions (exclusive) or Open and directory reads (shared)
+	class OperationGuard {
+	public:
+		OperationGuard(FSP_FILE_SYSTEM* fileSystem, const bool exclusive) : fileSystem(fileSystem), exclusive(exclusive) {
+			if (this->exclusive) {
+				AcquireSRWLockExclusive(&this->fileSystem->OpGuardLock);
+			} else {
+				AcquireSRWLockShared(&this->fileSystem->OpGuardLock);
+			}
+		}
+
+		~OperationGuard() {
+			if (this->exclusive) {
+				ReleaseSRWLockExclusive(&this->fileSystem->OpGuardLock);
+			} else {
+				ReleaseSRWLockShared(&this->fileSystem->OpGuardLock);
+			}
+		}
+
+		OperationGuard(const OperationGuard& other) = delete;
+		OperationGuard& operator=(const OperationGuard& other) = delete;
+
+	private:
+		FSP_FILE_SYSTEM* fileSystem;
+		bool exclusive;
+	};
+
 
 	NTSTATUS GetVolumeInfo(FSP_FILE_SYSTEM* fileSystem, FSP_FSCTL_VOLUME_INFO* volumeInfo);
 
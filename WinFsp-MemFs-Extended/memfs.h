@@ -20,9 +20,32 @@
 
 #include "nodes.h"
 #include "sectors.h"
+#include "negativecache.h"
+#include "fileidindex.h"
+#include "securitytable.h"
+#include "memorymonitor.h"
+#include "checkpoint.h"
+#include "overlay.h"
+#include "accounting.h"
 
 namespace Memfs {
-	using FileNodeMap = std::map<std::wstring, FileNode*, Utils::FileLess>;
+	// Keys view the names of their nodes, which only change while a node is out of the map
+	using FileNodeMap = std::map<std::wstring_view, FileNode*, Utils::FileLess>;
+
+	// Read-only point-in-time snapshots of the volume live below this directory, one subdirectory each
+	static constexpr PCWSTR VOLUME_SNAPSHOTS_DIRECTORY = L"\\.snapshots";
+
+	// Output of the statistics IOCTL; Fields are only ever appended
+	struct MemfsStatistics {
+		UINT64 FileNodeCount;
+		UINT64 UniqueSecurityDescriptors;
+		UINT64 MetadataBytes; // Of this volume only
+		UINT64 SectorBytes;
+		UINT64 AvailableMemoryBytes;
+		UINT64 MemoryLimitBytes;
+		UINT64 MemoryPressureLevel; // Memfs::MemoryPressureLevel
+		UINT64 InlineBytes; // Contents of tiny files, which have no sector (-T)
+	};
 
 	class MemFs {
 	public:
@@ -41,14 +64,100 @@ namespace Memfs {
 
 		[[nodiscard]] FSP_FILE_SYSTEM* GetRawFileSystem() const;
 
+		// Shares the memory of the process with its other volumes (-B); Has to be set before any file is created
+		void UseMemoryBudget(MemoryBudget* budget);
+		// Files, which are written up to this many bytes, keep their contents inline instead of in a sector (-T); Has to be set before any file is created
+		void SetInlineFileLimit(const UINT32 bytes);
+
 		UINT64 GetUsedTotalSize();
 		UINT64 CalculateMaxTotalSize();
 		UINT64 CalculateAvailableTotalSize();
+		// True while the host is so low on memory, that new allocations are rejected
+		[[nodiscard]] bool IsMemoryCritical() const;
 
 		std::wstring& GetVolumeLabel();
 		void SetVolumeLabel(const std::wstring& str);
 
 		SectorManager& GetSectorManager();
+		MemoryMonitor& GetMemoryMonitor();
+		NegativeLookupCache& GetNegativeLookups();
+		SecurityDescriptorTable& GetSecurityDescriptors();
+		// Allocations of the nodes of this volume, which its size limit is charged with
+		MetadataCounter& GetMetadata();
+		void GetStatistics(MemfsStatistics& statistics);
+
+		/**
+		 * \brief Collects the metadata of the whole volume for a snapshot image (see snapshot.h). The caller keeps the namespace from changing.
+		 * \param checkpointSequence Last checkpoint that the image contains, so that a log, which could not be emptied, is not replayed on top of it again
+		 * \param contents SnapshotData::Copied or SnapshotData::SectorTables, which needs the sector arena
+		 */
+		NTSTATUS PrepareSnapshot(SnapshotPlan& plan, const UINT64 checkpointSequence = 0, const SnapshotData contents = SnapshotData::Copied);
+		/**
+		 * \brief Writes a prepared image; Needs no operation guard.
+		 * Writes and size changes are not held off: A file that is written during the save may be stored with a mix of its old and new contents, padded with zeros if it shrank.
+		 */
+		NTSTATUS WriteSnapshot(const std::wstring& path, const SnapshotPlan& plan);
+		// PrepareSnapshot and WriteSnapshot in one go
+		NTSTATUS SaveSnapshot(const std::wstring& path, const UINT64 checkpointSequence = 0, const SnapshotData contents = SnapshotData::Copied);
+		/**
+		 * \brief Replaces the tree with the contents of a snapshot image; Only used before the file system is started
+		 */
+		NTSTATUS LoadSnapshot(const std::wstring& path, const SnapshotData contents = SnapshotData::Copied);
+		[[nodiscard]] UINT64 GetRestoredCheckpointSequence() const;
+		// Image that is restored on start and saved on stop (-R)
+		void SetSnapshotPath(const std::wstring& path);
+		[[nodiscard]] const std::wstring& GetSnapshotPath() const;
+		// Host directory, which MEMFS_IOCTL_EXPORT_ARCHIVE writes its archives into (-E); Exports are rejected without it
+		void SetExportDirectory(const std::wstring& path);
+		[[nodiscard]] const std::wstring& GetExportDirectory() const;
+		// Logs the changes next to the image every few seconds (-C); Has to be enabled before the image is restored
+		void EnableCheckpoints(const DWORD intervalSeconds);
+		// Restores the image, if there is one, and replays the checkpoint log on top of it
+		NTSTATUS RestoreSnapshotImage();
+		// Brings the image up to date, e.g. on stop; Waits for running creates, renames and deletes, but only holds them off while the metadata is collected
+		NTSTATUS SaveSnapshotImage();
+		/**
+		 * \brief Replaces the tree with the contents of a mapped snapshot image; Only used before the file system is started
+		 * \param contents SnapshotData::Lazy leaves the file contents in the image, which then has to stay mapped, until they are hydrated (overlay.h)
+		 */
+		NTSTATUS LoadSnapshot(const byte* image, const UINT64 imageSize, const SnapshotData contents = SnapshotData::Copied);
+		/**
+		 * \brief Keeps the sectors in a mapped host file (-H), whose state a restarted process attaches again without copying; Only used before any file is created
+		 * \param restarted Set if the state of a cleanly stopped process was attached; States from before the last boot of the host are dropped
+		 */
+		NTSTATUS EnableHotRestart(const std::wstring& path, bool& restarted);
+		[[nodiscard]] bool IsHotRestartEnabled() const;
+		// Writes which sectors belong to which file next to the sector file, e.g. on stop; The caller keeps the volume from changing
+		NTSTATUS SaveHotRestartState();
+		// Indexes a read-only lower layer (-O), whose contents are hydrated on first access; Only used before the file system is started
+		NTSTATUS AttachOverlay(const std::wstring& lowerPath, PreloadStatistics& statistics);
+		// Copies the contents of a file in from the lower layer, unless they are already; Has to precede every access to its sectors
+		NTSTATUS HydrateFile(FileNode& node);
+		// Drops the lower contents of a file, which is about to be overwritten
+		void DiscardHydration(FileNode& node);
+		/**
+		 * \brief Keeps the lower contents of a file reachable, before it is renamed
+		 * \throws std::bad_alloc If no memory is left
+		 */
+		void KeepLowerName(FileNode& node);
+		// Lets the empty target use the contents of the source at this point in time, without copying them (copy-on-write); The file size of the target is the one of these contents
+		bool ShareContents(FileNode& source, FileNode& target);
+		/**
+		 * \brief Reads the contents of a file, which are not hydrated from the overlay yet, without hydrating them
+		 * \return False if the range is beyond the allocation of the file or the lower layer could not be read
+		 */
+		bool ReadContents(FileNode& node, void* buffer, const size_t size, const UINT64 offset);
+
+		/**
+		 * \brief Freezes the whole volume as VOLUME_SNAPSHOTS_DIRECTORY\<name>; Only the metadata is copied, the sectors are shared until they are written.
+		 * The caller keeps the namespace from changing.
+		 */
+		NTSTATUS TakeVolumeSnapshot(const std::wstring_view& name);
+		NTSTATUS DeleteVolumeSnapshot(const std::wstring_view& name);
+		// Replaces everything outside of the snapshots with the contents of one, which stays; The volume is only changed, once the whole clone exists, and a failing insert puts the removed nodes back
+		NTSTATUS RollbackVolumeSnapshot(const std::wstring_view& name);
+		// True for names inside of the snapshots, which cannot be changed
+		[[nodiscard]] bool IsInVolumeSnapshots(const PCWSTR fileName) const;
 		void RecreateSectorManager();
 
 		[[nodiscard]] bool IsCaseInsensitive() const;
@@ -56,28 +165,108 @@ namespace Memfs {
 		std::optional<FileNode*> FindMainFromStream(const std::wstring_view& fileName);
 		std::pair<NTSTATUS, std::refoptional<FileNode>> FindParent(const std::wstring_view& fileName);
 		void TouchParent(const FileNode& node);
+		// The caller holds the operation guard, at least shared, as this reads the file map
+		void InvalidateParentDirBuffer(const FileNode& node);
 		bool HasChild(const FileNode& node);
 
 		std::pair<NTSTATUS, FileNode*> InsertNode(FileNode* node);
-		std::pair<NTSTATUS, FileNode&> InsertNode(FileNode&& node);
+		std::pair<NTSTATUS, FileNode&> InsertNode(FileNodePtr&& node);
 		void RemoveNode(FileNode& node, const bool reportDeletedSize = true);
 
+		/**
+		 * \brief Adds another name for a file, whose entry is inserted into the map
+		 * \param target Main node of a file, which must not be a directory and must not have named streams
+		 * \param linkName Full path of the new name
+		 * \param ticket Returned by AuthorizeLink for the parent of the new name; It is used up, even if the link cannot be created
+		 */
+		NTSTATUS CreateLink(FileNode& target, const std::wstring_view& linkName, const UINT64 ticket);
+		/**
+		 * \brief Permits a single link in a directory, which the caller opened with FILE_ADD_FILE; WinFsp gives the IOCTLs no token to check the directory against
+		 * \return A random ticket for CreateLink; Only the newest LINK_TICKET_COUNT tickets stay valid
+		 */
+		UINT64 AuthorizeLink(const FileNode& directory);
+		// The entry a file was opened through, which is one of its links or the node itself
+		FileNode& FindEntry(FileNode& node, const std::wstring_view& fileName);
+		// True while the node is in the map under its own name, and not only reachable through links or open handles
+		bool HasOwnName(const FileNode& node);
+		/**
+		 * \brief Finds a name of a file in constant time, no matter how deep it is in the tree
+		 * \return The node itself or one of its links, if the node lost its own name
+		 */
+		std::refoptional<FileNode> FindEntryById(const UINT64 fileId);
+
 		std::vector<FileNode*> EnumerateNamedStreams(const FileNode& node, const bool references);
 		std::vector<FileNode*> EnumerateDescendants(const FileNode& node, const bool references);
-		std::vector<FileNode*> EnumerateDirChildren(const FileNode& node, const wchar_t* marker);
+		/**
+		 * \brief Lazily enumerates the direct children of a directory, starting after the marker
+		 * \param node Directory node
+		 * \param marker Name of the last child returned in a previous enumeration or nullptr
+		 * \param callback Called for each child; returning false stops the enumeration
+		 * \return True if all children were enumerated, false if the callback stopped it
+		 */
+		bool EnumerateDirChildren(const FileNode& node, const wchar_t* marker, const std::function<bool(FileNode*)>& callback);
+		// Lets ReclaimMemory free the filled directory buffer of a node, which is still in the volume; The caller holds the operation guard
+		void TrackDirectoryBuffer(FileNode& node);
 
 	private:
+		void ReclaimMemory(const MemoryPressureLevel level);
+		// Frees the directory buffers, which listings fill again on demand; No listing may be running
+		void ReleaseDirectoryBuffers();
+		// Clones of a tree, which are not in the map yet; The lists hold one reference to each, which goes with them
+		struct TreeClone {
+			std::vector<FileNode*> Nodes; // In the order they are inserted
+			std::vector<FileNode*> HiddenNodes; // Only reachable through links
+
+			TreeClone() = default;
+			~TreeClone();
+
+			TreeClone(const TreeClone& other) = delete;
+			TreeClone& operator=(const TreeClone& other) = delete;
+		};
+
+		// Copies the tree below the source root, without changing the volume; The target root has to exist, if it is the volume root
+		void CloneTree(FileNode& sourceRoot, const std::wstring& targetRoot, TreeClone& clone);
+		// Inserts the clones in their order; The ones after an error are freed with the clone
+		NTSTATUS InsertClones(const TreeClone& clone);
+		FileNodeMap::iterator SeekDirChildren(const FileNode& node, const wchar_t* marker);
+		void InvalidateDirCursors(const FileNode& node, const FileNodeMap::iterator& iter);
+
 		std::unique_ptr<FSP_FILE_SYSTEM> fileSystem;
 
 		UINT64 maxFsSize;
-		UINT64 cachedMaxFsSize{};
-		UINT64 lastCacheTime{};
+		MemoryBudget* budget{nullptr}; // Owned by the service, which outlives its volumes
+		MetadataCounter metadata; // Declared before everything, which holds nodes, so that it outlives them
+		MemoryMonitor memoryMonitor;
 
 		std::wstring volumeLabel{L"MEMEFS"};
+		std::wstring snapshotPath;
+		std::wstring exportDirectory;
+		UINT64 restoredCheckpointSequence{0};
+		std::unique_ptr<CheckpointLog> checkpoints;
+		std::unique_ptr<Overlay> overlay;
+		std::wstring hotRestartPath;
 
 		SectorManager sectors;
+		SecurityDescriptorTable securityDescriptors; // Declared before the nodes, so that it outlives them
 		FileNodeMap fileMap;
-	};
+		FileIdIndex fileIds; // Main nodes, which can still be reached through a name
+		NegativeLookupCache negativeLookups;
+
+		// Last child returned by a stopped directory enumeration, so that its continuation does not have to search the map again
+		std::unordered_map<const FileNode*, FileNodeMap::iterator> dirCursors;
+		std::mutex dirCursorsMutex;
+		// Directories with a filled directory buffer, which are referenced until it is released or they are removed
+		std::unordered_set<FileNode*> bufferedDirectories;
+		std::mutex bufferedDirectoriesMutex;
 
-	inline MemFs* MEMFS_SINGLETON;
+		struct LinkTicket {
+			UINT64 Ticket;
+			UINT64 DirectoryId;
+		};
+		static constexpr size_t LINK_TICKET_COUNT = 64;
+		// Ring of the tickets handed out by AuthorizeLink; A zero ticket is never valid
+		std::array<LinkTicket, LINK_TICKET_COUNT> linkTickets{};
+		size_t nextLinkTicket{0};
+		std::mutex linkTicketsMutex;
+	};
 }
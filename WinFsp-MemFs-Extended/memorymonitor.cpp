@@ -0,0 +1,192 @@
+#include "globalincludes.h"
+#include <psapi.h> // Needs the Windows headers first
+
+#include "memorymonitor.h"
+
+using namespace Memfs;
+
+void MemorySample::ApplyLimit(const UINT64 limit, const UINT64 used) {
+	this->LimitBytes = min(this->LimitBytes, limit);
+	this->AvailableBytes = min(this->AvailableBytes, used < limit ? limit - used : 0);
+}
+
+
+bool SystemMemorySource::Sample(MemorySample& sample) {
+	MEMORYSTATUSEX memoryStatus{};
+	memoryStatus.dwLength = sizeof(MEMORYSTATUSEX);
+	if (!GlobalMemoryStatusEx(&memoryStatus)) {
+		return false;
+	}
+
+	sample.AvailableBytes = min(sample.AvailableBytes, min(memoryStatus.ullAvailPhys, memoryStatus.ullAvailVirtual));
+	sample.LimitBytes = min(sample.LimitBytes, min(memoryStatus.ullTotalPhys, memoryStatus.ullTotalVirtual));
+	return true;
+}
+
+bool JobObjectMemorySource::Sample(MemorySample& sample) {
+	BOOL inJob = FALSE;
+	if (!IsProcessInJob(GetCurrentProcess(), nullptr, &inJob) || !inJob) {
+		return false;
+	}
+
+	// A null handle queries the job of the calling process
+	JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits{};
+	if (!QueryInformationJobObject(nullptr, JobObjectExtendedLimitInformation, &limits, sizeof(limits), nullptr)) {
+		return false;
+	}
+
+	bool limited = false;
+	if (limits.BasicLimitInformation.LimitFlags & JOB_OBJECT_LIMIT_JOB_MEMORY) {
+		JOBOBJECT_MEMORY_USAGE_INFORMATION usage{};
+		const UINT64 jobMemoryUsed = QueryInformationJobObject(nullptr, JobObjectMemoryUsageInformation, &usage, sizeof(usage), nullptr)
+			                             ? usage.JobMemory
+			                             : limits.PeakJobMemoryUsed; // Older systems only report the peak
+
+		sample.ApplyLimit(limits.JobMemoryLimit, jobMemoryUsed);
+		limited = true;
+	}
+
+	if (limits.BasicLimitInformation.LimitFlags & JOB_OBJECT_LIMIT_PROCESS_MEMORY) {
+		PROCESS_MEMORY_COUNTERS_EX counters{};
+		counters.cb = sizeof(counters);
+
+		if (GetProcessMemoryInfo(GetCurrentProcess(), reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&counters), sizeof(counters))) {
+			sample.ApplyLimit(limits.ProcessMemoryLimit, counters.PrivateUsage);
+			limited = true;
+		}
+	}
+
+	return limited;
+}
+
+LowMemorySignal::LowMemorySignal() : notification(CreateMemoryResourceNotification(LowMemoryResourceNotification)) {}
+
+LowMemorySignal::~LowMemorySignal() {
+	if (this->notification != nullptr) {
+		CloseHandle(this->notification);
+	}
+}
+
+bool LowMemorySignal::IsSignaled() const {
+	BOOL lowMemory = FALSE;
+	return this->notification != nullptr && QueryMemoryResourceNotification(this->notification, &lowMemory) && lowMemory;
+}
+
+
+MemoryMonitor::MemoryMonitor() {
+	this->AddSource(std::make_unique<SystemMemorySource>());
+	this->AddSource(std::make_unique<JobObjectMemorySource>());
+}
+
+MemoryMonitor::~MemoryMonitor() {
+	this->Stop();
+}
+
+void MemoryMonitor::AddSource(std::unique_ptr<MemorySource> source) {
+	assert(!this->thread.joinable());
+	this->sources.push_back(std::move(source));
+}
+
+void MemoryMonitor::AddPressureHandler(std::function<void(MemoryPressureLevel)> handler) {
+	assert(!this->thread.joinable());
+	this->pressureHandlers.push_back(std::move(handler));
+}
+
+void MemoryMonitor::SetWatermarks(const UINT64 highPercent, const UINT64 lowPercent) {
+	assert(!this->thread.joinable());
+	this->highWatermarkPercent = max(highPercent, lowPercent);
+	this->lowWatermarkPercent = lowPercent;
+}
+
+void MemoryMonitor::Start() {
+	if (this->thread.joinable()) {
+		return;
+	}
+
+	this->SampleNow(); // Valid values before the first operation arrives
+	this->stopping = false;
+	this->thread = std::thread(&MemoryMonitor::Run, this);
+}
+
+void MemoryMonitor::Stop() {
+	if (!this->thread.joinable()) {
+		return;
+	}
+
+	{
+		std::lock_guard lock(this->stopMutex);
+		this->stopping = true;
+	}
+
+	this->stopCondition.notify_all();
+	this->thread.join();
+}
+
+void MemoryMonitor::SampleNow() {
+	MemorySample sample;
+	bool sampled = false;
+
+	for (const auto& source : this->sources) {
+		sampled |= source->Sample(sample);
+	}
+
+	// Keep the last values if no source could be read
+	if (sampled) {
+		this->availableBytes.store(sample.AvailableBytes, std::memory_order_relaxed);
+		this->limitBytes.store(sample.LimitBytes, std::memory_order_relaxed);
+	}
+
+	const MemoryPressureLevel level = this->EvaluatePressure(this->GetAvailableBytes(), this->GetLimitBytes(), this->lowMemorySignal.IsSignaled());
+	const MemoryPressureLevel oldLevel = this->pressureLevel.exchange(level, std::memory_order_relaxed);
+
+	if (level != MemoryPressureLevel::Normal && (level > oldLevel || GetTickCount64() - this->lastReactionTicks >= PRESSURE_HANDLER_INTERVAL_MS)) {
+		this->ReactToPressure(level);
+	}
+}
+
+MemoryPressureLevel MemoryMonitor::EvaluatePressure(const UINT64 available, const UINT64 limit, const bool signaled) const {
+	const UINT64 highWatermark = limit / 100 * this->highWatermarkPercent;
+	const UINT64 lowWatermark = limit / 100 * this->lowWatermarkPercent;
+	const MemoryPressureLevel current = this->pressureLevel.load(std::memory_order_relaxed);
+
+	// A level is only left again after a quarter above its watermark, so that it does not flap
+	if (available < lowWatermark || (current == MemoryPressureLevel::Critical && available < lowWatermark + lowWatermark / 4)) {
+		return MemoryPressureLevel::Critical;
+	}
+
+	if (signaled || available < highWatermark || (current != MemoryPressureLevel::Normal && available < highWatermark + highWatermark / 4)) {
+		return MemoryPressureLevel::Reclaim;
+	}
+
+	return MemoryPressureLevel::Normal;
+}
+
+void MemoryMonitor::ReactToPressure(const MemoryPressureLevel level) {
+	this->lastReactionTicks = GetTickCount64();
+
+	for (const auto& handler : this->pressureHandlers) {
+		handler(level);
+	}
+}
+
+UINT64 MemoryMonitor::GetAvailableBytes() const {
+	return this->availableBytes.load(std::memory_order_relaxed);
+}
+
+UINT64 MemoryMonitor::GetLimitBytes() const {
+	return this->limitBytes.load(std::memory_order_relaxed);
+}
+
+MemoryPressureLevel MemoryMonitor::GetPressureLevel() const {
+	return this->pressureLevel.load(std::memory_order_relaxed);
+}
+
+void MemoryMonitor::Run() {
+	std::unique_lock lock(this->stopMutex);
+
+	while (!this->stopCondition.wait_for(lock, std::chrono::milliseconds(SAMPLE_INTERVAL_MS), [this] { return this->stopping; })) {
+		lock.unlock();
+		this->SampleNow();
+		lock.lock();
+	}
+}
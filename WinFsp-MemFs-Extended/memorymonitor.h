@@ -0,0 +1,125 @@
+#pragma once
+
+#include "globalincludes.h"
+
+namespace Memfs {
+	enum class MemoryPressureLevel : UINT32 {
+		Normal = 0,
+		Reclaim = 1, // Below the high watermark: Caches and free pools are trimmed
+		Critical = 2, // Below the low watermark: New allocations are rejected
+	};
+
+	// One reading of a memory source; Values, which the source does not know, stay at UINT64_MAX
+	struct MemorySample {
+		UINT64 AvailableBytes{UINT64_MAX};
+		UINT64 LimitBytes{UINT64_MAX};
+
+		// Merges a limit and its current usage into the sample, keeping the tightest values
+		void ApplyLimit(const UINT64 limit, const UINT64 used);
+	};
+
+	/**
+	 * \brief Source of memory availability, which is sampled by the MemoryMonitor
+	 */
+	class MemorySource {
+	public:
+		virtual ~MemorySource() = default;
+
+		/**
+		 * \brief Merges the current availability into the sample
+		 * \return False if the source has nothing to report, e.g. because the process is not in a job
+		 */
+		virtual bool Sample(MemorySample& sample) = 0;
+	};
+
+	// Available physical and virtual memory of the system
+	class SystemMemorySource final : public MemorySource {
+	public:
+		bool Sample(MemorySample& sample) override;
+	};
+
+	// Job memory and process memory limits of the job object the process runs in (e.g. a Windows container)
+	class JobObjectMemorySource final : public MemorySource {
+	public:
+		bool Sample(MemorySample& sample) override;
+	};
+
+	/**
+	 * \brief Low-memory notification of the operating system (a memory resource notification)
+	 */
+	class LowMemorySignal {
+	public:
+		LowMemorySignal();
+		~LowMemorySignal();
+
+		LowMemorySignal(const LowMemorySignal& other) = delete;
+		LowMemorySignal(LowMemorySignal&& other) noexcept = delete;
+		LowMemorySignal& operator=(const LowMemorySignal& other) = delete;
+		LowMemorySignal& operator=(LowMemorySignal&& other) noexcept = delete;
+
+		[[nodiscard]] bool IsSignaled() const;
+
+	private:
+		HANDLE notification;
+	};
+
+	/**
+	 * \brief Samples all memory sources on a background thread and publishes the tightest values, so that the file system operations only have to read an atomic
+	 */
+	class MemoryMonitor {
+	public:
+		static constexpr DWORD SAMPLE_INTERVAL_MS = 100;
+		static constexpr DWORD PRESSURE_HANDLER_INTERVAL_MS = 1000; // Minimum time between two reactions to the same level
+		static constexpr UINT64 DEFAULT_HIGH_WATERMARK_PERCENT = 5;
+		static constexpr UINT64 DEFAULT_LOW_WATERMARK_PERCENT = 1;
+
+		MemoryMonitor(); // Adds the default sources of the platform
+		~MemoryMonitor();
+
+		MemoryMonitor(const MemoryMonitor& other) = delete;
+		MemoryMonitor(MemoryMonitor&& other) noexcept = delete;
+		MemoryMonitor& operator=(const MemoryMonitor& other) = delete;
+		MemoryMonitor& operator=(MemoryMonitor&& other) noexcept = delete;
+
+		// Sources and handlers can only be added while the monitor is stopped
+		void AddSource(std::unique_ptr<MemorySource> source);
+		// Called on the monitor thread when the pressure rises and repeatedly while it stays elevated
+		void AddPressureHandler(std::function<void(MemoryPressureLevel)> handler);
+		/**
+		 * \brief Sets the watermarks in percent of the memory limit
+		 * \param highPercent Caches are trimmed below this much available memory
+		 * \param lowPercent Allocations are rejected below this much available memory
+		 */
+		void SetWatermarks(const UINT64 highPercent, const UINT64 lowPercent);
+
+		void Start();
+		void Stop();
+		void SampleNow();
+
+		[[nodiscard]] UINT64 GetAvailableBytes() const;
+		[[nodiscard]] UINT64 GetLimitBytes() const;
+		[[nodiscard]] MemoryPressureLevel GetPressureLevel() const;
+
+	private:
+		void Run();
+		[[nodiscard]] MemoryPressureLevel EvaluatePressure(const UINT64 available, const UINT64 limit, const bool signaled) const;
+		void ReactToPressure(const MemoryPressureLevel level);
+
+		std::vector<std::unique_ptr<MemorySource>> sources;
+		std::vector<std::function<void(MemoryPressureLevel)>> pressureHandlers;
+		LowMemorySignal lowMemorySignal;
+
+		UINT64 highWatermarkPercent{DEFAULT_HIGH_WATERMARK_PERCENT};
+		UINT64 lowWatermarkPercent{DEFAULT_LOW_WATERMARK_PERCENT};
+		std::atomic<MemoryPressureLevel> pressureLevel{MemoryPressureLevel::Normal};
+		UINT64 lastReactionTicks{0};
+
+		std::atomic<UINT64> availableBytes{0};
+		std::atomic<UINT64> limitBytes{0};
+
+		std::thread thread;
+		std::mutex stopMutex;
+		std::condition_variable stopCondition;
+		bool stopping{false};
+	};
+}
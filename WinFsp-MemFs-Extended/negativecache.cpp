@@ -0,0 +1,92 @@
+#include <ranges>
+
+#include "globalincludes.h"
+#include "negativecache.h"
+
+using namespace Memfs;
+
+static constexpr size_t MAX_NEGATIVE_LOOKUPS = 4096;
+
+NegativeLookupCache::NegativeLookupCache(const bool caseInsensitive) : caseInsensitive(caseInsensitive) {}
+
+NegativeLookupCache::~NegativeLookupCache() {
+	this->Clear();
+}
+
+void NegativeLookupCache::MakeKey(const std::wstring_view& fileName, std::wstring& key) const {
+	key.assign(fileName);
+
+	if (this->caseInsensitive) {
+		for (wchar_t& c : key) {
+			c = (wchar_t)towupper(c);
+		}
+	}
+}
+
+void NegativeLookupCache::ReleaseEntry(const Entry& entry) {
+	entry.Parent->Dereference();
+}
+
+bool NegativeLookupCache::Contains(const std::wstring_view& fileName) {
+	thread_local std::wstring key; // Reused, so that a probe does not allocate
+	this->MakeKey(fileName, key);
+
+	{
+		std::shared_lock lock(this->entriesMutex);
+
+		const auto iter = this->entries.find(key);
+		if (iter == this->entries.end()) {
+			return false;
+		}
+
+		if (iter->second.Parent->GetChildrenGeneration() == iter->second.ParentGeneration) {
+			return true;
+		}
+	}
+
+	// Outdated, so it is dropped, unless another thread already did or replaced it
+	std::unique_lock lock(this->entriesMutex);
+	const auto iter = this->entries.find(key);
+	if (iter != this->entries.end() && iter->second.Parent->GetChildrenGeneration() != iter->second.ParentGeneration) {
+		ReleaseEntry(iter->second);
+		this->entries.erase(iter);
+	}
+
+	return false;
+}
+
+void NegativeLookupCache::Insert(const std::wstring_view& fileName, FileNode& parent) {
+	std::wstring key;
+	this->MakeKey(fileName, key);
+
+	std::unique_lock lock(this->entriesMutex);
+
+	if (this->entries.size() >= MAX_NEGATIVE_LOOKUPS && !this->entries.contains(key)) {
+		const auto evicted = this->entries.begin();
+		ReleaseEntry(evicted->second);
+		this->entries.erase(evicted);
+	}
+
+	try {
+		const Entry entry{&parent, parent.GetChildrenGeneration()};
+		const auto [iter, inserted] = this->entries.try_emplace(std::move(key), entry);
+
+		if (!inserted) {
+			ReleaseEntry(iter->second);
+			iter->second = entry;
+		}
+
+		parent.Reference();
+	} catch (...) {
+		// The cache is only an optimization
+	}
+}
+
+void NegativeLookupCache::Clear() {
+	std::unique_lock lock(this->entriesMutex);
+
+	for (const auto& entry : this->entries | std::views::values) {
+		ReleaseEntry(entry);
+	}
+	this->entries.clear();
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "globalincludes.h"
+
+#include "nodes.h"
+
+namespace Memfs {
+	/**
+	 * \brief Bounded cache of recently missed paths, whose parent directory exists. An entry stays valid as long as the children of its parent did not change.
+	 */
+	class NegativeLookupCache {
+	public:
+		explicit NegativeLookupCache(const bool caseInsensitive);
+		~NegativeLookupCache();
+
+		NegativeLookupCache(const NegativeLookupCache& other) = delete;
+		NegativeLookupCache(NegativeLookupCache&& other) noexcept = delete;
+		NegativeLookupCache& operator=(const NegativeLookupCache& other) = delete;
+		NegativeLookupCache& operator=(NegativeLookupCache&& other) noexcept = delete;
+
+		[[nodiscard]] bool Contains(const std::wstring_view& fileName);
+		void Insert(const std::wstring_view& fileName, FileNode& parent);
+		void Clear();
+
+	private:
+		struct Entry {
+			FileNode* Parent; // Referenced, so that the generation can always be checked
+			long ParentGeneration;
+		};
+
+		void MakeKey(const std::wstring_view& fileName, std::wstring& key) const;
+		static void ReleaseEntry(const Entry& entry);
+
+		bool caseInsensitive;
+
+		std::unordered_map<std::wstring, Entry> entries;
+		std::shared_mutex entriesMutex; // Shared for lookups, which are the common case
+	};
+}
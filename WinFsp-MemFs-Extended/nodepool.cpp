@@ -0,0 +1,132 @@
+#include "globalincludes.h"
+#include "nodepool.h"
+
+using namespace Memfs;
+
+static constexpr std::align_val_t BLOCK_ALIGNMENT{FileNodePool::BLOCK_GRANULARITY};
+static constexpr std::align_val_t SLAB_ALIGNMENT{FileNodePool::SLAB_SIZE};
+
+static byte* SlabOf(const void* block) {
+	return reinterpret_cast<byte*>(reinterpret_cast<uintptr_t>(block) & ~(uintptr_t)(FileNodePool::SLAB_SIZE - 1));
+}
+
+FileNodePool::~FileNodePool() {
+	for (SizeClass& sizeClass : this->sizeClasses) {
+		for (byte* slab : sizeClass.Slabs) {
+			::operator delete(slab, SLAB_ALIGNMENT);
+		}
+	}
+}
+
+size_t FileNodePool::BlockSize(const size_t size) {
+	return (size + BLOCK_GRANULARITY - 1) / BLOCK_GRANULARITY * BLOCK_GRANULARITY;
+}
+
+void* FileNodePool::Allocate(const size_t size) {
+	const size_t blockSize = BlockSize(size);
+	const size_t classIndex = blockSize / BLOCK_GRANULARITY - 1;
+	if (classIndex >= SIZE_CLASS_COUNT) {
+		return ::operator new(blockSize, BLOCK_ALIGNMENT);
+	}
+
+	SizeClass& sizeClass = this->sizeClasses[classIndex];
+	std::lock_guard lock(sizeClass.Mutex);
+
+	if (sizeClass.FreeList != nullptr) {
+		FreeBlock* block = sizeClass.FreeList;
+		sizeClass.FreeList = block->Next;
+		return block;
+	}
+
+	if (sizeClass.SlabCursor == nullptr || (size_t)(sizeClass.SlabEnd - sizeClass.SlabCursor) < blockSize) {
+		byte* slab = static_cast<byte*>(::operator new(SLAB_SIZE, SLAB_ALIGNMENT));
+
+		try {
+			sizeClass.Slabs.push_back(slab);
+		} catch (...) {
+			::operator delete(slab, SLAB_ALIGNMENT);
+			throw;
+		}
+
+		// The rest of the previous slab is abandoned; It is smaller than one block
+		sizeClass.SlabCursor = slab;
+		sizeClass.SlabEnd = slab + SLAB_SIZE;
+	}
+
+	void* block = sizeClass.SlabCursor;
+	sizeClass.SlabCursor += blockSize;
+	return block;
+}
+
+void FileNodePool::Free(void* block, const size_t size) {
+	const size_t blockSize = BlockSize(size);
+	const size_t classIndex = blockSize / BLOCK_GRANULARITY - 1;
+	if (classIndex >= SIZE_CLASS_COUNT) {
+		::operator delete(block, BLOCK_ALIGNMENT);
+		return;
+	}
+
+	SizeClass& sizeClass = this->sizeClasses[classIndex];
+	std::lock_guard lock(sizeClass.Mutex);
+
+	FreeBlock* freeBlock = static_cast<FreeBlock*>(block);
+	freeBlock->Next = sizeClass.FreeList;
+	sizeClass.FreeList = freeBlock;
+}
+
+size_t FileNodePool::Trim() {
+	size_t released = 0;
+	for (size_t i = 0; i < SIZE_CLASS_COUNT; i++) {
+		released += this->TrimSizeClass(this->sizeClasses[i], (i + 1) * BLOCK_GRANULARITY);
+	}
+
+	return released;
+}
+
+size_t FileNodePool::TrimSizeClass(SizeClass& sizeClass, const size_t blockSize) {
+	std::lock_guard lock(sizeClass.Mutex);
+	if (sizeClass.FreeList == nullptr) {
+		return 0;
+	}
+
+	const size_t blocksPerSlab = SLAB_SIZE / blockSize;
+	// The newest slab is never released, because its uncarved rest is not on the free list
+	const byte* currentSlab = sizeClass.SlabCursor != nullptr ? SlabOf(sizeClass.SlabCursor - 1) : nullptr;
+
+	std::unordered_map<byte*, size_t> freeBlocksPerSlab;
+	try {
+		for (const FreeBlock* block = sizeClass.FreeList; block != nullptr; block = block->Next) {
+			freeBlocksPerSlab[SlabOf(block)]++;
+		}
+	} catch (...) {
+		return 0; // Trimming is only an optimization
+	}
+
+	std::erase_if(freeBlocksPerSlab, [&](const auto& entry) {
+		return entry.first == currentSlab || entry.second < blocksPerSlab;
+	});
+	if (freeBlocksPerSlab.empty()) {
+		return 0;
+	}
+
+	// Unlink the blocks of the released slabs from the free list
+	FreeBlock** link = &sizeClass.FreeList;
+	while (*link != nullptr) {
+		if (freeBlocksPerSlab.contains(SlabOf(*link))) {
+			*link = (*link)->Next;
+		} else {
+			link = &(*link)->Next;
+		}
+	}
+
+	std::erase_if(sizeClass.Slabs, [&](byte* slab) {
+		if (!freeBlocksPerSlab.contains(slab)) {
+			return false;
+		}
+
+		::operator delete(slab, SLAB_ALIGNMENT);
+		return true;
+	});
+
+	return freeBlocksPerSlab.size() * SLAB_SIZE;
+}
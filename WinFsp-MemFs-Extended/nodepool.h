@@ -0,0 +1,59 @@
+#pragma once
+
+#include "globalincludes.h"
+
+namespace Memfs {
+	/**
+	 * \brief Size-classed pool for file nodes and their inline names. Blocks are carved from large slabs and recycled through free lists, so creating and deleting many small files does not hit the general-purpose heap.
+	 */
+	class FileNodePool {
+	public:
+		static constexpr size_t BLOCK_GRANULARITY = MEMFS_CACHE_LINE_SIZE;
+		static constexpr size_t SIZE_CLASS_COUNT = 24; // Blocks up to 1.5 KiB; Larger ones are allocated directly
+		static constexpr size_t SLAB_SIZE = 64 * 1024;
+
+		FileNodePool() = default;
+		~FileNodePool();
+
+		FileNodePool(const FileNodePool& other) = delete;
+		FileNodePool(FileNodePool&& other) noexcept = delete;
+		FileNodePool& operator=(const FileNodePool& other) = delete;
+		FileNodePool& operator=(FileNodePool&& other) noexcept = delete;
+
+		/**
+		 * \brief Allocates a block aligned to BLOCK_GRANULARITY
+		 * \param size Size of the block, which has to be passed to Free again
+		 * \throws std::bad_alloc If no memory is left
+		 */
+		void* Allocate(const size_t size);
+		void Free(void* block, const size_t size);
+
+		/**
+		 * \brief Returns slabs, whose blocks are all free, to the system
+		 * \return Released bytes
+		 */
+		size_t Trim();
+
+		// Rounds up to the size that is actually reserved for a block
+		static size_t BlockSize(const size_t size);
+
+	private:
+		struct FreeBlock {
+			FreeBlock* Next;
+		};
+
+		struct SizeClass {
+			std::mutex Mutex;
+			FreeBlock* FreeList{};
+			byte* SlabCursor{}; // Unused rest of the newest slab
+			byte* SlabEnd{};
+			std::vector<byte*> Slabs; // Aligned to SLAB_SIZE, so that the slab of a block can be computed
+		};
+
+		size_t TrimSizeClass(SizeClass& sizeClass, const size_t blockSize);
+
+		SizeClass sizeClasses[SIZE_CLASS_COUNT];
+	};
+
+	inline FileNodePool FILE_NODE_POOL;
+}
@@ -13,6 +13,8 @@ namespace Memfs {
 			node->SetEa(ea);
 		} catch (CreateException& ex) {
 			return ex.Which();
+		} catch (std::bad_alloc&) {
+			return STATUS_INSUFFICIENT_RESOURCES;
 		}
 
 		return STATUS_SUCCESS;
@@ -22,16 +24,34 @@ namespace Memfs {
 		MemFs* memfs = Interface::GetMemFs(fileSystem);
 		FileNode* fileNode = Interface::GetFileNode(fileNode0);
 
+		// Sizes only change on hydrated contents
+		const NTSTATUS hydrateResult = memfs->HydrateFile(*fileNode);
+		if (!NT_SUCCESS(hydrateResult)) {
+			return hydrateResult;
+		}
+
 		if (setAllocationSize) {
 			if (fileNode->fileInfo.AllocationSize != newSize) {
 				// memefs: Sector Reallocate
-				const SIZE_T oldSize = fileNode->GetSectorNode().ApproximateSize();
+				SectorNode* sectorNode;
+				try {
+					sectorNode = &fileNode->GetSectorNode();
+				} catch (...) {
+					return STATUS_INSUFFICIENT_RESOURCES;
+				}
+
+				const SIZE_T oldSize = sectorNode->ApproximateSize();
 				if (newSize - oldSize + memfs->GetUsedTotalSize() > memfs->CalculateMaxTotalSize()) {
 					return STATUS_DISK_FULL;
 				}
 
+				// Shrinking is always allowed, because it frees memory
+				if (newSize > fileNode->fileInfo.AllocationSize && memfs->IsMemoryCritical()) {
+					return STATUS_DISK_FULL;
+				}
 
-				if (!memfs->GetSectorManager().ReAllocate(fileNode->GetSectorNode(), newSize)) {
+
+				if (!memfs->GetSectorManager().ReAllocate(*sectorNode, newSize)) {
 					return STATUS_INSUFFICIENT_RESOURCES;
 				}
 
@@ -60,6 +80,7 @@ namespace Memfs {
 			}
 		}
 
+		fileNode->MarkMetadataChanged();
 		return STATUS_SUCCESS;
 	}
 
@@ -72,56 +93,73 @@ namespace Memfs {
 		const auto fileNodeOpt = memfs->FindFile(fileName);
 		if (!fileNodeOpt.has_value())
 			return STATUS_OBJECT_NAME_NOT_FOUND;
-		FileNode& fileNode = fileNodeOpt.value();
+		FileNode& fileNode = fileNodeOpt.value().get().ResolveLink();
 
 		if (0 == (fileNode.fileInfo.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
 			return STATUS_NOT_A_REPARSE_POINT;
 
 		if (buffer != nullptr) {
-			if (fileNode.reparseData.WantedByteSize() > *pSize)
+			const DynamicStruct<byte>& reparseData = fileNode.GetReparseData();
+			if (reparseData.WantedByteSize() > *pSize)
 				return STATUS_BUFFER_TOO_SMALL;
 
-			*pSize = fileNode.reparseData.WantedByteSize();
-			memcpy_s(buffer, *pSize, fileNode.reparseData.Struct(), fileNode.reparseData.WantedByteSize());
+			*pSize = reparseData.WantedByteSize();
+			memcpy_s(buffer, *pSize, reparseData.Struct(), reparseData.WantedByteSize());
 		}
 
 		return STATUS_SUCCESS;
 	}
 
-	BOOLEAN CompatAddDirInfo(FileNode* fileNode, PCWSTR fileName, PVOID buffer, ULONG length, PULONG pBytesTransferred) {
-		DynamicStruct<FSP_FSCTL_DIR_INFO> dirInfoBuf(sizeof(FSP_FSCTL_DIR_INFO) + fileNode->fileName.size() * sizeof(std::wstring::value_type) + 1);
-		FSP_FSCTL_DIR_INFO* dirInfo = dirInfoBuf.Struct();
+	// Names in dir and stream infos are single path components, optionally followed by a stream type (name:$DATA); Longer names are rejected by FileNode::Create and Rename
+	static constexpr size_t MAX_INFO_NAME_LENGTH = MEMFS_MAX_ENTRY_NAME_LENGTH;
 
-		std::wstring fileNameStr;
-		if (fileName == nullptr) {
-			const Utils::SuffixView suffixView = Utils::PathSuffix(fileNode->fileName);
-			fileNameStr = suffixView.Suffix;
-		} else {
-			fileNameStr = fileName;
-		}
+	static FSP_FSCTL_DIR_INFO* BuildDirInfo(const FileNode* fileNode, const std::wstring_view& fileName, UINT8* dirInfoBuf) {
+		FSP_FSCTL_DIR_INFO* dirInfo = reinterpret_cast<FSP_FSCTL_DIR_INFO*>(dirInfoBuf);
+
+		assert(fileName.length() <= MAX_INFO_NAME_LENGTH);
+		const size_t fileNameLength = fileName.length();
 
 		memset(dirInfo->Padding, 0, sizeof dirInfo->Padding);
-		dirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + fileNameStr.length() * sizeof(WCHAR));
-		dirInfo->FileInfo = fileNode->fileInfo;
-		memcpy(dirInfo->FileNameBuf, fileNameStr.c_str(), dirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
+		dirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + fileNameLength * sizeof(WCHAR));
+		dirInfo->FileInfo = fileNode->ResolveLink().fileInfo;
+		memcpy(dirInfo->FileNameBuf, fileName.data(), fileNameLength * sizeof(WCHAR));
+
+		return dirInfo;
+	}
+
+	BOOLEAN CompatAddDirInfo(const FileNode* fileNode, const std::wstring_view& fileName, PVOID buffer, ULONG length, PULONG pBytesTransferred) {
+		// Built on the stack, so that emitting an entry does not allocate
+		alignas(FSP_FSCTL_DIR_INFO) UINT8 dirInfoBuf[sizeof(FSP_FSCTL_DIR_INFO) + MAX_INFO_NAME_LENGTH * sizeof(WCHAR)];
+		FSP_FSCTL_DIR_INFO* dirInfo = BuildDirInfo(fileNode, fileName, dirInfoBuf);
 
 		return FspFileSystemAddDirInfo(dirInfo, buffer, length, pBytesTransferred);
 	}
 
-	BOOLEAN CompatAddStreamInfo(FileNode* fileNode, PVOID buffer, ULONG length, PULONG pBytesTransferred) {
-		DynamicStruct<FSP_FSCTL_STREAM_INFO> streamInfoBuf(sizeof(FSP_FSCTL_STREAM_INFO) + fileNode->fileName.size() * sizeof(std::wstring::value_type) + 1);
-		FSP_FSCTL_STREAM_INFO* streamInfo = streamInfoBuf.Struct();
+	BOOLEAN CompatFillDirectoryBuffer(const FileNode* fileNode, const std::wstring_view& fileName, DirectoryBuffer& dirBuffer, PNTSTATUS pResult) {
+		alignas(FSP_FSCTL_DIR_INFO) UINT8 dirInfoBuf[sizeof(FSP_FSCTL_DIR_INFO) + MAX_INFO_NAME_LENGTH * sizeof(WCHAR)];
+		FSP_FSCTL_DIR_INFO* dirInfo = BuildDirInfo(fileNode, fileName, dirInfoBuf);
 
-		const auto streamNamePos = fileNode->fileName.find_first_of(L':');
-		std::wstring streamName;
-		if (streamNamePos != std::string::npos) {
-			streamName = fileNode->fileName.substr(streamNamePos + 1);
+		return FspFileSystemFillDirectoryBuffer(&dirBuffer.Buffer, dirInfo, pResult);
+	}
+
+	BOOLEAN CompatAddStreamInfo(const FileNode* fileNode, PVOID buffer, ULONG length, PULONG pBytesTransferred) {
+		alignas(FSP_FSCTL_STREAM_INFO) UINT8 streamInfoBuf[sizeof(FSP_FSCTL_STREAM_INFO) + MAX_INFO_NAME_LENGTH * sizeof(WCHAR)];
+		FSP_FSCTL_STREAM_INFO* streamInfo = reinterpret_cast<FSP_FSCTL_STREAM_INFO*>(streamInfoBuf);
+
+		const std::wstring_view fileName = fileNode->fileName;
+		const auto streamNamePos = fileName.find_first_of(L':');
+		std::wstring_view streamName;
+		if (streamNamePos != std::wstring_view::npos) {
+			streamName = fileName.substr(streamNamePos + 1);
 		}
 
-		streamInfo->Size = (UINT16)(sizeof(FSP_FSCTL_STREAM_INFO) + streamName.length() * sizeof(WCHAR));
+		assert(streamName.length() <= MAX_INFO_NAME_LENGTH);
+		const size_t streamNameLength = streamName.length();
+
+		streamInfo->Size = (UINT16)(sizeof(FSP_FSCTL_STREAM_INFO) + streamNameLength * sizeof(WCHAR));
 		streamInfo->StreamSize = fileNode->fileInfo.FileSize;
 		streamInfo->StreamAllocationSize = fileNode->fileInfo.AllocationSize;
-		memcpy(streamInfo->StreamNameBuf, streamName.c_str(), streamInfo->Size - sizeof(FSP_FSCTL_STREAM_INFO));
+		memcpy(streamInfo->StreamNameBuf, streamName.data(), streamNameLength * sizeof(WCHAR));
 
 		return FspFileSystemAddStreamInfo(streamInfo, buffer, length, pBytesTransferred);
 	}
@@ -4,28 +4,158 @@
 #include "nodes.h"
 
 #include "memfs.h"
+#include "accounting.h"
 
 using namespace Memfs;
 
-static volatile UINT64 IndexNumber = 1;
+static std::atomic<UINT64> IndexNumber{1}; // Shared by all hard links of a node
 static constexpr bool LOG_REFERENCES = false; // Debug option
 
-FileNode::FileNode(const std::wstring& fileName) : fileName(fileName) {
-	this->EnsureFileNameLength();
+// Variable-sized allocations owned by the cold data; The struct itself is accounted when it is allocated
+static INT64 ColdDataContentSize(const FileNodeColdData* coldData) {
+	if (coldData == nullptr) {
+		return 0;
+	}
+
+	return (INT64)(coldData->Eas.ByteSize() + coldData->ReparseData.ByteSize() + (coldData->NamedStreams.capacity() + coldData->Links.capacity()) * sizeof(FileNode*)
+		+ coldData->LowerName.capacity() * sizeof(wchar_t));
+}
 
+FileNode::FileNode(const std::wstring_view& fileName, const UINT32 nameCapacity, MetadataCounter& metadata) : fileName(reinterpret_cast<wchar_t*>(this + 1), nameCapacity, fileName, metadata),
+                                                                                                             metadata(&metadata) {
 	const uint64_t now = Utils::GetSystemTime();
 	this->fileInfo.CreationTime =
 		this->fileInfo.LastAccessTime =
 		this->fileInfo.LastWriteTime =
 		this->fileInfo.ChangeTime = now;
 
-	this->fileInfo.IndexNumber = IndexNumber++;
+	this->fileInfo.IndexNumber = IndexNumber.fetch_add(1, std::memory_order_relaxed);
+}
+
+FileNode::~FileNode() {
+	const SectorNode* sectorNode = this->sectors.load(std::memory_order_relaxed);
+	if (sectorNode != nullptr) {
+		delete sectorNode;
+		this->metadata->Add(-(INT64)sizeof(SectorNode));
+	}
+
+	const FileNodeColdData* coldData = this->coldData.load(std::memory_order_relaxed);
+	if (coldData != nullptr) {
+		this->metadata->Add(-(INT64)sizeof(FileNodeColdData) - ColdDataContentSize(coldData));
+		delete coldData;
+	}
+
+	if (this->linkTarget != nullptr) {
+		this->linkTarget->Dereference();
+	}
+}
+
+bool FileNode::IsValidName(const std::wstring_view& fileName) {
+	return fileName.length() < MEMFS_MAX_PATH && Utils::PathSuffix(fileName).Suffix.length() <= MEMFS_MAX_ENTRY_NAME_LENGTH;
 }
 
-void FileNode::EnsureFileNameLength() const {
-	if (this->fileName.length() >= MEMFS_MAX_PATH) {
+FileNodePtr FileNode::Create(const std::wstring_view& fileName, MetadataCounter& metadata) {
+	if (!IsValidName(fileName)) {
 		throw FileNameTooLongException();
 	}
+
+	// The name is placed directly behind the node and may use the rest of the pool block
+	const size_t blockSize = FileNodePool::BlockSize(sizeof(FileNode) + (fileName.length() + 1) * sizeof(wchar_t));
+	const UINT32 nameCapacity = (UINT32)((blockSize - sizeof(FileNode)) / sizeof(wchar_t));
+
+	void* block = FILE_NODE_POOL.Allocate(blockSize);
+	metadata.Add((INT64)blockSize);
+
+	return FileNodePtr(new(block) FileNode(fileName, nameCapacity, metadata));
+}
+
+FileNodePtr FileNode::CreateLink(const std::wstring_view& fileName, FileNode& target) {
+	FileNodePtr link = Create(fileName, *target.metadata);
+
+	target.Reference();
+	link->linkTarget = &target; // Keeps its own ID, which only identifies the entry in snapshots and checkpoints
+
+	return link;
+}
+
+void FileNode::ReserveIndexNumbers(const UINT64 lastUsed) {
+	UINT64 next = IndexNumber.load(std::memory_order_relaxed);
+	while (next <= lastUsed && !IndexNumber.compare_exchange_weak(next, lastUsed + 1, std::memory_order_relaxed)) {}
+}
+
+void FileNode::Delete(FileNode* node) {
+	const size_t blockSize = sizeof(FileNode) + node->fileName.inlineCapacity * sizeof(wchar_t);
+	MetadataCounter* metadata = node->metadata;
+
+	node->~FileNode();
+	FILE_NODE_POOL.Free(node, blockSize);
+	metadata->Add(-(INT64)blockSize);
+}
+
+void FileNodeDeleter::operator()(FileNode* node) const {
+	FileNode::Delete(node);
+}
+
+FileNodeName::FileNodeName(wchar_t* inlineBuffer, const UINT32 inlineCapacity, const std::wstring_view& name, MetadataCounter& metadata) : data(inlineBuffer), nameLength((UINT32)name.length()),
+                                                                                                                                        inlineCapacity(inlineCapacity), inlineBuffer(inlineBuffer), metadata(&metadata) {
+	assert(name.length() < inlineCapacity);
+
+	memcpy(this->data, name.data(), name.length() * sizeof(wchar_t));
+	this->data[name.length()] = L'\0';
+}
+
+FileNodeName::~FileNodeName() {
+	if (this->data != this->inlineBuffer) {
+		delete[] this->data;
+		this->metadata->Add(-(INT64)((this->nameLength + 1) * sizeof(wchar_t)));
+	}
+}
+
+void FileNodeName::Assign(const std::wstring_view& name) {
+	wchar_t* newData = this->inlineBuffer;
+	if (name.length() >= this->inlineCapacity) {
+		newData = new wchar_t[name.length() + 1];
+		this->metadata->Add((INT64)((name.length() + 1) * sizeof(wchar_t)));
+	}
+
+	memmove(newData, name.data(), name.length() * sizeof(wchar_t));
+	newData[name.length()] = L'\0';
+
+	if (this->data != this->inlineBuffer && this->data != newData) {
+		delete[] this->data;
+		this->metadata->Add(-(INT64)((this->nameLength + 1) * sizeof(wchar_t)));
+	}
+
+	this->data = newData;
+	this->nameLength = (UINT32)name.length();
+}
+
+const wchar_t* FileNodeName::c_str() const {
+	return this->data;
+}
+
+size_t FileNodeName::length() const {
+	return this->nameLength;
+}
+
+bool FileNodeName::empty() const {
+	return 0 == this->nameLength;
+}
+
+std::wstring FileNodeName::ToString() const {
+	return {this->data, this->nameLength};
+}
+
+wchar_t FileNodeName::operator[](const size_t index) const {
+	return this->data[index];
+}
+
+FileNodeName::operator std::wstring_view() const {
+	return {this->data, this->nameLength};
+}
+
+bool FileNodeName::operator==(const std::wstring_view& other) const {
+	return std::wstring_view(*this) == other;
 }
 
 long FileNode::GetReferenceCount(const bool withInterlock) {
@@ -64,7 +194,7 @@ void FileNode::Dereference(const bool toZero) {
 			FspServiceLog(EVENTLOG_INFORMATION_TYPE, (PWSTR)L"Removing %s", this->fileName.c_str());
 		}
 
-		delete this; // This better not cause any problems
+		Delete(this); // This better not cause any problems
 	}
 }
 
@@ -94,89 +224,285 @@ void FileNode::SetMainNode(FileNode* mainNode) {
 	this->mainFileNode = mainNode;
 }
 
-FileNodeEaMap& FileNode::GetEaMap() {
+const std::vector<FileNode*>& FileNode::GetNamedStreams() const {
+	static const std::vector<FileNode*> NO_NAMED_STREAMS;
+
+	const FileNodeColdData* coldData = this->PeekColdData();
+	return coldData != nullptr ? coldData->NamedStreams : NO_NAMED_STREAMS;
+}
+
+void FileNode::AddNamedStream(FileNode* streamNode) {
+	FileNodeColdData& coldData = this->GetColdData();
+	const INT64 oldSize = ColdDataContentSize(&coldData);
+
+	coldData.NamedStreams.push_back(streamNode);
+	this->metadata->Add(ColdDataContentSize(&coldData) - oldSize);
+}
+
+void FileNode::RemoveNamedStream(const FileNode* streamNode) {
+	FileNodeColdData* coldData = this->PeekColdData();
+	if (coldData != nullptr) {
+		std::erase(coldData->NamedStreams, streamNode); // Keeps the capacity
+	}
+}
+
+bool FileNode::IsLink() const {
+	return this->linkTarget != nullptr;
+}
+
+FileNode* FileNode::GetLinkTarget() const {
+	return this->linkTarget;
+}
+
+FileNode& FileNode::ResolveLink() {
+	return this->linkTarget != nullptr ? *this->linkTarget : *this;
+}
+
+const FileNode& FileNode::ResolveLink() const {
+	return this->linkTarget != nullptr ? *this->linkTarget : *this;
+}
+
+const std::vector<FileNode*>& FileNode::GetLinks() const {
+	static const std::vector<FileNode*> NO_LINKS;
+
+	const FileNodeColdData* coldData = this->PeekColdData();
+	return coldData != nullptr ? coldData->Links : NO_LINKS;
+}
+
+void FileNode::AddLink(FileNode* linkNode) {
+	FileNodeColdData& coldData = this->GetColdData();
+	const INT64 oldSize = ColdDataContentSize(&coldData);
+
+	coldData.Links.push_back(linkNode);
+	this->metadata->Add(ColdDataContentSize(&coldData) - oldSize);
+}
+
+void FileNode::RemoveLink(const FileNode* linkNode) {
+	FileNodeColdData* coldData = this->PeekColdData();
+	if (coldData != nullptr) {
+		std::erase(coldData->Links, linkNode);
+	}
+}
+
+const EaStorage& FileNode::GetEas() {
+	static const EaStorage NO_EAS;
+
 	if (!this->IsMainNode()) {
-		return this->mainFileNode->GetEaMap();
+		return this->mainFileNode->GetEas();
 	}
 
-	if (!this->eaMap.has_value()) {
-		this->eaMap = FileNodeEaMap();
+	const FileNodeColdData* coldData = this->PeekColdData();
+	return coldData != nullptr ? coldData->Eas : NO_EAS;
+}
+
+void FileNode::SetEa(PFILE_FULL_EA_INFORMATION ea) {
+	if (!this->IsMainNode()) {
+		this->mainFileNode->SetEa(ea);
+		return;
 	}
 
-	return this->eaMap.value();
+	LONG eaSizeDifference;
+	try {
+		FileNodeColdData& coldData = this->GetColdData();
+		const INT64 oldSize = ColdDataContentSize(&coldData);
+
+		eaSizeDifference = coldData.Eas.Set(ea);
+		this->metadata->Add(ColdDataContentSize(&coldData) - oldSize);
+	} catch (...) {
+		throw CreateException(STATUS_INSUFFICIENT_RESOURCES);
+	}
+
+	this->fileInfo.EaSize = (UINT32)((LONG)this->fileInfo.EaSize + eaSizeDifference);
+	this->MarkMetadataChanged();
 }
 
-std::refoptional<FileNodeEaMap> FileNode::GetEaMapOpt() {
+bool FileNode::NeedsEa() {
 	if (!this->IsMainNode()) {
-		return this->mainFileNode->GetEaMapOpt();
+		return this->mainFileNode->NeedsEa();
 	}
 
-	if (!this->eaMap.has_value()) {
-		return {};
+	const FileNodeColdData* coldData = this->PeekColdData();
+	return coldData != nullptr && coldData->Eas.NeedsEa();
+}
+
+void FileNode::DeleteEas() {
+	FileNodeColdData* coldData = this->PeekColdData();
+	if (coldData != nullptr) {
+		const INT64 oldSize = ColdDataContentSize(coldData);
+
+		coldData->Eas.Clear();
+		this->metadata->Add(ColdDataContentSize(coldData) - oldSize);
 	}
 
-	return this->eaMap.value();
+	this->fileInfo.EaSize = 0;
+	this->MarkMetadataChanged();
 }
 
-void FileNode::SetEa(PFILE_FULL_EA_INFORMATION ea) {
-	DynamicStruct<FILE_FULL_EA_INFORMATION> fileNodeEaDynamic;
-	FILE_FULL_EA_INFORMATION* fileNodeEa = nullptr;
-	ULONG eaSizePlus = 0, eaSizeMinus = 0;
+const DynamicStruct<byte>& FileNode::GetReparseData() const {
+	static const DynamicStruct<byte> NO_REPARSE_DATA;
+
+	const FileNodeColdData* coldData = this->PeekColdData();
+	return coldData != nullptr ? coldData->ReparseData : NO_REPARSE_DATA;
+}
+
+void FileNode::SetReparseData(DynamicStruct<byte>&& reparseData) {
+	if (!reparseData.HoldsStruct() && this->PeekColdData() == nullptr) {
+		return;
+	}
+
+	FileNodeColdData& coldData = this->GetColdData();
+	const INT64 oldSize = ColdDataContentSize(&coldData);
+
+	coldData.ReparseData = std::move(reparseData);
+	this->metadata->Add(ColdDataContentSize(&coldData) - oldSize);
+	this->MarkMetadataChanged();
+}
+
+bool FileNode::NeedsHydration() const {
+	return this->hydrationPending.load(std::memory_order_acquire);
+}
+
+void FileNode::SetLowerSource(const UINT64 offset, const std::wstring_view& lowerName) {
+	// Most files of a lower host directory keep their names, so they need no cold data
+	if (0 != offset || !lowerName.empty() || this->PeekColdData() != nullptr) {
+		FileNodeColdData& coldData = this->GetColdData();
+		const INT64 oldSize = ColdDataContentSize(&coldData);
+
+		coldData.LowerName = lowerName;
+		coldData.LowerOffset = offset;
+		this->metadata->Add(ColdDataContentSize(&coldData) - oldSize);
+	}
+
+	this->hydrationPending.store(true, std::memory_order_release);
+}
 
-	FileNodeEaMap& eaMap = this->GetEaMap();
+std::wstring_view FileNode::GetLowerName() const {
+	const FileNodeColdData* coldData = this->PeekColdData();
+	return coldData != nullptr && !coldData->LowerName.empty() ? std::wstring_view(coldData->LowerName) : std::wstring_view(this->fileName);
+}
 
-	if (0 != ea->EaValueLength) {
-		eaSizePlus = FIELD_OFFSET(FILE_FULL_EA_INFORMATION, EaName) +
-			ea->EaNameLength + 1 + ea->EaValueLength;
+UINT64 FileNode::GetLowerOffset() const {
+	const FileNodeColdData* coldData = this->PeekColdData();
+	return coldData != nullptr ? coldData->LowerOffset : 0;
+}
 
-		fileNodeEaDynamic = DynamicStruct<FILE_FULL_EA_INFORMATION>(eaSizePlus);
-		fileNodeEa = fileNodeEaDynamic.Struct();
-		memcpy_s(fileNodeEa, fileNodeEaDynamic.ByteSize(), ea, eaSizePlus);
+void FileNode::ClearLowerSource() {
+	// Readers, which see the flag cleared, also see the hydrated sectors
+	this->hydrationPending.store(false, std::memory_order_release);
 
-		fileNodeEa->NextEntryOffset = 0;
+	FileNodeColdData* coldData = this->PeekColdData();
+	if (coldData != nullptr) {
+		const INT64 oldSize = ColdDataContentSize(coldData);
+		std::wstring().swap(coldData->LowerName);
+		coldData->LowerOffset = 0;
+		this->metadata->Add(ColdDataContentSize(coldData) - oldSize);
+	}
+}
 
-		eaSizePlus = FspFileSystemGetEaPackedSize(ea);
+SectorNode& FileNode::GetSectorNode() {
+	SectorNode* sectorNode = this->sectors.load(std::memory_order_acquire);
+	if (sectorNode != nullptr) {
+		return *sectorNode;
 	}
 
-	const FileNodeEaMap::iterator p = eaMap.find(ea->EaName);
-	if (p != eaMap.end()) {
-		eaSizeMinus = FspFileSystemGetEaPackedSize(ea);
-		eaMap.erase(p); // Now, here the old ea is hopefully freed
+	// Concurrent first uses may race; The loser frees its empty node
+	SectorNode* newSectorNode = new SectorNode();
+	if (!this->sectors.compare_exchange_strong(sectorNode, newSectorNode, std::memory_order_acq_rel)) {
+		delete newSectorNode;
+		return *sectorNode;
 	}
 
-	if (0 != ea->EaValueLength && fileNodeEaDynamic.HoldsStruct()) {
-		try {
-			eaMap.insert(FileNodeEaMap::value_type(fileNodeEa->EaName, std::move(fileNodeEaDynamic)));
-		} catch (...) {
-			throw CreateException(STATUS_INSUFFICIENT_RESOURCES);
-		}
+	this->metadata->Add((INT64)sizeof(SectorNode));
+	return *newSectorNode;
+}
+
+DirectoryBuffer& FileNode::GetDirectoryBuffer() {
+	return this->GetColdData().DirBuffer;
+}
+
+void FileNode::InvalidateDirectoryBuffer() {
+	// A buffer, which does not exist yet, is filled from the current state anyway
+	FileNodeColdData* coldData = this->PeekColdData();
+	if (coldData != nullptr) {
+		coldData->DirBuffer.Invalidate();
 	}
+}
 
-	this->fileInfo.EaSize = this->fileInfo.EaSize + eaSizePlus - eaSizeMinus;
+long FileNode::GetChildrenGeneration() const {
+	return this->childrenGeneration;
 }
 
-bool FileNode::NeedsEa() {
-	if (!this->IsMainNode()) {
-		return this->mainFileNode->NeedsEa();
+void FileNode::BumpChildrenGeneration() {
+	InterlockedIncrement(&this->childrenGeneration);
+}
+
+void FileNode::MarkMetadataChanged() {
+	this->metadataChanged.store(true, std::memory_order_release);
+}
+
+bool FileNode::TakeMetadataChanged() {
+	return this->metadataChanged.exchange(false, std::memory_order_acq_rel);
+}
+
+FileNodeColdData* FileNode::PeekColdData() const {
+	return this->coldData.load(std::memory_order_acquire);
+}
+
+FileNodeColdData& FileNode::GetColdData() {
+	FileNodeColdData* coldData = this->coldData.load(std::memory_order_acquire);
+	if (coldData != nullptr) {
+		return *coldData;
 	}
 
-	if (!this->eaMap.has_value()) {
-		return false;
+	FileNodeColdData* newColdData = new FileNodeColdData();
+	newColdData->DirBuffer.Metadata = this->metadata;
+	if (!this->coldData.compare_exchange_strong(coldData, newColdData, std::memory_order_acq_rel)) {
+		delete newColdData;
+		return *coldData;
 	}
 
-	for (const auto& p : this->eaMap.value()) {
-		if (p.second.HoldsStruct() && 0 != (p.second.Struct()->Flags & FILE_NEED_EA)) {
-			return true;
-		}
+	this->metadata->Add((INT64)sizeof(FileNodeColdData));
+	return *newColdData;
+}
+
+DirectoryBuffer::~DirectoryBuffer() {
+	FspFileSystemDeleteDirectoryBuffer(&this->Buffer);
+	this->Metadata->Add(-(INT64)this->Bytes);
+}
+
+DirectoryBuffer::DirectoryBuffer(DirectoryBuffer&& other) noexcept : Buffer(std::exchange(other.Buffer, nullptr)), Generation(other.Generation), FilledGeneration(other.FilledGeneration),
+                                                                    Bytes(std::exchange(other.Bytes, 0)), Metadata(other.Metadata) {}
+
+DirectoryBuffer& DirectoryBuffer::operator=(DirectoryBuffer&& other) noexcept {
+	if (this != &other) {
+		FspFileSystemDeleteDirectoryBuffer(&this->Buffer);
+		this->Metadata->Add(-(INT64)this->Bytes);
+
+		this->Buffer = std::exchange(other.Buffer, nullptr);
+		this->Generation = other.Generation;
+		this->FilledGeneration = other.FilledGeneration;
+		this->Bytes = std::exchange(other.Bytes, 0);
+		this->Metadata = other.Metadata;
 	}
 
-	return false;
+	return *this;
 }
 
-void FileNode::DeleteEaMap() {
-	this->eaMap.reset();
+void DirectoryBuffer::Invalidate() {
+	InterlockedIncrement(&this->Generation);
 }
 
-SectorNode& FileNode::GetSectorNode() {
-	return this->sectors;
+bool DirectoryBuffer::IsValid() const {
+	return this->Generation == this->FilledGeneration;
+}
+
+void DirectoryBuffer::SetFilledBytes(const size_t bytes) {
+	this->Metadata->Add((INT64)bytes - (INT64)this->Bytes);
+	this->Bytes = bytes;
+}
+
+void DirectoryBuffer::Release() {
+	FspFileSystemDeleteDirectoryBuffer(&this->Buffer);
+	this->SetFilledBytes(0);
+	this->Invalidate();
 }
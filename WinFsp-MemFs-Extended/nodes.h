@@ -5,24 +5,135 @@
 #include "sectors.h"
 #include "comparisons.h"
 #include "dynamicstruct.h"
+#include "eastorage.h"
+#include "securitytable.h"
+#include "nodepool.h"
 
 namespace Memfs {
-	using FileNodeEaMap = std::map<std::string, DynamicStruct<FILE_FULL_EA_INFORMATION>, Utils::EaLess>;
+	class MetadataCounter;
 
-	class FileNode {
+	// Prepared and sorted listing of a directory, which is served by WinFsp's directory buffer functions
+	struct DirectoryBuffer {
+		PVOID Buffer{};
+		volatile long Generation{0}; // Incremented whenever the listing changes
+		volatile long FilledGeneration{-1}; // Generation the buffer was last filled with
+		size_t Bytes{0}; // Estimated size of the filled entries, which is accounted as metadata
+		MetadataCounter* Metadata{nullptr}; // Of the volume; Set together with the cold data
+
+		DirectoryBuffer() = default;
+		~DirectoryBuffer();
+
+		DirectoryBuffer(const DirectoryBuffer& other) = delete;
+		DirectoryBuffer(DirectoryBuffer&& other) noexcept;
+		DirectoryBuffer& operator=(const DirectoryBuffer& other) = delete;
+		DirectoryBuffer& operator=(DirectoryBuffer&& other) noexcept;
+
+		void Invalidate();
+		[[nodiscard]] bool IsValid() const;
+		// Accounts the entries of a listing, which was just filled
+		void SetFilledBytes(const size_t bytes);
+		// Frees the buffer, which is filled again by the next listing; The caller makes sure that no listing reads it
+		void Release();
+	};
+
+	class FileNode;
+
+	/**
+	 * \brief Null-terminated path of a node. It is stored inline behind its pooled node and only moves to the heap if a rename does not fit the inline capacity.
+	 */
+	class FileNodeName {
+	public:
+		~FileNodeName();
+
+		FileNodeName(const FileNodeName& other) = delete;
+		FileNodeName(FileNodeName&& other) noexcept = delete;
+		FileNodeName& operator=(const FileNodeName& other) = delete;
+		FileNodeName& operator=(FileNodeName&& other) noexcept = delete;
+
+		/**
+		 * \brief Replaces the name
+		 * \throws std::bad_alloc If the name does not fit inline and no memory is left
+		 */
+		void Assign(const std::wstring_view& name);
+
+		[[nodiscard]] const wchar_t* c_str() const;
+		[[nodiscard]] size_t length() const;
+		[[nodiscard]] bool empty() const;
+		[[nodiscard]] std::wstring ToString() const;
+
+		wchar_t operator[](const size_t index) const;
+		operator std::wstring_view() const;
+		bool operator==(const std::wstring_view& other) const;
+
+	private:
+		friend class FileNode;
+
+		FileNodeName(wchar_t* inlineBuffer, const UINT32 inlineCapacity, const std::wstring_view& name, MetadataCounter& metadata);
+
+		wchar_t* data;
+		UINT32 nameLength;
+		UINT32 inlineCapacity; // In characters, including the null terminator
+		wchar_t* inlineBuffer;
+		MetadataCounter* metadata; // Of the volume, which a name on the heap is accounted to
+	};
+
+	struct FileNodeDeleter {
+		void operator()(FileNode* node) const;
+	};
+
+	// Owns a pooled node until it is handed to MemFs::InsertNode
+	using FileNodePtr = std::unique_ptr<FileNode, FileNodeDeleter>;
+
+	// Rarely used attributes of a node, which are only allocated once one of them is needed
+	struct FileNodeColdData {
+		EaStorage Eas;
+		DynamicStruct<byte> ReparseData;
+		DirectoryBuffer DirBuffer;
+		std::vector<FileNode*> NamedStreams;
+		std::vector<FileNode*> Links; // Further names of the node
+		std::wstring LowerName; // Below the lower host directory of an overlay (overlay.h), only if the node was renamed or cloned before it was hydrated
+		UINT64 LowerOffset{0}; // Of the contents in a lower snapshot image
+	};
+
+	// The hot fields come first, so that most operations only touch the first cache line of a node
+	class alignas(MEMFS_CACHE_LINE_SIZE) FileNode {
 	public:
-		std::wstring fileName; // Has to be constrained!
 		FSP_FSCTL_FILE_INFO fileInfo{};
 
-		DynamicStruct<SECURITY_DESCRIPTOR> fileSecurity;
-		DynamicStruct<byte> reparseData;
+	private:
+		volatile long refCount{0};
+		volatile long childrenGeneration{0};
+		FileNode* mainFileNode{};
+		FileNode* linkTarget{}; // Referenced by the link for as long as it exists
+
+	public:
+		SharedSecurityDescriptor fileSecurity; // Interned in MemFs::GetSecurityDescriptors
+		FileNodeName fileName; // Has to be constrained!
+
+		/**
+		 * \brief Allocates a node together with its name from the node pool
+		 * \param metadata Of the volume, which all allocations of the node are accounted to
+		 * \throws FileNameTooLongException If the name exceeds MEMFS_MAX_PATH
+		 * \throws std::bad_alloc If no memory is left
+		 */
+		static FileNodePtr Create(const std::wstring_view& fileName, MetadataCounter& metadata);
+		// Whether Create accepts the name
+		[[nodiscard]] static bool IsValidName(const std::wstring_view& fileName);
+		/**
+		 * \brief Allocates a hard link entry, which only holds a name and forwards everything else to the target; It is accounted to the volume of the target
+		 * \throws FileNameTooLongException If the name exceeds MEMFS_MAX_PATH
+		 * \throws std::bad_alloc If no memory is left
+		 */
+		static FileNodePtr CreateLink(const std::wstring_view& fileName, FileNode& target);
+		// Makes sure that new nodes get file IDs above the given one, after nodes with stored IDs were restored
+		static void ReserveIndexNumbers(const UINT64 lastUsed);
+		static void Delete(FileNode* node);
 
-		explicit FileNode(const std::wstring& fileName);
-		~FileNode() = default;
+		~FileNode();
 		explicit FileNode(const FileNode& other) = delete;
 		FileNode& operator=(const FileNode& other) = delete;
-		explicit FileNode(FileNode&& other) noexcept = default;
-		FileNode& operator=(FileNode&& other) noexcept = default;
+		explicit FileNode(FileNode&& other) noexcept = delete;
+		FileNode& operator=(FileNode&& other) noexcept = delete;
 
 		long GetReferenceCount(const bool withInterlock = true);
 		void Reference();
@@ -34,28 +145,72 @@ namespace Memfs {
 		FileNode* GetMainNode() const;
 		void SetMainNode(FileNode* mainNode);
 
-		FileNodeEaMap& GetEaMap();
-		std::refoptional<FileNodeEaMap> GetEaMapOpt();
+		// Named streams of a main node, maintained by MemFs::InsertNode and MemFs::RemoveNode
+		[[nodiscard]] const std::vector<FileNode*>& GetNamedStreams() const;
+		void AddNamedStream(FileNode* streamNode);
+		void RemoveNamedStream(const FileNode* streamNode);
+
+		// Hard links are opened as their target, which owns the data, the security and the file ID
+		[[nodiscard]] bool IsLink() const;
+		FileNode* GetLinkTarget() const;
+		FileNode& ResolveLink();
+		const FileNode& ResolveLink() const;
+
+		// Link entries pointing to this node, maintained by MemFs::InsertNode and MemFs::RemoveNode
+		[[nodiscard]] const std::vector<FileNode*>& GetLinks() const;
+		void AddLink(FileNode* linkNode);
+		void RemoveLink(const FileNode* linkNode);
+
+		const EaStorage& GetEas();
 		void SetEa(PFILE_FULL_EA_INFORMATION ea);
 		bool NeedsEa();
-		void DeleteEaMap();
+		void DeleteEas();
+
+		[[nodiscard]] const DynamicStruct<byte>& GetReparseData() const;
+		void SetReparseData(DynamicStruct<byte>&& reparseData);
+
+		// The contents are still in the lower layer of the overlay and are copied in by MemFs::HydrateFile
+		[[nodiscard]] bool NeedsHydration() const;
+		/**
+		 * \param offset Of the contents in a lower snapshot image
+		 * \param lowerName Of the contents below a lower host directory, if it is not the name of the node
+		 */
+		void SetLowerSource(const UINT64 offset, const std::wstring_view& lowerName = {});
+		// The name of the node, unless the contents were left under another one
+		[[nodiscard]] std::wstring_view GetLowerName() const;
+		[[nodiscard]] UINT64 GetLowerOffset() const;
+		void ClearLowerSource();
 
+		// Allocates the sector storage on first use; Directories never use it
 		SectorNode& GetSectorNode();
+		DirectoryBuffer& GetDirectoryBuffer();
+		void InvalidateDirectoryBuffer();
+
+		// Incremented whenever a child is inserted below this node or the node itself is removed or changes its reparse point
+		[[nodiscard]] long GetChildrenGeneration() const;
+		void BumpChildrenGeneration();
+
+		// Set by every change of the metadata, which the checkpoint log (checkpoint.h) records; New nodes start out changed
+		void MarkMetadataChanged();
+		[[nodiscard]] bool TakeMetadataChanged();
 
 	private:
-		// Don't forget to update the move constructor if adding new variables here
-		void EnsureFileNameLength() const; // Constrains filename with exceptions
+		FileNode(const std::wstring_view& fileName, const UINT32 nameCapacity, MetadataCounter& metadata);
 
-		SectorNode sectors;
-		volatile long refCount{0};
+		[[nodiscard]] FileNodeColdData* PeekColdData() const;
+		FileNodeColdData& GetColdData();
 
-		FileNode* mainFileNode{};
-		std::optional<FileNodeEaMap> eaMap;
+		std::atomic<SectorNode*> sectors{nullptr};
+		std::atomic<FileNodeColdData*> coldData{nullptr};
+		std::atomic<bool> hydrationPending{false};
+		std::atomic<bool> metadataChanged{true};
+		MetadataCounter* metadata;
 	};
 
 	NTSTATUS CompatFspFileNodeSetEa(FSP_FILE_SYSTEM* fileSystem, PVOID fileNode, PFILE_FULL_EA_INFORMATION ea);
 	NTSTATUS CompatSetFileSizeInternal(FSP_FILE_SYSTEM* fileSystem, PVOID fileNode0, UINT64 newSize, BOOLEAN setAllocationSize);
 	NTSTATUS CompatGetReparsePointByName(FSP_FILE_SYSTEM* fileSystem, PVOID context, PWSTR fileName, BOOLEAN isDirectory, PVOID buffer, PSIZE_T pSize);
-	BOOLEAN CompatAddDirInfo(FileNode* fileNode, PCWSTR fileName, PVOID buffer, ULONG length, PULONG pBytesTransferred);
-	BOOLEAN CompatAddStreamInfo(FileNode* fileNode, PVOID buffer, ULONG length, PULONG pBytesTransferred);
+	BOOLEAN CompatAddDirInfo(const FileNode* fileNode, const std::wstring_view& fileName, PVOID buffer, ULONG length, PULONG pBytesTransferred);
+	BOOLEAN CompatFillDirectoryBuffer(const FileNode* fileNode, const std::wstring_view& fileName, DirectoryBuffer& dirBuffer, PNTSTATUS pResult);
+	BOOLEAN CompatAddStreamInfo(const FileNode* fileNode, PVOID buffer, ULONG length, PULONG pBytesTransferred);
 }
@@ -1,6 +1,7 @@
 #include <cassert>
 
 #include "memfs-interface.h"
+#include "tarexport.h"
 #include "utils.h"
 
 namespace Memfs::Interface {
@@ -18,6 +19,11 @@ namespace Memfs::Interface {
 
 		assert(0 != flags); /* FSP_FSCTL_VOLUME_PARAMS::PostCleanupWhenModifiedOnly ensures this */
 
+		// Not even the access times of the snapshots change; Their entries are only deleted by the IOCTL
+		if (IsReadOnly(memfs, *mainFileNode)) {
+			return;
+		}
+
 		if (flags & FspCleanupSetArchiveBit) {
 			if (0 == (mainFileNode->fileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
 				mainFileNode->fileInfo.FileAttributes |= FILE_ATTRIBUTE_ARCHIVE;
@@ -46,12 +52,23 @@ namespace Memfs::Interface {
 			CompatSetFileSizeInternal(fileSystem, fileNode, allocationSize, true);
 		}
 
+		// Sizes and times of the entry in the parent listing are updated on cleanup, like NTFS does
+		mainFileNode->MarkMetadataChanged();
+		if (flags & FspCleanupDelete) {
+			// WinFsp already holds the exclusive guard for a deleting cleanup
+			memfs->InvalidateParentDirBuffer(*mainFileNode);
+		} else {
+			OperationGuard guard(fileSystem, false);
+			memfs->InvalidateParentDirBuffer(*mainFileNode);
+		}
+
 		if ((flags & FspCleanupDelete) && !memfs->HasChild(*fileNode)) {
 			for (const auto& namedStream : memfs->EnumerateNamedStreams(*fileNode, false)) {
 				memfs->RemoveNode(*namedStream);
 			}
 
-			memfs->RemoveNode(*fileNode);
+			// Only the name the file was opened through is deleted; Other hard links keep the node alive
+			memfs->RemoveNode(memfs->FindEntry(*fileNode, fileName));
 		}
 	}
 
@@ -104,6 +121,149 @@ namespace Memfs::Interface {
 			return STATUS_SUCCESS;
 		}
 
+		// Unlike reading every file through the kernel, each file is archived as it was at one point in time and writers keep going meanwhile
+		if (MEMFS_IOCTL_EXPORT_ARCHIVE == controlCode) {
+			if (0 != inputBufferLength % sizeof(WCHAR)) {
+				return STATUS_INVALID_PARAMETER;
+			}
+
+			const std::wstring_view input(static_cast<PWSTR>(inputBuffer), inputBufferLength / sizeof(WCHAR));
+			const size_t separator = input.find(L'\0');
+			if (std::wstring_view::npos == separator || 0 == separator || separator + 1 == input.length()) {
+				return STATUS_INVALID_PARAMETER;
+			}
+
+			// Only the name of the archive comes from the caller, who must not pick any other host file
+			MemFs* memfs = GetMemFs(fileSystem);
+			if (memfs->GetExportDirectory().empty()) {
+				return STATUS_INVALID_DEVICE_REQUEST;
+			}
+			const std::wstring_view archiveName = input.substr(separator + 1);
+			if (!TarExporter::IsValidArchiveName(archiveName)) {
+				return STATUS_OBJECT_NAME_INVALID;
+			}
+
+			ExportStatistics statistics{};
+			NTSTATUS result;
+			try {
+				TarExporter exporter(*memfs, memfs->GetExportDirectory() + L"\\" + std::wstring(archiveName));
+				{
+					OperationGuard guard(fileSystem, false);
+					result = exporter.Collect(input.substr(0, separator));
+				}
+
+				if (NT_SUCCESS(result)) {
+					result = exporter.Write(statistics);
+				}
+			} catch (std::bad_alloc&) {
+				return STATUS_INSUFFICIENT_RESOURCES;
+			}
+
+			if (NT_SUCCESS(result) && outputBufferLength >= sizeof(ExportStatistics)) {
+				memcpy(outputBuffer, &statistics, sizeof(ExportStatistics));
+				*pBytesTransferred = sizeof(ExportStatistics);
+			}
+			return result;
+		}
+
+		if (MEMFS_IOCTL_QUERY_STATISTICS == controlCode) {
+			if (outputBufferLength < sizeof(MemfsStatistics)) {
+				return STATUS_BUFFER_TOO_SMALL;
+			}
+
+			MemfsStatistics statistics{};
+			GetMemFs(fileSystem)->GetStatistics(statistics);
+
+			memcpy(outputBuffer, &statistics, sizeof(MemfsStatistics));
+			*pBytesTransferred = sizeof(MemfsStatistics);
+			return STATUS_SUCCESS;
+		}
+
+		// WinFsp has no callback for FileLinkInformation, so hard links are created through this IOCTL
+		if (MEMFS_IOCTL_AUTHORIZE_HARD_LINK == controlCode) {
+			if (outputBufferLength < sizeof(UINT64)) {
+				return STATUS_BUFFER_TOO_SMALL;
+			}
+			if (!(GetFileNode(fileNode)->fileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+				return STATUS_NOT_A_DIRECTORY;
+			}
+
+			const UINT64 ticket = GetMemFs(fileSystem)->AuthorizeLink(*GetFileNode(fileNode));
+			memcpy(outputBuffer, &ticket, sizeof(UINT64));
+			*pBytesTransferred = sizeof(UINT64);
+			return STATUS_SUCCESS;
+		}
+
+		if (MEMFS_IOCTL_CREATE_HARD_LINK == controlCode) {
+			if (inputBufferLength <= sizeof(UINT64) || 0 != inputBufferLength % sizeof(WCHAR)) {
+				return STATUS_INVALID_PARAMETER;
+			}
+
+			UINT64 ticket;
+			memcpy(&ticket, inputBuffer, sizeof(UINT64));
+			const std::wstring_view linkName(reinterpret_cast<PWSTR>(static_cast<byte*>(inputBuffer) + sizeof(UINT64)), (inputBufferLength - sizeof(UINT64)) / sizeof(WCHAR));
+			MemFs* memfs = GetMemFs(fileSystem);
+
+			// The link name is checked for the snapshots once it is resolved
+			if (IsReadOnly(memfs, *GetFileNode(fileNode))) {
+				return STATUS_MEDIA_WRITE_PROTECTED;
+			}
+
+			OperationGuard guard(fileSystem, true);
+			return memfs->CreateLink(*GetFileNode(fileNode), linkName, ticket);
+		}
+
+		// WinFsp rejects FILE_OPEN_BY_FILE_ID, so opening by ID resolves the path here first
+		if (MEMFS_IOCTL_QUERY_FILE_PATH == controlCode) {
+			if (inputBufferLength != sizeof(UINT64)) {
+				return STATUS_INVALID_PARAMETER;
+			}
+
+			OperationGuard guard(fileSystem, false);
+
+			const auto entryOpt = GetMemFs(fileSystem)->FindEntryById(*static_cast<PUINT64>(inputBuffer));
+			if (!entryOpt.has_value()) {
+				return STATUS_INVALID_PARAMETER; // Like NTFS for unknown IDs
+			}
+			const FileNode& entry = entryOpt.value();
+
+			const ULONG pathByteSize = (ULONG)(entry.fileName.length() * sizeof(WCHAR));
+			if (outputBufferLength < pathByteSize) {
+				return STATUS_BUFFER_TOO_SMALL;
+			}
+
+			memcpy(outputBuffer, entry.fileName.c_str(), pathByteSize);
+			*pBytesTransferred = pathByteSize;
+			return STATUS_SUCCESS;
+		}
+
+		if (MEMFS_IOCTL_SAVE_SNAPSHOT == controlCode) {
+			MemFs* memfs = GetMemFs(fileSystem);
+			if (memfs->GetSnapshotPath().empty()) {
+				return STATUS_INVALID_DEVICE_REQUEST;
+			}
+
+			return memfs->SaveSnapshotImage(); // Takes the operation guard itself, after the checkpoint mutex
+		}
+
+		if (MEMFS_IOCTL_TAKE_VOLUME_SNAPSHOT == controlCode || MEMFS_IOCTL_DELETE_VOLUME_SNAPSHOT == controlCode || MEMFS_IOCTL_ROLLBACK_VOLUME_SNAPSHOT == controlCode) {
+			if (0 == inputBufferLength || 0 != inputBufferLength % sizeof(WCHAR)) {
+				return STATUS_INVALID_PARAMETER;
+			}
+
+			MemFs* memfs = GetMemFs(fileSystem);
+			const std::wstring_view name(static_cast<PWSTR>(inputBuffer), inputBufferLength / sizeof(WCHAR));
+
+			OperationGuard guard(fileSystem, true);
+			if (MEMFS_IOCTL_TAKE_VOLUME_SNAPSHOT == controlCode) {
+				return memfs->TakeVolumeSnapshot(name);
+			}
+			if (MEMFS_IOCTL_DELETE_VOLUME_SNAPSHOT == controlCode) {
+				return memfs->DeleteVolumeSnapshot(name);
+			}
+			return memfs->RollbackVolumeSnapshot(name);
+		}
+
 		return STATUS_INVALID_DEVICE_REQUEST;
 	}
 }
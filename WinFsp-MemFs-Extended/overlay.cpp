@@ -0,0 +1,280 @@
+#include "globalincludes.h"
+#include "overlay.h"
+
+#include "memfs.h"
+
+using namespace Memfs;
+
+Overlay::Overlay(MemFs& memfs, const std::wstring& lowerPath) : memfs(memfs), lowerPath(lowerPath) {}
+
+Overlay::~Overlay() {
+	if (this->image != nullptr) {
+		UnmapViewOfFile(this->image);
+	}
+}
+
+NTSTATUS Overlay::Attach(PreloadStatistics& statistics) {
+	const DWORD attributes = GetFileAttributesW(this->lowerPath.c_str());
+	if (INVALID_FILE_ATTRIBUTES == attributes) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	if (attributes & FILE_ATTRIBUTE_DIRECTORY) {
+		return HostPreloader(this->memfs, this->lowerPath, true).Run(statistics);
+	}
+
+	const ULONGLONG startTicks = GetTickCount64();
+	const NTSTATUS result = this->AttachImage();
+	if (!NT_SUCCESS(result)) {
+		return result;
+	}
+
+	statistics = {};
+	try {
+		const auto rootNode = this->memfs.FindFile(L"\\");
+		for (const FileNode* node : this->memfs.EnumerateDescendants(rootNode.value(), false)) {
+			if (node == &rootNode.value().get() || node->IsLink()) {
+				continue;
+			}
+
+			if (node->fileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				statistics.Directories++;
+			} else {
+				statistics.Files++;
+				statistics.Bytes += node->fileInfo.FileSize;
+			}
+		}
+	} catch (std::bad_alloc&) {
+		// Only the statistics are missing
+	}
+	statistics.Milliseconds = GetTickCount64() - startTicks;
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS Overlay::AttachImage() {
+	const HANDLE file = CreateFileW(this->lowerPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || (UINT64)fileSize.QuadPart < sizeof(SnapshotHeader)) {
+		CloseHandle(file);
+		return STATUS_FILE_CORRUPT_ERROR;
+	}
+
+	const HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (mapping == nullptr) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	// The view keeps the image open, so that it cannot be changed underneath the volume
+	this->image = static_cast<const byte*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	CloseHandle(mapping);
+	if (this->image == nullptr) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+	this->imageSize = (UINT64)fileSize.QuadPart;
+
+	return this->memfs.LoadSnapshot(this->image, this->imageSize, SnapshotData::Lazy);
+}
+
+NTSTATUS Overlay::Hydrate(FileNode& node) {
+	std::lock_guard lock(this->GetHydrationLock(node));
+	if (!node.NeedsHydration()) {
+		return STATUS_SUCCESS; // Hydrated by a concurrent access
+	}
+
+	const UINT64 fileSize = node.fileInfo.FileSize;
+	const UINT64 allocationSize = SectorManager::AlignSize(max(node.fileInfo.AllocationSize, fileSize));
+	if (allocationSize > this->memfs.CalculateAvailableTotalSize() || this->memfs.IsMemoryCritical()) {
+		return STATUS_DISK_FULL;
+	}
+
+	try {
+		SectorNode& sectorNode = node.GetSectorNode();
+		if (0 != allocationSize && !this->memfs.GetSectorManager().ReAllocate(sectorNode, allocationSize)) {
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		node.fileInfo.AllocationSize = allocationSize;
+
+		if (this->image != nullptr) {
+			// Bounds of the image were checked when it was indexed
+			if (0 != fileSize && !SectorManager::ReadWrite<false>(sectorNode, (void*)(this->image + node.GetLowerOffset()), fileSize, 0)) {
+				return STATUS_INSUFFICIENT_RESOURCES; // Tiny files may need their sector only now
+			}
+		} else if (0 != fileSize) {
+			const HANDLE file = this->OpenLower(node);
+			if (INVALID_HANDLE_VALUE == file) {
+				return STATUS_UNEXPECTED_IO_ERROR;
+			}
+
+			NTSTATUS result = STATUS_SUCCESS;
+			try {
+				std::vector<byte> buffer((size_t)min(fileSize, (UINT64)READ_BUFFER_SIZE));
+				for (UINT64 offset = 0; NT_SUCCESS(result) && offset < fileSize; offset += buffer.size()) {
+					const size_t copyNow = (size_t)min((UINT64)buffer.size(), fileSize - offset);
+					if (!this->ReadLower(node, file, buffer.data(), copyNow, offset)) {
+						result = STATUS_UNEXPECTED_IO_ERROR;
+					} else if (!SectorManager::ReadWrite<false>(sectorNode, buffer.data(), copyNow, offset)) {
+						result = STATUS_INSUFFICIENT_RESOURCES;
+					}
+				}
+			} catch (std::bad_alloc&) {
+				result = STATUS_INSUFFICIENT_RESOURCES;
+			}
+
+			CloseHandle(file);
+			if (!NT_SUCCESS(result)) {
+				return result;
+			}
+		}
+	} catch (std::bad_alloc&) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	node.ClearLowerSource();
+	node.MarkMetadataChanged();
+	return STATUS_SUCCESS;
+}
+
+void Overlay::Discard(FileNode& node) {
+	std::lock_guard lock(this->GetHydrationLock(node));
+	if (!node.NeedsHydration()) {
+		return;
+	}
+
+	// The allocation size was only reported, so the caller allocates again from nothing
+	node.fileInfo.AllocationSize = 0;
+	node.fileInfo.FileSize = 0;
+	node.ClearLowerSource();
+	node.MarkMetadataChanged();
+}
+
+bool Overlay::Share(FileNode& source, FileNode& target) {
+	std::lock_guard lock(this->GetHydrationLock(source));
+	if (source.NeedsHydration()) {
+		// The target has a name of its own, so a lower host file is only found again by the name of the source
+		target.SetLowerSource(source.GetLowerOffset(), this->image == nullptr ? source.GetLowerName() : std::wstring_view());
+		target.fileInfo.FileSize = source.fileInfo.FileSize; // Bounds the reads from the lower layer
+		return true;
+	}
+
+	try {
+		if (0 == source.fileInfo.AllocationSize) {
+			target.fileInfo.FileSize = 0;
+			return true;
+		}
+		return this->memfs.GetSectorManager().Share(source.GetSectorNode(), target.GetSectorNode(), source.fileInfo.FileSize, target.fileInfo.FileSize);
+	} catch (std::bad_alloc&) {
+		return false;
+	}
+}
+
+bool Overlay::Read(FileNode& node, void* buffer, const size_t size, const UINT64 offset) {
+	std::lock_guard lock(this->GetHydrationLock(node));
+	if (!node.NeedsHydration()) {
+		try {
+			return SectorManager::ReadWrite<true>(node.GetSectorNode(), buffer, size, offset);
+		} catch (std::bad_alloc&) {
+			return false;
+		}
+	}
+
+	if (this->image != nullptr) {
+		return this->ReadLower(node, INVALID_HANDLE_VALUE, buffer, size, offset);
+	}
+
+	const HANDLE file = this->OpenLower(node);
+	if (INVALID_HANDLE_VALUE == file) {
+		return false;
+	}
+
+	const bool success = this->ReadLower(node, file, buffer, size, offset);
+	CloseHandle(file);
+	return success;
+}
+
+void Overlay::KeepLowerName(FileNode& node) {
+	std::lock_guard lock(this->GetHydrationLock(node));
+	if (node.NeedsHydration() && this->image == nullptr) {
+		node.SetLowerSource(0, node.GetLowerName());
+	}
+}
+
+HANDLE Overlay::OpenLower(const FileNode& node) const {
+	const std::wstring path = this->lowerPath + std::wstring(node.GetLowerName());
+	return CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+}
+
+bool Overlay::ReadLower(const FileNode& node, const HANDLE file, void* buffer, const size_t size, const UINT64 offset) {
+	if (this->image != nullptr) {
+		memcpy(buffer, this->image + node.GetLowerOffset() + offset, size);
+		return true;
+	}
+
+	LARGE_INTEGER position;
+	position.QuadPart = (LONGLONG)offset;
+	bool success = SetFilePointerEx(file, position, nullptr, FILE_BEGIN);
+
+	size_t bytesDone = 0;
+	while (success && bytesDone < size) {
+		DWORD bytesRead = 0;
+		success = ReadFile(file, static_cast<byte*>(buffer) + bytesDone, (DWORD)min(size - bytesDone, (size_t)READ_BUFFER_SIZE), &bytesRead, nullptr);
+		if (0 == bytesRead) {
+			break;
+		}
+		bytesDone += bytesRead;
+	}
+
+	// A host file, which shrank since it was indexed, reads as zeros beyond its end
+	if (success) {
+		memset(static_cast<byte*>(buffer) + bytesDone, 0, size - bytesDone);
+	}
+
+	return success;
+}
+
+std::mutex& Overlay::GetHydrationLock(const FileNode& node) {
+	return this->hydrationLocks[node.fileInfo.IndexNumber % HYDRATION_LOCK_COUNT];
+}
+
+
+NTSTATUS MemFs::AttachOverlay(const std::wstring& lowerPath, PreloadStatistics& statistics) {
+	this->overlay = std::make_unique<Overlay>(*this, lowerPath);
+	return this->overlay->Attach(statistics);
+}
+
+NTSTATUS MemFs::HydrateFile(FileNode& node) {
+	if (!node.NeedsHydration()) {
+		return STATUS_SUCCESS;
+	}
+
+	return this->overlay->Hydrate(node);
+}
+
+void MemFs::KeepLowerName(FileNode& node) {
+	if (node.NeedsHydration()) {
+		this->overlay->KeepLowerName(node);
+	}
+}
+
+void MemFs::DiscardHydration(FileNode& node) {
+	if (node.NeedsHydration()) {
+		this->overlay->Discard(node);
+	}
+}
+
+bool MemFs::ReadContents(FileNode& node, void* buffer, const size_t size, const UINT64 offset) {
+	if (this->overlay) {
+		return this->overlay->Read(node, buffer, size, offset);
+	}
+
+	try {
+		return SectorManager::ReadWrite<true>(node.GetSectorNode(), buffer, size, offset);
+	} catch (std::bad_alloc&) {
+		return false;
+	}
+}
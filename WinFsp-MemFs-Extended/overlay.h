@@ -0,0 +1,62 @@
+#pragma once
+
+#include "globalincludes.h"
+
+#include "preload.h"
+
+namespace Memfs {
+	class MemFs;
+	class FileNode;
+
+	/**
+	 * \brief Read-only lower layer of the volume (-O), which is a host directory or a snapshot image.
+	 * Only its metadata is indexed at mount; The contents of a file are hydrated into its sectors on first access, so that memory grows with the working set.
+	 * Writes and deletes only change the volume, the lower layer itself is never modified.
+	 */
+	class Overlay {
+	public:
+		static constexpr size_t HYDRATION_LOCK_COUNT = 64; // Striped by file ID
+		static constexpr size_t READ_BUFFER_SIZE = 1024 * 1024;
+
+		Overlay(MemFs& memfs, const std::wstring& lowerPath);
+		~Overlay();
+
+		Overlay(const Overlay& other) = delete;
+		Overlay(Overlay&& other) noexcept = delete;
+		Overlay& operator=(const Overlay& other) = delete;
+		Overlay& operator=(Overlay&& other) noexcept = delete;
+
+		/**
+		 * \brief Indexes the lower layer into the volume; Only used before the file system is started
+		 */
+		NTSTATUS Attach(PreloadStatistics& statistics);
+
+		NTSTATUS Hydrate(FileNode& node);
+		// Drops the lower contents of a file, which is overwritten anyway
+		void Discard(FileNode& node);
+		// Lets a volume snapshot (see MemFs::TakeVolumeSnapshot) use the same lower contents or the same sectors
+		bool Share(FileNode& source, FileNode& target);
+		// Remembers where the lower contents of a file are, before it is renamed
+		void KeepLowerName(FileNode& node);
+		/**
+		 * \brief Reads the contents of a file without hydrating them, e.g. to save the volume; Missing bytes are read as zeros
+		 * \return False if the contents could not be read
+		 */
+		bool Read(FileNode& node, void* buffer, const size_t size, const UINT64 offset);
+
+	private:
+		NTSTATUS AttachImage();
+		// Host file of a lower host directory, which is found by the lower name of the node
+		HANDLE OpenLower(const FileNode& node) const;
+		// The caller holds the hydration lock of the node; The file is only used for a lower host directory
+		bool ReadLower(const FileNode& node, const HANDLE file, void* buffer, const size_t size, const UINT64 offset);
+		std::mutex& GetHydrationLock(const FileNode& node);
+
+		MemFs& memfs;
+		std::wstring lowerPath; // Host directory or snapshot image; Host files are only found by their names below it
+		const byte* image{nullptr}; // Mapped for as long as the volume exists, if the lower layer is a snapshot image
+		UINT64 imageSize{0};
+
+		std::array<std::mutex, HYDRATION_LOCK_COUNT> hydrationLocks;
+	};
+}
@@ -0,0 +1,345 @@
+#include "globalincludes.h"
+#include "exceptions.h"
+#include "preload.h"
+
+#include "memfs.h"
+
+using namespace Memfs;
+
+// Attributes, which only describe the host storage, are dropped
+static constexpr DWORD PRELOADED_ATTRIBUTES = FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_DIRECTORY
+	| FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_TEMPORARY | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED;
+
+static UINT64 FileTimeToUint64(const FILETIME& time) {
+	return ((UINT64)time.dwHighDateTime << 32) | time.dwLowDateTime;
+}
+
+static void ApplyFindData(FileNode& node, const WIN32_FIND_DATAW& findData, const SharedSecurityDescriptor& security) {
+	node.fileInfo.FileAttributes = findData.dwFileAttributes & PRELOADED_ATTRIBUTES;
+	node.fileInfo.CreationTime = FileTimeToUint64(findData.ftCreationTime);
+	node.fileInfo.LastAccessTime = FileTimeToUint64(findData.ftLastAccessTime);
+	node.fileInfo.LastWriteTime = node.fileInfo.ChangeTime = FileTimeToUint64(findData.ftLastWriteTime);
+	node.fileSecurity = security; // Host ACLs do not apply to the volume, so everything inherits the root's
+}
+
+HostPreloader::HostPreloader(MemFs& memfs, const std::wstring& hostPath, const bool indexOnly) : memfs(memfs), hostPath(hostPath), indexOnly(indexOnly) {
+	while (!this->hostPath.empty() && (this->hostPath.back() == L'\\' || this->hostPath.back() == L'/')) {
+		this->hostPath.pop_back();
+	}
+}
+
+NTSTATUS HostPreloader::Run(PreloadStatistics& statistics) {
+	const ULONGLONG startTicks = GetTickCount64();
+
+	const DWORD attributes = GetFileAttributesW(this->hostPath.c_str());
+	if (INVALID_FILE_ATTRIBUTES == attributes) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+	if (!(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		return STATUS_NOT_A_DIRECTORY;
+	}
+
+	const auto rootNode = this->memfs.FindFile(L"\\");
+	if (!rootNode.has_value()) {
+		return STATUS_OBJECT_PATH_NOT_FOUND;
+	}
+	this->rootSecurity = rootNode.value().get().fileSecurity;
+
+	try {
+		WorkItem rootItem{this->hostPath, L"\\", {}};
+		rootItem.FindData.dwFileAttributes = FILE_ATTRIBUTE_DIRECTORY;
+		this->pendingItems.push_back(std::move(rootItem));
+
+		std::vector<std::thread> threads;
+		const unsigned int threadCount = max(MIN_THREAD_COUNT, std::thread::hardware_concurrency());
+		threads.reserve(threadCount);
+		for (unsigned int t = 1; t < threadCount; t++) {
+			try {
+				threads.emplace_back(&HostPreloader::Work, this);
+			} catch (std::system_error&) {
+				break; // The remaining threads do the work
+			}
+		}
+
+		this->Work();
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+	} catch (std::bad_alloc&) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	for (const auto& [directory, times] : this->directoryTimes) {
+		directory->fileInfo.CreationTime = times.CreationTime;
+		directory->fileInfo.LastAccessTime = times.LastAccessTime;
+		directory->fileInfo.LastWriteTime = times.LastWriteTime;
+		directory->fileInfo.ChangeTime = times.ChangeTime;
+		directory->MarkMetadataChanged();
+	}
+	this->memfs.GetNegativeLookups().Clear();
+
+	statistics.Directories = this->directories;
+	statistics.Files = this->files;
+	statistics.Bytes = this->bytes;
+	statistics.Skipped = this->skipped;
+	statistics.Milliseconds = GetTickCount64() - startTicks;
+
+	return this->failure;
+}
+
+void HostPreloader::Work() {
+	std::vector<byte> buffer;
+	try {
+		if (!this->indexOnly) {
+			buffer.resize(READ_BUFFER_SIZE);
+		}
+	} catch (std::bad_alloc&) {
+		return; // The other threads do the work
+	}
+
+	std::unique_lock lock(this->queueMutex);
+
+	while (true) {
+		// Done once nothing is left and no busy thread can add more
+		this->queueCondition.wait(lock, [this] {
+			return !this->pendingItems.empty() || 0 == this->busyThreads || !NT_SUCCESS(this->failure);
+		});
+		if (this->pendingItems.empty() || !NT_SUCCESS(this->failure)) {
+			break;
+		}
+
+		const WorkItem item = std::move(this->pendingItems.back());
+		this->pendingItems.pop_back();
+		this->busyThreads++;
+		lock.unlock();
+
+		try {
+			if (item.FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				this->LoadDirectory(item);
+			} else {
+				this->LoadFile(item, buffer);
+			}
+		} catch (std::bad_alloc&) {
+			this->Fail(STATUS_INSUFFICIENT_RESOURCES);
+		}
+
+		lock.lock();
+		this->busyThreads--;
+		if (0 == this->busyThreads && this->pendingItems.empty()) {
+			this->queueCondition.notify_all();
+		}
+	}
+}
+
+void HostPreloader::LoadDirectory(const WorkItem& item) {
+	const bool isRoot = item.VolumePath == L"\\";
+
+	if (!isRoot) {
+		FileNodePtr nodePtr;
+		try {
+			nodePtr = FileNode::Create(item.VolumePath, this->memfs.GetMetadata());
+		} catch (FileNameTooLongException&) {
+			this->skipped++;
+			return;
+		}
+
+		FileNode* newNode = nodePtr.get();
+		ApplyFindData(*newNode, item.FindData, this->rootSecurity);
+
+		const FileNode* node = this->InsertNode(std::move(nodePtr));
+		if (node == nullptr) {
+			return;
+		}
+
+		// Directories, which already exist, are merged
+		if (node != newNode) {
+			if (!(node->fileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+				this->skipped++;
+				return;
+			}
+		} else {
+			std::lock_guard insertLock(this->insertMutex);
+			this->directoryTimes.emplace_back(newNode, newNode->fileInfo);
+			this->directories++;
+		}
+	}
+
+	WIN32_FIND_DATAW findData;
+	const HANDLE find = FindFirstFileExW((item.HostPath + L"\\*").c_str(), FindExInfoBasic, &findData, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+	if (INVALID_HANDLE_VALUE == find) {
+		this->skipped++;
+		return;
+	}
+
+	std::vector<WorkItem> children;
+	do {
+		const std::wstring_view name(findData.cFileName);
+		if (name == L"." || name == L"..") {
+			continue;
+		}
+
+		// Symbolic links and junctions are not followed, they might leave the tree
+		if (findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+			this->skipped++;
+			continue;
+		}
+
+		children.push_back(WorkItem{item.HostPath + L"\\" + std::wstring(name), (isRoot ? L"" : item.VolumePath) + L"\\" + std::wstring(name), findData});
+	} while (FindNextFileW(find, &findData));
+	FindClose(find);
+
+	{
+		std::lock_guard queueLock(this->queueMutex);
+		this->pendingItems.insert(this->pendingItems.end(), std::make_move_iterator(children.begin()), std::make_move_iterator(children.end()));
+	}
+	this->queueCondition.notify_all();
+}
+
+void HostPreloader::LoadFile(const WorkItem& item, std::vector<byte>& buffer) {
+	const UINT64 hostSize = ((UINT64)item.FindData.nFileSizeHigh << 32) | item.FindData.nFileSizeLow;
+	const UINT64 allocationSize = SectorManager::AlignSize(hostSize);
+
+	if (!this->indexOnly && (this->memfs.IsMemoryCritical() || !this->ReserveBytes(allocationSize))) {
+		this->Fail(STATUS_DISK_FULL);
+		return;
+	}
+
+	FileNodePtr nodePtr;
+	try {
+		nodePtr = FileNode::Create(item.VolumePath, this->memfs.GetMetadata());
+	} catch (FileNameTooLongException&) {
+		this->ReleaseBytes(allocationSize);
+		this->skipped++;
+		return;
+	} catch (...) {
+		this->ReleaseBytes(allocationSize);
+		throw;
+	}
+
+	FileNode* newNode = nodePtr.get();
+	ApplyFindData(*newNode, item.FindData, this->rootSecurity);
+
+	newNode->fileInfo.AllocationSize = allocationSize;
+
+	if (this->indexOnly) {
+		// Reported, but only allocated once the contents are hydrated
+		newNode->fileInfo.FileSize = hostSize;
+		if (0 != hostSize) {
+			newNode->SetLowerSource(0); // Found again below the lower directory by the name of the node
+		}
+	} else {
+		bool copied;
+		try {
+			copied = this->CopyContents(item, *newNode, buffer);
+		} catch (...) {
+			this->ReleaseBytes(allocationSize);
+			throw;
+		}
+
+		this->ReleaseBytes(allocationSize); // Counted as used from now on, or freed with the node
+		if (!copied) {
+			return;
+		}
+	}
+
+	const FileNode* node = this->InsertNode(std::move(nodePtr));
+	if (node == nullptr) {
+		return;
+	}
+	if (node != newNode) {
+		this->skipped++; // Restored from a snapshot image or a name that only differs in case
+		return;
+	}
+
+	this->files++;
+	this->bytes += newNode->fileInfo.FileSize;
+}
+
+bool HostPreloader::CopyContents(const WorkItem& item, FileNode& node, std::vector<byte>& buffer) {
+	const UINT64 allocationSize = node.fileInfo.AllocationSize;
+	if (0 != allocationSize && !this->memfs.GetSectorManager().ReAllocate(node.GetSectorNode(), allocationSize)) {
+		this->Fail(STATUS_INSUFFICIENT_RESOURCES);
+		return false;
+	}
+
+	const HANDLE file = CreateFileW(item.HostPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (INVALID_HANDLE_VALUE == file) {
+		this->skipped++;
+		return false;
+	}
+
+	// Large sequential reads, which are copied into the sectors; A file, which grew since it was listed, is cut off at its listed size
+	UINT64 offset = 0;
+	bool readFailed = false;
+	while (offset < allocationSize) {
+		DWORD bytesRead;
+		if (!ReadFile(file, buffer.data(), (DWORD)min((UINT64)buffer.size(), allocationSize - offset), &bytesRead, nullptr)) {
+			readFailed = true;
+			break;
+		}
+		if (0 == bytesRead) {
+			break;
+		}
+
+		// Tiny files may need their sector only now
+		if (!SectorManager::ReadWrite<false>(node.GetSectorNode(), buffer.data(), bytesRead, offset)) {
+			CloseHandle(file);
+			this->Fail(STATUS_INSUFFICIENT_RESOURCES);
+			return false;
+		}
+		offset += bytesRead;
+	}
+	CloseHandle(file);
+
+	if (readFailed) {
+		this->skipped++;
+		return false;
+	}
+
+	node.fileInfo.FileSize = offset;
+	node.MarkMetadataChanged();
+	return true;
+}
+
+bool HostPreloader::ReserveBytes(const UINT64 bytes) {
+	if (this->indexOnly) {
+		return true;
+	}
+
+	UINT64 reserved = this->reservedBytes.load(std::memory_order_relaxed);
+	do {
+		if (reserved + bytes > this->memfs.CalculateAvailableTotalSize()) {
+			return false;
+		}
+	} while (!this->reservedBytes.compare_exchange_weak(reserved, reserved + bytes, std::memory_order_relaxed));
+
+	return true;
+}
+
+void HostPreloader::ReleaseBytes(const UINT64 bytes) {
+	if (!this->indexOnly) {
+		this->reservedBytes.fetch_sub(bytes, std::memory_order_relaxed);
+	}
+}
+
+FileNode* HostPreloader::InsertNode(FileNodePtr&& node) {
+	std::lock_guard lock(this->insertMutex);
+
+	const auto [result, insertedNode] = this->memfs.InsertNode(std::move(node));
+	if (!NT_SUCCESS(result)) {
+		this->Fail(result);
+		return nullptr;
+	}
+
+	return &insertedNode;
+}
+
+void HostPreloader::Fail(const NTSTATUS status) {
+	NTSTATUS expected = STATUS_SUCCESS;
+	this->failure.compare_exchange_strong(expected, status);
+
+	{
+		std::lock_guard lock(this->queueMutex);
+	}
+	this->queueCondition.notify_all();
+}
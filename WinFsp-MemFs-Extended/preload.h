@@ -0,0 +1,79 @@
+#pragma once
+
+#include "globalincludes.h"
+
+#include "nodes.h"
+
+namespace Memfs {
+	class MemFs;
+
+	struct PreloadStatistics {
+		UINT64 Directories;
+		UINT64 Files;
+		UINT64 Bytes;
+		UINT64 Skipped; // Unreadable files, reparse points, names that are too long or already exist
+		UINT64 Milliseconds;
+	};
+
+	/**
+	 * \brief Copies a host directory tree into the volume with a pool of threads; Only used before the file system is started.
+	 * Directories and files are items of one work queue, so that wide and deep trees keep all threads busy.
+	 */
+	class HostPreloader {
+	public:
+		static constexpr size_t READ_BUFFER_SIZE = 8 * 1024 * 1024;
+		static constexpr unsigned int MIN_THREAD_COUNT = 4; // Threads mostly wait for the disk
+
+		/**
+		 * \param indexOnly Only indexes the metadata and leaves the contents on the host, until they are hydrated (overlay.h)
+		 */
+		HostPreloader(MemFs& memfs, const std::wstring& hostPath, const bool indexOnly = false);
+
+		HostPreloader(const HostPreloader& other) = delete;
+		HostPreloader(HostPreloader&& other) noexcept = delete;
+		HostPreloader& operator=(const HostPreloader& other) = delete;
+		HostPreloader& operator=(HostPreloader&& other) noexcept = delete;
+
+		NTSTATUS Run(PreloadStatistics& statistics);
+
+	private:
+		struct WorkItem {
+			std::wstring HostPath;
+			std::wstring VolumePath;
+			WIN32_FIND_DATAW FindData;
+		};
+
+		void Work();
+		void LoadDirectory(const WorkItem& item);
+		void LoadFile(const WorkItem& item, std::vector<byte>& buffer);
+		// Returns false if the file was skipped or the preload failed
+		bool CopyContents(const WorkItem& item, FileNode& node, std::vector<byte>& buffer);
+		// Takes the bytes from what is left of the volume, until the sectors are allocated and counted as used; Workers, which check at the same time, cannot both get the last bytes
+		bool ReserveBytes(const UINT64 bytes);
+		void ReleaseBytes(const UINT64 bytes);
+		// Serialized, because the map is not safe for concurrent inserts
+		FileNode* InsertNode(FileNodePtr&& node);
+		void Fail(const NTSTATUS status);
+
+		MemFs& memfs;
+		std::wstring hostPath;
+		bool indexOnly;
+		SharedSecurityDescriptor rootSecurity;
+
+		std::vector<WorkItem> pendingItems; // Taken from the back, so that the walk stays depth first and the queue small
+		unsigned int busyThreads{0};
+		std::mutex queueMutex;
+		std::condition_variable queueCondition;
+		std::mutex insertMutex;
+
+		// Directory times are applied last, because inserting the children touches them
+		std::vector<std::pair<FileNode*, FSP_FSCTL_FILE_INFO>> directoryTimes;
+
+		std::atomic<UINT64> directories{0};
+		std::atomic<UINT64> files{0};
+		std::atomic<UINT64> bytes{0};
+		std::atomic<UINT64> skipped{0};
+		std::atomic<NTSTATUS> failure{STATUS_SUCCESS};
+		std::atomic<UINT64> reservedBytes{0};
+	};
+}
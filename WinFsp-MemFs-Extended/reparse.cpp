@@ -22,12 +22,13 @@ namespace Memfs::Interface {
 			return STATUS_NOT_A_REPARSE_POINT;
 		}
 
-		if (fileNode->reparseData.WantedByteSize() > *pSize) {
+		const DynamicStruct<byte>& reparseData = fileNode->GetReparseData();
+		if (reparseData.WantedByteSize() > *pSize) {
 			return STATUS_BUFFER_TOO_SMALL;
 		}
 
-		*pSize = fileNode->reparseData.WantedByteSize();
-		memcpy_s(buffer, *pSize, fileNode->reparseData.Struct(), fileNode->reparseData.WantedByteSize());
+		*pSize = reparseData.WantedByteSize();
+		memcpy_s(buffer, *pSize, reparseData.Struct(), reparseData.WantedByteSize());
 
 		return STATUS_SUCCESS;
 	}
@@ -42,13 +43,20 @@ namespace Memfs::Interface {
 			fileNode = fileNode->GetMainNode();
 		}
 
+		if (IsReadOnly(memfs, *fileNode)) {
+			return STATUS_MEDIA_WRITE_PROTECTED;
+		}
+
+		// WinFsp does not guard this operation, but the child and parent lookups read the file map
+		OperationGuard guard(fileSystem, false);
+
 		if (memfs->HasChild(*fileNode)) {
 			return STATUS_DIRECTORY_NOT_EMPTY;
 		}
 
-		if (fileNode->reparseData.HoldsStruct()) {
+		if (fileNode->GetReparseData().HoldsStruct()) {
 			const NTSTATUS result = FspFileSystemCanReplaceReparsePoint(
-				fileNode->reparseData.Struct(), fileNode->reparseData.WantedByteSize(),
+				const_cast<byte*>(fileNode->GetReparseData().Struct()), fileNode->GetReparseData().WantedByteSize(),
 				buffer, size);
 
 			if (!NT_SUCCESS(result)) {
@@ -57,7 +65,10 @@ namespace Memfs::Interface {
 		}
 
 		try {
-			fileNode->reparseData = DynamicStruct<byte>(size);
+			DynamicStruct<byte> reparseData(size);
+			memcpy_s(reparseData.Struct(), reparseData.ByteSize(), buffer, size);
+
+			fileNode->SetReparseData(std::move(reparseData));
 		} catch (...) {
 			return STATUS_INSUFFICIENT_RESOURCES;
 		}
@@ -65,9 +76,10 @@ namespace Memfs::Interface {
 		fileNode->fileInfo.FileAttributes |= FILE_ATTRIBUTE_REPARSE_POINT;
 		fileNode->fileInfo.ReparseTag = *(PULONG)buffer;
 		/* the first field in a reparse buffer is the reparse tag */
+		fileNode->MarkMetadataChanged();
 
-		memcpy_s(fileNode->reparseData.Struct(), fileNode->reparseData.ByteSize(), buffer, size);
-
+		fileNode->BumpChildrenGeneration(); // Misses below are reparsed from now on
+		memfs->InvalidateParentDirBuffer(*fileNode);
 		return STATUS_SUCCESS;
 	}
 
@@ -81,9 +93,13 @@ namespace Memfs::Interface {
 			fileNode = fileNode->GetMainNode();
 		}
 
-		if (fileNode->reparseData.HoldsStruct()) {
+		if (IsReadOnly(memfs, *fileNode)) {
+			return STATUS_MEDIA_WRITE_PROTECTED;
+		}
+
+		if (fileNode->GetReparseData().HoldsStruct()) {
 			const NTSTATUS result = FspFileSystemCanReplaceReparsePoint(
-				fileNode->reparseData.Struct(), fileNode->reparseData.WantedByteSize(),
+				const_cast<byte*>(fileNode->GetReparseData().Struct()), fileNode->GetReparseData().WantedByteSize(),
 				buffer, size);
 
 			if (!NT_SUCCESS(result)) {
@@ -93,10 +109,21 @@ namespace Memfs::Interface {
 			return STATUS_NOT_A_REPARSE_POINT;
 		}
 
-		fileNode->reparseData = DynamicStruct<byte>(); // Throw away old dynamic struct
+		try {
+			fileNode->SetReparseData(DynamicStruct<byte>()); // Throw away old dynamic struct
+		} catch (...) {
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
 
 		fileNode->fileInfo.FileAttributes &= ~FILE_ATTRIBUTE_REPARSE_POINT;
 		fileNode->fileInfo.ReparseTag = 0;
+		fileNode->MarkMetadataChanged();
+
+		fileNode->BumpChildrenGeneration();
+		{
+			OperationGuard guard(fileSystem, false);
+			memfs->InvalidateParentDirBuffer(*fileNode);
+		}
 		return STATUS_SUCCESS;
 	}
 }
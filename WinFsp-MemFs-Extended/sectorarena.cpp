@@ -0,0 +1,109 @@
+#include "globalincludes.h"
+#include "sectorarena.h"
+
+using namespace Memfs;
+
+SectorArena::SectorArena(const std::wstring& path) : path(path) {}
+
+SectorArena::~SectorArena() {
+	if (this->sectors != nullptr) {
+		UnmapViewOfFile(this->sectors);
+	}
+	if (this->file != INVALID_HANDLE_VALUE) {
+		CloseHandle(this->file);
+	}
+}
+
+NTSTATUS SectorArena::Open(const UINT64 capacity) {
+	this->file = CreateFileW(this->path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (this->file == INVALID_HANDLE_VALUE) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	// Sparse, so that the capacity only takes disk space once it is used; Ignore errors, e.g. on FAT
+	DWORD bytesReturned;
+	DeviceIoControl(this->file, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &bytesReturned, nullptr);
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(this->file, &fileSize)) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	// A file of a larger volume is never cut off
+	this->slotCount = max((capacity + sizeof(Sector) - 1) / sizeof(Sector), (UINT64)fileSize.QuadPart / sizeof(Sector));
+	if (0 == this->slotCount) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	const UINT64 mappedSize = this->slotCount * sizeof(Sector);
+	const HANDLE mapping = CreateFileMappingW(this->file, nullptr, PAGE_READWRITE, (DWORD)(mappedSize >> 32), (DWORD)mappedSize, nullptr);
+	if (mapping == nullptr) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	this->sectors = static_cast<Sector*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+	CloseHandle(mapping);
+	if (this->sectors == nullptr) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	return STATUS_SUCCESS;
+}
+
+Sector* SectorArena::Allocate() {
+	std::lock_guard lock(this->mutex);
+
+	if (!this->freeSlots.empty()) {
+		const UINT64 slot = this->freeSlots.back();
+		this->freeSlots.pop_back();
+		return &this->sectors[slot];
+	}
+
+	if (this->nextSlot < this->slotCount) {
+		return &this->sectors[this->nextSlot++];
+	}
+
+	return nullptr;
+}
+
+void SectorArena::Free(Sector* sector) {
+	std::lock_guard lock(this->mutex);
+
+	try {
+		this->freeSlots.push_back(this->GetSlot(sector));
+	} catch (std::bad_alloc&) {
+		// Only lost until the next restart
+	}
+}
+
+UINT64 SectorArena::GetSlot(const Sector* sector) const {
+	return (UINT64)(sector - this->sectors);
+}
+
+Sector* SectorArena::GetSector(const UINT64 slot) const {
+	return slot < this->slotCount ? &this->sectors[slot] : nullptr;
+}
+
+bool SectorArena::Claim(const UINT64 slot) {
+	if (this->claimedSlots.empty()) {
+		this->claimedSlots.resize(this->slotCount);
+	}
+
+	if (this->claimedSlots[slot]) {
+		return false;
+	}
+
+	this->claimedSlots[slot] = true;
+	this->nextSlot = max(this->nextSlot, slot + 1);
+	return true;
+}
+
+void SectorArena::FinishClaims() {
+	for (UINT64 slot = 0; slot < this->nextSlot; slot++) {
+		if (!this->claimedSlots[slot]) {
+			this->freeSlots.push_back(slot);
+		}
+	}
+
+	std::vector<bool>().swap(this->claimedSlots);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "globalincludes.h"
+
+#include "sectors.h"
+
+namespace Memfs {
+	/**
+	 * \brief Sectors of a hot restartable volume (-H), which live in a mapped host file instead of the process heap.
+	 * The pages of the mapping stay in the system cache when the process exits, so that the next process maps them again without copying any data.
+	 * Which sector belongs to which file is only known from the state saved on stop (MemFs::SaveHotRestartState).
+	 */
+	class SectorArena {
+	public:
+		explicit SectorArena(const std::wstring& path);
+		~SectorArena();
+
+		SectorArena(const SectorArena& other) = delete;
+		SectorArena(SectorArena&& other) noexcept = delete;
+		SectorArena& operator=(const SectorArena& other) = delete;
+		SectorArena& operator=(SectorArena&& other) noexcept = delete;
+
+		/**
+		 * \brief Maps the file with room for at least the capacity; The file is kept open exclusively, so that only one volume uses it
+		 */
+		NTSTATUS Open(const UINT64 capacity);
+
+		// Returns nullptr if the file is full
+		Sector* Allocate();
+		void Free(Sector* sector);
+
+		// Slots number the sectors in the file; Saved states refer to sectors by them
+		[[nodiscard]] UINT64 GetSlot(const Sector* sector) const;
+		// Returns nullptr for a slot outside of the file
+		[[nodiscard]] Sector* GetSector(const UINT64 slot) const;
+		// Marks a slot of a restored state as used; Returns false if it already was, because a volume snapshot shares it
+		bool Claim(const UINT64 slot);
+		// Frees every slot, which was not claimed
+		void FinishClaims();
+
+	private:
+		std::wstring path;
+		HANDLE file{INVALID_HANDLE_VALUE};
+		Sector* sectors{nullptr};
+		UINT64 slotCount{0};
+
+		UINT64 nextSlot{0}; // Slots from here on were never handed out
+		std::vector<UINT64> freeSlots;
+		std::vector<bool> claimedSlots;
+		std::mutex mutex;
+	};
+}
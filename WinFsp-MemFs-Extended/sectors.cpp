@@ -2,10 +2,16 @@
 #include "sectors.h"
 
 #include "memfs.h"
+#include "sectorarena.h"
+#include "accounting.h"
 
 using namespace Memfs;
 
-SectorManager::SectorManager() {
+static UINT32 InlineCapacity(const UINT32 size) {
+	return (size + SectorManager::INLINE_GRANULARITY - 1) / SectorManager::INLINE_GRANULARITY * SectorManager::INLINE_GRANULARITY;
+}
+
+SectorManager::SectorManager(MetadataCounter& metadata) : metadata(&metadata) {
 	this->heap = HeapCreate(0, 0, 0);
 
 	if (this->heap == nullptr || this->heap == INVALID_HANDLE_VALUE) {
@@ -17,7 +23,8 @@ SectorManager::~SectorManager() {
 	HeapDestroy(this->heap); // Ignore errors
 }
 
-SectorManager::SectorManager(SectorManager&& other) noexcept : heap(std::move(other.heap)), allocatedSectors(other.allocatedSectors) {
+SectorManager::SectorManager(SectorManager&& other) noexcept : heap(std::move(other.heap)), arena(std::move(other.arena)), budget(other.budget), metadata(other.metadata),
+                                                                allocatedSectors(other.allocatedSectors), inlineBytes(other.inlineBytes), inlineLimit(other.inlineLimit) {
 	other.heap = nullptr;
 }
 
@@ -26,7 +33,12 @@ SectorManager& SectorManager::operator=(SectorManager&& other) noexcept {
 
 	this->heap = other.heap;
 	other.heap = nullptr;
+	this->arena = std::move(other.arena);
+	this->budget = other.budget;
+	this->metadata = other.metadata;
 	this->allocatedSectors = other.allocatedSectors;
+	this->inlineBytes = other.inlineBytes;
+	this->inlineLimit = other.inlineLimit;
 
 	return *this;
 }
@@ -47,57 +59,92 @@ UINT64 SectorManager::GetSectorAmount(const size_t alignedSize) {
 
 bool SectorManager::ReAllocate(SectorNode& node, const size_t size) {
 	std::unique_lock writeLock(node.SectorsMutex);
-	const SIZE_T vectorSize = node.Sectors.size();
-
-	const SIZE_T oldSize = vectorSize * FULL_SECTOR_SIZE;
 	const SIZE_T alignedSize = AlignSize(size);
 	const UINT64 wantedSectorCount = GetSectorAmount(alignedSize);
 
+	// A single sector is only allocated once it is written beyond the inline limit
+	if (node.Inline || (1 == wantedSectorCount && 0 != this->inlineLimit && node.GetSectors().empty())) {
+		if (1 == wantedSectorCount) {
+			node.Inline = true;
+			node.Manager = this;
+			return true;
+		}
+
+		if (0 == wantedSectorCount) {
+			this->ResizeInline(node, 0);
+			node.Inline = false;
+			return true;
+		}
+
+		if (!this->PromoteInline(node)) {
+			return false;
+		}
+	}
+
+	// Shared sectors are copied first, but only the ones, which are kept; Freeing the node only drops its reference
+	if (node.Shared != nullptr) {
+		if (wantedSectorCount == node.Shared->Sectors.size()) {
+			return true;
+		}
+		if (!this->Unshare(node, wantedSectorCount)) {
+			return false;
+		}
+	}
+
+	const SIZE_T vectorSize = node.Sectors.size();
+	const SIZE_T oldCapacity = node.Sectors.capacity() + node.DirtySectors.capacity();
+
 	if (vectorSize < wantedSectorCount) {
 		// Allocate
 		const SIZE_T sectorDifference = wantedSectorCount - vectorSize;
-		InterlockedExchangeAdd(&this->allocatedSectors, sectorDifference);
+		if (!this->ReserveSectors(sectorDifference)) {
+			return false;
+		}
 
+		node.Manager = this; // Accounts the vectors from now on
 		try {
 			node.Sectors.resize(wantedSectorCount);
-		} catch (std::bad_alloc&) {
-			// Deallocate again to old size after failed allocation
-			if (oldSize < vectorSize) {
-				writeLock.unlock();
-				this->ReAllocate(node, oldSize);
+			if (this->trackDirty) {
+				node.DirtySectors.resize((wantedSectorCount + 63) / 64);
 			}
-
+			this->metadata->Add((INT64)((node.Sectors.capacity() + node.DirtySectors.capacity() - oldCapacity) * sizeof(Sector*)));
+		} catch (std::bad_alloc&) {
+			node.Sectors.resize(vectorSize); // Keeps the capacity, which is accounted from now on
+			this->metadata->Add((INT64)((node.Sectors.capacity() + node.DirtySectors.capacity() - oldCapacity) * sizeof(Sector*)));
+			this->ReleaseSectors(sectorDifference);
 			return false;
 		}
 
-
 		for (UINT64 i = vectorSize; i < wantedSectorCount; i++) {
-			try {
-				Sector* allocPtr = static_cast<Sector*>(HeapAlloc(this->heap, 0, sizeof(Sector)));
-				if (allocPtr == nullptr) {
-					throw std::bad_alloc();
+			Sector* allocPtr = this->AllocateSector();
+			if (allocPtr == nullptr) {
+				// Back to the old size after a failed allocation
+				for (UINT64 j = vectorSize; j < i; j++) {
+					this->FreeSector(node.Sectors[j]);
 				}
-
-				node.Sectors[i] = allocPtr;
-			} catch (std::bad_alloc&) {
-				// Deallocate again to old size after failed allocation
-				if (oldSize < vectorSize) {
-					writeLock.unlock();
-					this->ReAllocate(node, oldSize);
+				node.Sectors.resize(vectorSize);
+				if (!node.DirtySectors.empty()) {
+					node.DirtySectors.resize((vectorSize + 63) / 64);
 				}
+				this->ReleaseSectors(sectorDifference);
 
 				return false;
 			}
+
+			node.Sectors[i] = allocPtr;
 		}
 	} else if (vectorSize > wantedSectorCount) {
 		// Deallocate
+		const UINT64 sectorDifference = vectorSize - wantedSectorCount;
 		for (UINT64 i = wantedSectorCount; i < vectorSize; i++) {
-			HeapFree(this->heap, 0, node.Sectors[i]);
+			this->FreeSector(node.Sectors[i]);
 		}
 
 		node.Sectors.resize(wantedSectorCount);
-		const UINT64 sectorDifference = vectorSize - wantedSectorCount;
-		InterlockedExchangeSubtract(&this->allocatedSectors, sectorDifference);
+		if (!node.DirtySectors.empty()) {
+			node.DirtySectors.resize((wantedSectorCount + 63) / 64); // Keeps the capacity
+		}
+		this->ReleaseSectors(sectorDifference);
 	}
 
 	return true;
@@ -107,6 +154,336 @@ bool SectorManager::Free(SectorNode& node) {
 	return ReAllocate(node, 0);
 }
 
+bool SectorManager::Share(SectorNode& source, SectorNode& target, const UINT64& sourceSize, UINT64& sharedSize) {
+	// Exclusively, so that the target never sees a write that is only half done
+	std::unique_lock sourceLock(source.SectorsMutex);
+	std::unique_lock targetLock(target.SectorsMutex);
+
+	// A resize reallocates the sectors before it sets the size, so a size past the sectors belongs to a truncation in progress
+	sharedSize = min(sourceSize, source.Inline ? (UINT64)FULL_SECTOR_SIZE : (UINT64)source.GetSectors().size() * FULL_SECTOR_SIZE);
+
+	// Small enough to be copied right away
+	if (source.Inline) {
+		if (target.Inline || !target.GetSectors().empty() || !this->ResizeInline(target, source.InlineSize)) {
+			return false;
+		}
+
+		if (0 != source.InlineSize) {
+			memcpy(target.InlineBytes, source.InlineBytes, source.InlineSize);
+		}
+		target.Inline = true;
+		target.Manager = this;
+		return true;
+	}
+
+	return this->ShareSectors(source, target);
+}
+
+bool SectorManager::ShareSectors(SectorNode& source, SectorNode& target) {
+	if (source.GetSectors().empty() || target.Inline || !target.GetSectors().empty()) {
+		return source.GetSectors().empty() && !target.Inline;
+	}
+
+	target.Manager = this;
+	const SIZE_T oldCapacity = target.DirtySectors.capacity();
+	try {
+		if (this->trackDirty) {
+			target.DirtySectors.assign((source.GetSectors().size() + 63) / 64, ~0ULL); // Unknown to the checkpoints so far
+		}
+
+		// The sectors vector of the source becomes the shared one, so sharing costs the same for every size
+		if (source.Shared == nullptr) {
+			source.Shared = new SharedSectors{std::move(source.Sectors)};
+			this->metadata->Add((INT64)sizeof(SharedSectors));
+		}
+	} catch (std::bad_alloc&) {
+		target.DirtySectors.clear();
+		this->metadata->Add((INT64)((target.DirtySectors.capacity() - oldCapacity) * sizeof(Sector*)));
+		return false;
+	}
+	this->metadata->Add((INT64)((target.DirtySectors.capacity() - oldCapacity) * sizeof(Sector*)));
+
+	InterlockedIncrement(&source.Shared->Owners);
+	target.Shared = source.Shared;
+	return true;
+}
+
+bool SectorManager::Unshare(SectorNode& node, const UINT64 keepCount) {
+	SharedSectors* shared = node.Shared;
+	this->metadata->Add(-(INT64)(node.Sectors.capacity() * sizeof(Sector*)));
+
+	// The other owners are gone, e.g. a deleted volume snapshot, so the sectors are taken back without copying; Nobody can share them meanwhile, as that needs the mutex of this node
+	if (1 == InterlockedCompareExchange(&shared->Owners, 0, 1)) {
+		node.Sectors = std::move(shared->Sectors);
+		node.Shared = nullptr;
+		delete shared;
+		this->metadata->Add(-(INT64)sizeof(SharedSectors));
+		return true;
+	}
+
+	const UINT64 count = min(keepCount, (UINT64)shared->Sectors.size());
+	SectorVector copies;
+	if (!this->ReserveSectors(count)) {
+		this->metadata->Add((INT64)(node.Sectors.capacity() * sizeof(Sector*)));
+		return false;
+	}
+
+	try {
+		copies.reserve(count);
+	} catch (std::bad_alloc&) {
+		this->metadata->Add((INT64)(node.Sectors.capacity() * sizeof(Sector*)));
+		this->ReleaseSectors(count);
+		return false;
+	}
+
+	for (UINT64 i = 0; i < count; i++) {
+		Sector* copy = this->AllocateSector();
+		if (copy == nullptr) {
+			for (Sector* sector : copies) {
+				this->FreeSector(sector);
+			}
+			this->metadata->Add((INT64)(node.Sectors.capacity() * sizeof(Sector*)));
+			this->ReleaseSectors(count);
+			return false;
+		}
+
+		memcpy(copy, shared->Sectors[i], sizeof(Sector));
+		copies.push_back(copy);
+	}
+
+	this->metadata->Add((INT64)(copies.capacity() * sizeof(Sector*)));
+	node.Sectors = std::move(copies);
+	node.Shared = nullptr;
+	this->ReleaseShared(shared);
+	return true;
+}
+
+void SectorManager::ReleaseShared(SharedSectors* shared) {
+	if (0 != InterlockedDecrement(&shared->Owners)) {
+		return;
+	}
+
+	for (Sector* sector : shared->Sectors) {
+		this->FreeSector(sector);
+	}
+	this->ReleaseSectors(shared->Sectors.size());
+	this->metadata->Add(-(INT64)(shared->Sectors.capacity() * sizeof(Sector*) + sizeof(SharedSectors)));
+	delete shared;
+}
+
+bool SectorManager::ResizeInline(SectorNode& node, const UINT32 size) {
+	const UINT32 oldCapacity = InlineCapacity(node.InlineSize);
+	const UINT32 newCapacity = InlineCapacity(size);
+
+	if (0 == newCapacity && 0 != oldCapacity) {
+		HeapFree(this->heap, 0, node.InlineBytes);
+		node.InlineBytes = nullptr;
+		InterlockedExchangeSubtract(&this->inlineBytes, (UINT64)oldCapacity);
+		if (this->budget != nullptr) {
+			this->budget->Release(oldCapacity);
+		}
+	} else if (newCapacity > oldCapacity) {
+		const UINT32 difference = newCapacity - oldCapacity;
+		if (this->budget != nullptr && !this->budget->Reserve(difference)) {
+			return false;
+		}
+
+		// Zeroed, so that the bytes between two writes read as zeros
+		void* bytes = nullptr == node.InlineBytes ? HeapAlloc(this->heap, HEAP_ZERO_MEMORY, newCapacity) : HeapReAlloc(this->heap, HEAP_ZERO_MEMORY, node.InlineBytes, newCapacity);
+		if (bytes == nullptr) {
+			if (this->budget != nullptr) {
+				this->budget->Release(difference);
+			}
+			return false;
+		}
+
+		node.InlineBytes = static_cast<byte*>(bytes);
+		InterlockedExchangeAdd(&this->inlineBytes, (UINT64)difference);
+	}
+
+	node.InlineSize = size;
+	return true;
+}
+
+bool SectorManager::PromoteInline(SectorNode& node) {
+	if (!this->ReserveSectors(1)) {
+		return false;
+	}
+
+	Sector* sector = this->AllocateSector();
+	if (sector == nullptr) {
+		this->ReleaseSectors(1);
+		return false;
+	}
+
+	node.Manager = this;
+	const SIZE_T oldCapacity = node.Sectors.capacity();
+	try {
+		node.Sectors.push_back(sector);
+	} catch (std::bad_alloc&) {
+		this->FreeSector(sector);
+		this->ReleaseSectors(1);
+		return false;
+	}
+	this->metadata->Add((INT64)((node.Sectors.capacity() - oldCapacity) * sizeof(Sector*)));
+
+	if (0 != node.InlineSize) {
+		memcpy(sector->Bytes, node.InlineBytes, node.InlineSize);
+	}
+	memset(sector->Bytes + node.InlineSize, 0, FULL_SECTOR_SIZE - node.InlineSize);
+
+	this->ResizeInline(node, 0);
+	node.Inline = false;
+	return true;
+}
+
+bool SectorManager::WriteInline(SectorNode& node, void* buffer, const size_t size, const size_t offset) {
+	const size_t end = offset + size;
+	if (end > FULL_SECTOR_SIZE) {
+		return false; // Beyond the allocation
+	}
+
+	if (end > this->inlineLimit) {
+		if (!this->PromoteInline(node)) {
+			return false;
+		}
+
+		return CopySectors<false>(node, buffer, size, offset);
+	}
+
+	if (end > node.InlineSize && !this->ResizeInline(node, (UINT32)end)) {
+		return false;
+	}
+
+	memcpy(node.InlineBytes + offset, buffer, size);
+	return true;
+}
+
+void SectorManager::UseArena(std::unique_ptr<SectorArena>&& arena) {
+	this->arena = std::move(arena);
+	this->inlineLimit = 0; // Hot restart states only list sectors
+}
+
+void SectorManager::UseBudget(MemoryBudget* budget) {
+	this->budget = budget;
+}
+
+SectorArena* SectorManager::GetArena() const {
+	return this->arena.get();
+}
+
+MetadataCounter& SectorManager::GetMetadata() const {
+	return *this->metadata;
+}
+
+bool SectorManager::AttachSectors(SectorNode& node, const UINT64* slots, const UINT64 count) {
+	// Nodes, which shared their sectors, were saved with the same slots
+	if (0 != count) {
+		const auto owner = this->attachOwners.find(slots[0]);
+		if (this->attachOwners.end() != owner) {
+			const SectorVector& ownerSectors = owner->second->GetSectors();
+			if (ownerSectors.size() != count) {
+				return false;
+			}
+
+			for (UINT64 i = 0; i < count; i++) {
+				if (ownerSectors[i] != this->arena->GetSector(slots[i])) {
+					return false;
+				}
+			}
+
+			return this->ShareSectors(*owner->second, node);
+		}
+	}
+
+	const SIZE_T oldCapacity = node.Sectors.capacity();
+	node.Sectors.resize(count);
+	node.Manager = this;
+	this->metadata->Add((INT64)((node.Sectors.capacity() - oldCapacity) * sizeof(Sector*)));
+
+	for (UINT64 i = 0; i < count; i++) {
+		Sector* sector = this->arena->GetSector(slots[i]);
+		if (sector == nullptr) {
+			node.Sectors.resize(i); // Only the claimed sectors are freed with the node
+			return false;
+		}
+
+		// Owned by another node with different slots
+		if (!this->arena->Claim(slots[i])) {
+			node.Sectors.resize(i);
+			return false;
+		}
+
+		// Already in use, so the budget cannot reject them
+		InterlockedExchangeAdd(&this->allocatedSectors, 1ULL);
+		if (this->budget != nullptr) {
+			this->budget->ForceReserve(sizeof(Sector));
+		}
+		node.Sectors[i] = sector;
+	}
+
+	if (0 != count) {
+		this->attachOwners.try_emplace(slots[0], &node);
+	}
+	return true;
+}
+
+void SectorManager::FinishAttach() {
+	this->arena->FinishClaims();
+	std::unordered_map<UINT64, SectorNode*>().swap(this->attachOwners);
+}
+
+Sector* SectorManager::AllocateSector() {
+	if (this->arena) {
+		return this->arena->Allocate();
+	}
+
+	return static_cast<Sector*>(HeapAlloc(this->heap, 0, sizeof(Sector)));
+}
+
+bool SectorManager::ReserveSectors(const UINT64 count) {
+	if (this->budget != nullptr && !this->budget->Reserve(count * sizeof(Sector))) {
+		return false;
+	}
+
+	InterlockedExchangeAdd(&this->allocatedSectors, count);
+	return true;
+}
+
+void SectorManager::ReleaseSectors(const UINT64 count) {
+	InterlockedExchangeSubtract(&this->allocatedSectors, count);
+	if (this->budget != nullptr) {
+		this->budget->Release(count * sizeof(Sector));
+	}
+}
+
+void SectorManager::FreeSector(Sector* sector) {
+	if (this->arena) {
+		this->arena->Free(sector);
+	} else {
+		HeapFree(this->heap, 0, sector);
+	}
+}
+
+void SectorManager::Compact() {
+	HeapCompact(this->heap, 0);
+}
+
+void SectorManager::EnableDirtyTracking() {
+	this->trackDirty = true;
+	this->inlineLimit = 0; // Checkpoints log dirty sectors
+}
+
+void SectorManager::SetInlineLimit(const UINT32 limit) {
+	if (!this->trackDirty && !this->arena) {
+		this->inlineLimit = min(limit, (UINT32)FULL_SECTOR_SIZE);
+	}
+}
+
+UINT64 SectorManager::TakeDirtySectors(SectorNode& node, const size_t word) {
+	return (UINT64)InterlockedExchange64((volatile LONG64*)&node.DirtySectors[word], 0);
+}
+
 bool SectorManager::IsFullyEmpty() {
 	return this->GetAllocatedSectors() == 0;
 }
@@ -115,6 +492,23 @@ UINT64 SectorManager::GetAllocatedSectors() {
 	return InterlockedExchangeAdd(&this->allocatedSectors, 0ULL);
 }
 
+UINT64 SectorManager::GetInlineBytes() {
+	return InterlockedExchangeAdd(&this->inlineBytes, 0ULL);
+}
+
+// One atomic operation per bitmap word, so that large writes do not pay per sector
+static void MarkDirtySectors(SectorNode& node, const UINT64 first, const UINT64 last) {
+	const UINT64 lastWord = min(last / 64, (UINT64)node.DirtySectors.size() - 1);
+
+	for (UINT64 word = first / 64; word <= lastWord; word++) {
+		const UINT64 from = word == first / 64 ? first % 64 : 0;
+		const UINT64 to = word == last / 64 ? last % 64 : 63;
+		const UINT64 mask = (~0ULL >> (63 - to)) & (~0ULL << from);
+
+		InterlockedOr64((volatile LONG64*)&node.DirtySectors[word], (LONG64)mask);
+	}
+}
+
 template <bool IsReading>
 bool SectorManager::ReadWrite(SectorNode& node, void* buffer, const size_t size, const size_t offset) {
 	if (size == 0) {
@@ -122,7 +516,57 @@ bool SectorManager::ReadWrite(SectorNode& node, void* buffer, const size_t size,
 	}
 
 	std::shared_lock readLock(node.SectorsMutex);
-	const SIZE_T sectorCount = node.Sectors.size();
+	if (node.Inline) {
+		if constexpr (IsReading) {
+			if (offset + size > FULL_SECTOR_SIZE) {
+				return false;
+			}
+
+			// Nothing was written beyond the inline contents
+			const size_t storedSize = offset < node.InlineSize ? min(size, node.InlineSize - offset) : 0;
+			if (0 != storedSize) {
+				memcpy(buffer, node.InlineBytes + offset, storedSize);
+			}
+			memset(static_cast<byte*>(buffer) + storedSize, 0, size - storedSize);
+			return true;
+		} else {
+			if (offset + size <= node.InlineSize) {
+				memcpy(node.InlineBytes + offset, buffer, size);
+				return true;
+			}
+
+			// Growing or promoting the contents needs the mutex exclusively
+			readLock.unlock();
+			std::unique_lock writeLock(node.SectorsMutex);
+			if (node.Inline) {
+				return node.Manager->WriteInline(node, buffer, size, offset);
+			}
+			if (node.Shared != nullptr && !node.Manager->Unshare(node, UINT64_MAX)) {
+				return false;
+			}
+			return CopySectors<IsReading>(node, buffer, size, offset);
+		}
+	}
+
+	if constexpr (!IsReading) {
+		if (node.Shared != nullptr) {
+			// Copying the shared sectors needs the mutex exclusively; Only the first write after sharing pays for it
+			readLock.unlock();
+			std::unique_lock writeLock(node.SectorsMutex);
+			if (node.Shared != nullptr && !node.Manager->Unshare(node, UINT64_MAX)) {
+				return false;
+			}
+			return CopySectors<IsReading>(node, buffer, size, offset);
+		}
+	}
+
+	return CopySectors<IsReading>(node, buffer, size, offset);
+}
+
+template <bool IsReading>
+bool SectorManager::CopySectors(SectorNode& node, void* buffer, const size_t size, const size_t offset) {
+	const SectorVector& sectors = node.GetSectors();
+	const SIZE_T sectorCount = sectors.size();
 
 	const SIZE_T downAlignedOffset = AlignSize(offset, FALSE);
 	const UINT64 offsetSectorBegin = GetSectorAmount(downAlignedOffset);
@@ -139,23 +583,29 @@ bool SectorManager::ReadWrite(SectorNode& node, void* buffer, const size_t size,
 
 	SIZE_T byteAmount = min(size, FULL_SECTOR_SIZE - offsetOffset);
 	if constexpr (IsReading) {
-		memcpy(buffer, node.Sectors[offsetSectorBegin]->Bytes + offsetOffset, byteAmount);
+		memcpy(buffer, sectors[offsetSectorBegin]->Bytes + offsetOffset, byteAmount);
 	} else {
-		memcpy(node.Sectors[offsetSectorBegin]->Bytes + offsetOffset, buffer, byteAmount);
+		memcpy(sectors[offsetSectorBegin]->Bytes + offsetOffset, buffer, byteAmount);
 	}
 
 	for (UINT64 i = offsetSectorBegin + 1; i <= sectorEnd; i++) {
 		const SIZE_T copyNow = min(FULL_SECTOR_SIZE, size - byteAmount);
 
 		if constexpr (IsReading) {
-			memcpy((PVOID)((ULONG_PTR)buffer + byteAmount), node.Sectors[i]->Bytes, copyNow);
+			memcpy((PVOID)((ULONG_PTR)buffer + byteAmount), sectors[i]->Bytes, copyNow);
 		} else {
-			memcpy(node.Sectors[i]->Bytes, (PVOID)((ULONG_PTR)buffer + byteAmount), copyNow);
+			memcpy(sectors[i]->Bytes, (PVOID)((ULONG_PTR)buffer + byteAmount), copyNow);
 		}
 
 		byteAmount += copyNow;
 	}
 
+	if constexpr (!IsReading) {
+		if (!node.DirtySectors.empty()) {
+			MarkDirtySectors(node, offsetSectorBegin, sectorEnd);
+		}
+	}
+
 	return true;
 }
 
@@ -164,20 +614,38 @@ template bool SectorManager::ReadWrite<true>(SectorNode& node, void* buffer, con
 template bool SectorManager::ReadWrite<false>(SectorNode& node, void* buffer, const size_t size, const size_t offset);
 
 
+// The vectors only have a capacity, once the manager is set
 SectorNode::~SectorNode() {
-	SectorManager& sectorManager = MEMFS_SINGLETON->GetSectorManager();
-	sectorManager.Free(*this);
+	if (this->Manager != nullptr) {
+		this->Manager->Free(*this);
+		this->Manager->GetMetadata().Add(-(INT64)((this->Sectors.capacity() + this->DirtySectors.capacity()) * sizeof(Sector*)));
+	}
 }
 
-SectorNode::SectorNode(SectorNode&& other) noexcept : Sectors(std::move(other.Sectors)) {}
+SectorNode::SectorNode(SectorNode&& other) noexcept : Sectors(std::move(other.Sectors)), DirtySectors(std::move(other.DirtySectors)), Shared(std::exchange(other.Shared, nullptr)),
+                                                      Inline(std::exchange(other.Inline, false)), InlineSize(std::exchange(other.InlineSize, 0)),
+                                                      Manager(other.Manager), InlineBytes(std::exchange(other.InlineBytes, nullptr)) {}
 
 SectorNode& SectorNode::operator=(SectorNode&& other) noexcept {
-	MEMFS_SINGLETON->GetSectorManager().Free(*this);
+	if (this->Manager != nullptr) {
+		this->Manager->Free(*this);
+		this->Manager->GetMetadata().Add(-(INT64)((this->Sectors.capacity() + this->DirtySectors.capacity()) * sizeof(Sector*)));
+	}
 
 	this->Sectors = std::move(other.Sectors);
+	this->DirtySectors = std::move(other.DirtySectors);
+	this->Shared = std::exchange(other.Shared, nullptr);
+	this->Inline = std::exchange(other.Inline, false);
+	this->InlineSize = std::exchange(other.InlineSize, 0);
+	this->Manager = other.Manager;
+	this->InlineBytes = std::exchange(other.InlineBytes, nullptr);
 	return *this;
 }
 
 size_t SectorNode::ApproximateSize() const {
-	return this->Sectors.size() * (sizeof(Sector) + sizeof(Sector*));
+	return this->GetSectors().size() * (sizeof(Sector) + sizeof(Sector*)) + InlineCapacity(this->InlineSize);
+}
+
+const SectorVector& SectorNode::GetSectors() const {
+	return this->Shared != nullptr ? this->Shared->Sectors : this->Sectors;
 }
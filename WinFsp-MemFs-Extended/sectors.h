@@ -3,6 +3,11 @@
 #include "globalincludes.h"
 
 namespace Memfs {
+	class SectorArena;
+	class SectorManager;
+	class MemoryBudget;
+	class MetadataCounter;
+
 	// Make sure that this struct is never padded, no matter what sector size is used
 #pragma pack(push, memefsNoPadding, 1)
 	struct Sector {
@@ -12,9 +17,26 @@ namespace Memfs {
 
 	using SectorVector = std::vector<Sector*>;
 
+	// Sectors of several nodes after SectorManager::Share; Nobody writes them, the first write of an owner copies them for itself
+	struct SharedSectors {
+		SectorVector Sectors;
+		volatile long Owners{1};
+	};
+
 	struct SectorNode {
+		// Own sectors of the node; Empty, while it uses shared ones
 		SectorVector Sectors;
 		std::shared_mutex SectorsMutex;
+		// One bit per sector, which writes set while the manager tracks dirty sectors; Checkpoints take and clear them
+		std::vector<UINT64> DirtySectors;
+		// Set, while the node uses the sectors of other nodes as well (SectorManager::Share)
+		SharedSectors* Shared{nullptr};
+		// The allocation is a single sector, whose contents are only kept up to the end of the last write (SectorManager::SetInlineLimit)
+		bool Inline{false};
+		UINT32 InlineSize{0};
+		// Manager of the volume, which allocated the sectors; Set with the first sector
+		SectorManager* Manager{nullptr};
+		byte* InlineBytes{nullptr};
 
 		SectorNode() = default;
 		// This must free all sectors on destruction!
@@ -26,11 +48,17 @@ namespace Memfs {
 		SectorNode& operator=(SectorNode&& other) noexcept;
 
 		[[nodiscard]] size_t ApproximateSize() const;
+		// Sectors, which hold the contents; The caller holds the sectors mutex
+		[[nodiscard]] const SectorVector& GetSectors() const;
 	};
 
 	class SectorManager {
 	public:
-		SectorManager();
+		static constexpr UINT32 DEFAULT_INLINE_LIMIT = 0; // Disabled, unless -T enables it
+		static constexpr UINT32 INLINE_GRANULARITY = 32; // Inline contents grow in steps, so that appending does not reallocate on every write
+
+		// The sector tables of the nodes are accounted to the metadata of the volume
+		explicit SectorManager(MetadataCounter& metadata);
 		~SectorManager();
 
 		SectorManager(const SectorManager& other) = delete;
@@ -46,11 +74,79 @@ namespace Memfs {
 
 		bool ReAllocate(SectorNode& node, const size_t size);
 		bool Free(SectorNode& node);
+		/**
+		 * \brief Lets an empty node use the sectors of another one, without copying any data; The first write or resize of an owner copies all of them (copy-on-write)
+		 * \param sourceSize File size of the source, which is read while its sectors cannot change
+		 * \param sharedSize Receives that size, bounded to the shared contents
+		 */
+		bool Share(SectorNode& source, SectorNode& target, const UINT64& sourceSize, UINT64& sharedSize);
+
+		// Returns free pages of the sector heap to the system
+		void Compact();
+
+		// Only affects nodes that are (re)allocated afterwards, so it has to be enabled before any file is created
+		void EnableDirtyTracking();
+		/**
+		 * \brief Keeps files with a single sector of allocation inline, as long as nothing beyond the limit is written; They get their sector, once they grow past it.
+		 * Only affects nodes that are allocated afterwards; 0 disables it, as the arena and dirty tracking do, which work on whole sectors.
+		 */
+		void SetInlineLimit(const UINT32 limit);
+		/**
+		 * \brief Clears and returns one word of the dirty bitmap; The caller holds the sectors mutex of the node
+		 */
+		static UINT64 TakeDirtySectors(SectorNode& node, const size_t word);
 
 		bool IsFullyEmpty();
 		UINT64 GetAllocatedSectors();
+		UINT64 GetInlineBytes();
+
+		// Takes the sectors from a mapped host file from now on (-H); Has to be set before any file is created
+		void UseArena(std::unique_ptr<SectorArena>&& arena);
+		// Reserves every sector from the budget of the process (-B); Has to be set before any file is created
+		void UseBudget(MemoryBudget* budget);
+		[[nodiscard]] SectorArena* GetArena() const;
+		[[nodiscard]] MetadataCounter& GetMetadata() const;
+		/**
+		 * \brief Gives an empty node the sectors of a restored hot restart state; A node, which lists the same slots as an earlier one, shares its sectors
+		 * \return False for a slot outside of the arena or one, which another node got with different slots
+		 */
+		bool AttachSectors(SectorNode& node, const UINT64* slots, const UINT64 count);
+		// Frees every slot, which no node got
+		void FinishAttach();
 	private:
+		Sector* AllocateSector();
+		void FreeSector(Sector* sector);
+		// Counts the sectors, before they are allocated; Returns false if the budget is exhausted
+		bool ReserveSectors(const UINT64 count);
+		void ReleaseSectors(const UINT64 count);
+
+		// Grows or frees the inline contents; The caller holds the sectors mutex of the node exclusively
+		bool ResizeInline(SectorNode& node, const UINT32 size);
+		// Moves the inline contents into a sector of their own; The caller holds the sectors mutex of the node exclusively
+		bool PromoteInline(SectorNode& node);
+		// Writes to an inline node, which needs to grow or to be promoted first
+		bool WriteInline(SectorNode& node, void* buffer, const size_t size, const size_t offset);
+
+		// The caller holds the sectors mutex of the node; Writes need sectors of its own
+		template <bool IsReading>
+		static bool CopySectors(SectorNode& node, void* buffer, const size_t size, const size_t offset);
+		// The caller holds the sectors mutexes of both nodes exclusively
+		bool ShareSectors(SectorNode& source, SectorNode& target);
+		// Gives the node its own copies of the first shared sectors and drops its reference; The caller holds the sectors mutex exclusively
+		bool Unshare(SectorNode& node, const UINT64 keepCount);
+		// Frees the shared sectors with their last owner
+		void ReleaseShared(SharedSectors* shared);
+
 		HANDLE heap;
+		std::unique_ptr<SectorArena> arena; // Used instead of the heap, if set
+		MemoryBudget* budget{nullptr};
+		MetadataCounter* metadata;
 		volatile UINT64 allocatedSectors{0};
+		volatile UINT64 inlineBytes{0};
+		UINT32 inlineLimit{DEFAULT_INLINE_LIMIT};
+		bool trackDirty{false};
+
+		// Node of every first slot during a hot restart (AttachSectors)
+		std::unordered_map<UINT64, SectorNode*> attachOwners;
 	};
 }
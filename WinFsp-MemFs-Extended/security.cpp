@@ -7,21 +7,28 @@ namespace Memfs::Interface {
 
 		const auto fileNodeOpt = memfs->FindFile(fileName);
 		if (!fileNodeOpt.has_value()) {
+			// Repeatedly probed missing paths (search paths, DLL search order) skip the reparse point and parent walks
+			if (memfs->GetNegativeLookups().Contains(fileName)) {
+				return STATUS_OBJECT_NAME_NOT_FOUND;
+			}
+
 			result = STATUS_OBJECT_NAME_NOT_FOUND;
 
 			if (FspFileSystemFindReparsePoint(fileSystem, CompatGetReparsePointByName, nullptr,
 			                                  fileName, pFileAttributes)) {
 				result = STATUS_REPARSE;
 			} else {
-				const auto [parentResult, _] = memfs->FindParent(fileName);
+				const auto [parentResult, parent] = memfs->FindParent(fileName);
 				if (parentResult != STATUS_SUCCESS) {
 					result = parentResult;
+				} else {
+					memfs->GetNegativeLookups().Insert(fileName, parent.value());
 				}
 			}
 
 			return result;
 		}
-		FileNode* fileNode = &fileNodeOpt.value().get();
+		FileNode* fileNode = &fileNodeOpt.value().get().ResolveLink();
 
 		UINT32 fileAttributesMask = ~(UINT32)0;
 		if (!fileNode->IsMainNode()) {
@@ -81,8 +88,12 @@ namespace Memfs::Interface {
 			fileNode = fileNode->GetMainNode();
 		}
 
+		if (IsReadOnly(GetMemFs(fileSystem), *fileNode)) {
+			return STATUS_MEDIA_WRITE_PROTECTED;
+		}
+
 		NTSTATUS result = FspSetSecurityDescriptor(
-			fileNode->fileSecurity.Struct(),
+			(PSECURITY_DESCRIPTOR)fileNode->fileSecurity.Struct(),
 			securityInformation,
 			modificationDescriptor,
 			&newSecurityDescriptor);
@@ -92,9 +103,9 @@ namespace Memfs::Interface {
 
 		const SIZE_T fileSecuritySize = GetSecurityDescriptorLength(newSecurityDescriptor);
 		try {
-			fileNode->fileSecurity = DynamicStruct<SECURITY_DESCRIPTOR>(fileSecuritySize);
-
-			memcpy_s(fileNode->fileSecurity.Struct(), fileNode->fileSecurity.ByteSize(), newSecurityDescriptor, fileSecuritySize);
+			// Shared descriptors are immutable, so the node is moved to the (possibly already existing) new one
+			fileNode->fileSecurity = GetMemFs(fileSystem)->GetSecurityDescriptors().Intern(newSecurityDescriptor, fileSecuritySize);
+			fileNode->MarkMetadataChanged();
 			FspDeleteSecurityDescriptor(newSecurityDescriptor, (NTSTATUS(*)())FspSetSecurityDescriptor);
 		} catch (...) {
 			FspDeleteSecurityDescriptor(newSecurityDescriptor, (NTSTATUS(*)())FspSetSecurityDescriptor);
@@ -0,0 +1,134 @@
+#include "globalincludes.h"
+#include "securitytable.h"
+#include "accounting.h"
+
+using namespace Memfs;
+
+// Entry with its descriptor and the bucket node of the table
+INT64 SecurityDescriptorTable::EntryByteSize(const SharedSecurityDescriptor::Entry* entry) {
+	return (INT64)(sizeof(SharedSecurityDescriptor::Entry) + entry->Descriptor.ByteSize() + 2 * sizeof(void*) + sizeof(std::pair<const size_t, SharedSecurityDescriptor::Entry*>));
+}
+
+SharedSecurityDescriptor::SharedSecurityDescriptor(Entry* entry) : entry(entry) {}
+
+SharedSecurityDescriptor::~SharedSecurityDescriptor() {
+	this->Release();
+}
+
+SharedSecurityDescriptor::SharedSecurityDescriptor(const SharedSecurityDescriptor& other) : entry(other.entry) {
+	if (this->entry != nullptr) {
+		InterlockedIncrement(&this->entry->RefCount);
+	}
+}
+
+SharedSecurityDescriptor::SharedSecurityDescriptor(SharedSecurityDescriptor&& other) noexcept : entry(std::exchange(other.entry, nullptr)) {}
+
+SharedSecurityDescriptor& SharedSecurityDescriptor::operator=(const SharedSecurityDescriptor& other) {
+	if (this != &other && this->entry != other.entry) {
+		this->Release();
+
+		this->entry = other.entry;
+		if (this->entry != nullptr) {
+			InterlockedIncrement(&this->entry->RefCount);
+		}
+	}
+
+	return *this;
+}
+
+SharedSecurityDescriptor& SharedSecurityDescriptor::operator=(SharedSecurityDescriptor&& other) noexcept {
+	if (this != &other) {
+		this->Release();
+		this->entry = std::exchange(other.entry, nullptr);
+	}
+
+	return *this;
+}
+
+const SECURITY_DESCRIPTOR* SharedSecurityDescriptor::Struct() const {
+	return this->entry != nullptr ? this->entry->Descriptor.Struct() : nullptr;
+}
+
+std::size_t SharedSecurityDescriptor::WantedByteSize() const {
+	return this->entry != nullptr ? this->entry->Descriptor.WantedByteSize() : 0;
+}
+
+bool SharedSecurityDescriptor::HoldsStruct() const {
+	return this->entry != nullptr;
+}
+
+void SharedSecurityDescriptor::Release() {
+	if (this->entry != nullptr) {
+		SecurityDescriptorTable::Release(this->entry);
+		this->entry = nullptr;
+	}
+}
+
+
+SecurityDescriptorTable::SecurityDescriptorTable(MetadataCounter& metadata) : metadata(metadata) {}
+
+SecurityDescriptorTable::~SecurityDescriptorTable() {
+	// Nodes that are still alive keep their descriptors; This only happens when the file system is torn down
+	for (const auto& entry : this->entries) {
+		entry.second->Table = nullptr;
+	}
+}
+
+SharedSecurityDescriptor SecurityDescriptorTable::Intern(const PSECURITY_DESCRIPTOR descriptor, const std::size_t length) {
+	const size_t hash = std::hash<std::string_view>{}(std::string_view(static_cast<const char*>(descriptor), length));
+
+	std::lock_guard lock(this->entriesMutex);
+
+	const auto [begin, end] = this->entries.equal_range(hash);
+	for (auto iter = begin; iter != end; ++iter) {
+		SharedSecurityDescriptor::Entry* entry = iter->second;
+
+		if (entry->Descriptor.WantedByteSize() == length && 0 == memcmp(entry->Descriptor.Struct(), descriptor, length)) {
+			InterlockedIncrement(&entry->RefCount);
+			return SharedSecurityDescriptor(entry);
+		}
+	}
+
+	std::unique_ptr<SharedSecurityDescriptor::Entry> entry(new SharedSecurityDescriptor::Entry{this, &this->metadata, 1, hash, DynamicStruct<SECURITY_DESCRIPTOR>(length)});
+	memcpy_s(entry->Descriptor.Struct(), entry->Descriptor.ByteSize(), descriptor, length);
+
+	this->entries.emplace(hash, entry.get());
+	this->metadata.Add(EntryByteSize(entry.get()));
+	return SharedSecurityDescriptor(entry.release());
+}
+
+size_t SecurityDescriptorTable::GetUniqueCount() {
+	std::lock_guard lock(this->entriesMutex);
+	return this->entries.size();
+}
+
+void SecurityDescriptorTable::Release(SharedSecurityDescriptor::Entry* entry) {
+	if (entry->Table == nullptr) {
+		// The table is already gone
+		if (0 == InterlockedDecrement(&entry->RefCount)) {
+			entry->Metadata->Add(-EntryByteSize(entry));
+			delete entry;
+		}
+
+		return;
+	}
+
+	// Decremented under the lock, so that Intern cannot hand out an entry, which is about to be deleted
+	SecurityDescriptorTable* table = entry->Table;
+	std::lock_guard lock(table->entriesMutex);
+
+	if (0 != InterlockedDecrement(&entry->RefCount)) {
+		return;
+	}
+
+	const auto [begin, end] = table->entries.equal_range(entry->Hash);
+	for (auto iter = begin; iter != end; ++iter) {
+		if (iter->second == entry) {
+			table->entries.erase(iter);
+			break;
+		}
+	}
+
+	table->metadata.Add(-EntryByteSize(entry));
+	delete entry;
+}
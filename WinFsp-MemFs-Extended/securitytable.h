@@ -0,0 +1,76 @@
+#pragma once
+
+#include "globalincludes.h"
+
+#include "dynamicstruct.h"
+
+namespace Memfs {
+	class SecurityDescriptorTable;
+	class MetadataCounter;
+
+	/**
+	 * \brief Reference to an immutable, interned security descriptor. Copies share the same descriptor.
+	 */
+	class SharedSecurityDescriptor {
+	public:
+		SharedSecurityDescriptor() = default;
+		~SharedSecurityDescriptor();
+
+		SharedSecurityDescriptor(const SharedSecurityDescriptor& other);
+		SharedSecurityDescriptor(SharedSecurityDescriptor&& other) noexcept;
+		SharedSecurityDescriptor& operator=(const SharedSecurityDescriptor& other);
+		SharedSecurityDescriptor& operator=(SharedSecurityDescriptor&& other) noexcept;
+
+		[[nodiscard]] const SECURITY_DESCRIPTOR* Struct() const;
+		[[nodiscard]] std::size_t WantedByteSize() const;
+		[[nodiscard]] bool HoldsStruct() const;
+
+	private:
+		friend class SecurityDescriptorTable;
+
+		struct Entry {
+			SecurityDescriptorTable* Table;
+			MetadataCounter* Metadata; // Of the volume; Outlives the table
+			volatile long RefCount;
+			size_t Hash;
+			DynamicStruct<SECURITY_DESCRIPTOR> Descriptor;
+		};
+
+		explicit SharedSecurityDescriptor(Entry* entry);
+		void Release();
+
+		Entry* entry{};
+	};
+
+	/**
+	 * \brief Deduplicates security descriptors by their content, because nearly all files inherit one of a few descriptors
+	 */
+	class SecurityDescriptorTable {
+	public:
+		explicit SecurityDescriptorTable(MetadataCounter& metadata);
+		~SecurityDescriptorTable();
+
+		SecurityDescriptorTable(const SecurityDescriptorTable& other) = delete;
+		SecurityDescriptorTable(SecurityDescriptorTable&& other) noexcept = delete;
+		SecurityDescriptorTable& operator=(const SecurityDescriptorTable& other) = delete;
+		SecurityDescriptorTable& operator=(SecurityDescriptorTable&& other) noexcept = delete;
+
+		/**
+		 * \brief Returns the shared copy of a self-relative security descriptor and creates it if needed
+		 * \throws std::bad_alloc If a new copy could not be allocated
+		 */
+		SharedSecurityDescriptor Intern(const PSECURITY_DESCRIPTOR descriptor, const std::size_t length);
+
+		[[nodiscard]] size_t GetUniqueCount();
+
+	private:
+		friend class SharedSecurityDescriptor;
+
+		static void Release(SharedSecurityDescriptor::Entry* entry);
+		static INT64 EntryByteSize(const SharedSecurityDescriptor::Entry* entry);
+
+		std::unordered_multimap<size_t, SharedSecurityDescriptor::Entry*> entries;
+		std::mutex entriesMutex;
+		MetadataCounter& metadata;
+	};
+}
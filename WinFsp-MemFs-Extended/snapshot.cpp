@@ -0,0 +1,608 @@
+#include "globalincludes.h"
+#include "exceptions.h"
+#include "snapshot.h"
+
+#include "memfs.h"
+#include "memfs-interface.h"
+#include "sectorarena.h"
+
+using namespace Memfs;
+
+static UINT64 AlignSection(const UINT64 offset) {
+	return (offset + SNAPSHOT_SECTION_ALIGNMENT - 1) / SNAPSHOT_SECTION_ALIGNMENT * SNAPSHOT_SECTION_ALIGNMENT;
+}
+
+SnapshotWriter::SnapshotWriter(const HANDLE file) : file(file) {
+	this->buffer.resize(BUFFER_SIZE);
+}
+
+bool SnapshotWriter::Write(const void* data, size_t size) {
+	const byte* bytes = static_cast<const byte*>(data);
+
+	while (size > 0) {
+		const size_t copyNow = min(size, this->buffer.size() - this->used);
+		if (bytes != nullptr) {
+			memcpy(this->buffer.data() + this->used, bytes, copyNow);
+			bytes += copyNow;
+		} else {
+			memset(this->buffer.data() + this->used, 0, copyNow);
+		}
+
+		this->used += copyNow;
+		this->position += copyNow;
+		size -= copyNow;
+
+		if (this->used == this->buffer.size() && !this->Flush()) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool SnapshotWriter::PadTo(const UINT64 offset) {
+	assert(offset >= this->position);
+	return this->Write(nullptr, (size_t)(offset - this->position));
+}
+
+bool SnapshotWriter::Flush() {
+	DWORD written;
+	if (this->used > 0 && (!WriteFile(this->file, this->buffer.data(), (DWORD)this->used, &written, nullptr) || written != this->used)) {
+		return false;
+	}
+
+	this->used = 0;
+	return true;
+}
+
+UINT64 SnapshotWriter::GetPosition() const {
+	return this->position;
+}
+
+static void AlignBlob(std::vector<byte>& blob) {
+	blob.resize((blob.size() + 7) / 8 * 8);
+}
+
+void Memfs::AppendSnapshotBlob(std::vector<byte>& blob, const void* data, const size_t size, UINT64& offset, UINT64& length) {
+	AlignBlob(blob);
+	offset = blob.size();
+	length = size;
+	blob.insert(blob.end(), static_cast<const byte*>(data), static_cast<const byte*>(data) + size);
+}
+
+void Memfs::AppendSnapshotEas(FileNode& node, std::vector<byte>& blob, UINT64& offset, UINT64& length) {
+	AlignBlob(blob);
+	offset = blob.size();
+	node.GetEas().ForEach([&](const FILE_FULL_EA_INFORMATION* ea) {
+		const size_t entrySize = FIELD_OFFSET(FILE_FULL_EA_INFORMATION, EaName) + ea->EaNameLength + 1 + ea->EaValueLength;
+		const size_t entryOffset = blob.size();
+
+		blob.resize(entryOffset + (entrySize + 3) / 4 * 4);
+		memcpy(blob.data() + entryOffset, ea, entrySize);
+		reinterpret_cast<FILE_FULL_EA_INFORMATION*>(blob.data() + entryOffset)->NextEntryOffset = (ULONG)(blob.size() - entryOffset);
+		return true;
+	});
+	length = blob.size() - offset;
+}
+
+bool Memfs::IsValidSnapshotEaChain(const byte* eas, const UINT64 length) {
+	for (UINT64 eaOffset = 0; eaOffset < length;) {
+		const UINT64 remaining = length - eaOffset;
+		if (remaining < FIELD_OFFSET(FILE_FULL_EA_INFORMATION, EaName)) {
+			return false;
+		}
+
+		const FILE_FULL_EA_INFORMATION* ea = reinterpret_cast<const FILE_FULL_EA_INFORMATION*>(eas + eaOffset);
+		const UINT64 entrySize = FIELD_OFFSET(FILE_FULL_EA_INFORMATION, EaName) + (UINT64)ea->EaNameLength + 1 + ea->EaValueLength;
+		if (ea->NextEntryOffset == 0 || ea->NextEntryOffset > remaining || entrySize > ea->NextEntryOffset) {
+			return false;
+		}
+
+		eaOffset += ea->NextEntryOffset;
+	}
+
+	return true;
+}
+
+void Memfs::ApplySnapshotMetadata(FileNode& node, const SnapshotNode& record, const byte* blob, const SharedSecurityDescriptor* security) {
+	node.fileInfo = record.FileInfo;
+	node.fileInfo.EaSize = 0; // Summed up again by SetEa
+	node.fileSecurity = security != nullptr ? *security : SharedSecurityDescriptor();
+
+	if (node.IsMainNode()) {
+		if (!IsValidSnapshotEaChain(blob + record.EaOffset, record.EaLength)) {
+			throw CreateException(STATUS_FILE_CORRUPT_ERROR);
+		}
+
+		node.DeleteEas();
+		for (UINT64 eaOffset = 0; eaOffset < record.EaLength;) {
+			FILE_FULL_EA_INFORMATION* ea = (FILE_FULL_EA_INFORMATION*)(blob + record.EaOffset + eaOffset);
+			node.SetEa(ea);
+			eaOffset += ea->NextEntryOffset;
+		}
+	}
+
+	DynamicStruct<byte> reparseData;
+	if (record.ReparseLength > 0) {
+		reparseData = DynamicStruct<byte>(record.ReparseLength);
+		memcpy(reparseData.Struct(), blob + record.ReparseOffset, record.ReparseLength);
+	}
+	node.SetReparseData(std::move(reparseData));
+}
+
+SnapshotPlan::~SnapshotPlan() {
+	for (FileNode* node : this->RecordNodes) {
+		node->Dereference();
+	}
+}
+
+NTSTATUS MemFs::PrepareSnapshot(SnapshotPlan& plan, const UINT64 checkpointSequence, const SnapshotData contents) {
+	std::unordered_map<const FileNode*, UINT64> nodeIndices;
+	std::unordered_map<const SECURITY_DESCRIPTOR*, UINT64> securityIndices;
+	std::vector<FileNode*> links;
+	UINT64 dataSize = 0;
+	UINT64 maxIndexNumber = 0;
+
+	try {
+		const auto addRecord = [&](FileNode& node, const SnapshotNodeKind kind, const UINT64 mainIndex) {
+			SnapshotNode record{};
+			record.FileInfo = node.fileInfo;
+			record.Kind = kind;
+			record.MainIndex = mainIndex;
+			record.SecurityIndex = SNAPSHOT_NO_INDEX;
+
+			UINT64 nameLength;
+			AppendSnapshotBlob(plan.Blob, node.fileName.c_str(), node.fileName.length() * sizeof(WCHAR), record.NameOffset, nameLength);
+			record.NameLength = (UINT32)node.fileName.length();
+
+			if (kind != SnapshotNodeKind::Link) {
+				if (node.fileSecurity.HoldsStruct()) {
+					const auto [iter, inserted] = securityIndices.emplace(node.fileSecurity.Struct(), plan.SecurityRecords.size());
+					if (inserted) {
+						SnapshotSecurity securityRecord{};
+						AppendSnapshotBlob(plan.Blob, node.fileSecurity.Struct(), node.fileSecurity.WantedByteSize(), securityRecord.Offset, securityRecord.Length);
+						plan.SecurityRecords.push_back(securityRecord);
+					}
+
+					record.SecurityIndex = iter->second;
+				}
+
+				if (node.IsMainNode()) {
+					AppendSnapshotEas(node, plan.Blob, record.EaOffset, record.EaLength);
+				}
+
+				const DynamicStruct<byte>& reparseData = node.GetReparseData();
+				if (reparseData.HoldsStruct()) {
+					AppendSnapshotBlob(plan.Blob, reparseData.Struct(), reparseData.WantedByteSize(), record.ReparseOffset, record.ReparseLength);
+				}
+
+				record.DataOffset = dataSize;
+				if (SnapshotData::SectorTables == contents && (node.fileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+					// Directories have no sectors, and asking for their sector node would allocate one
+					record.FileInfo.AllocationSize = 0;
+				} else if (SnapshotData::SectorTables == contents) {
+					// Exactly the sectors, which the table lists
+					SectorNode& sectorNode = node.GetSectorNode();
+					std::shared_lock sectorsLock(sectorNode.SectorsMutex);
+					const SectorArena* arena = this->sectors.GetArena();
+
+					record.FileInfo.AllocationSize = sectorNode.GetSectors().size() * FULL_SECTOR_SIZE;
+					dataSize += SectorManager::GetSectorAmount(record.FileInfo.AllocationSize) * sizeof(UINT64);
+					for (const Sector* sector : sectorNode.GetSectors()) {
+						plan.SectorSlots.push_back(arena->GetSlot(sector));
+					}
+				} else {
+					dataSize += SectorManager::AlignSize(record.FileInfo.FileSize);
+				}
+			}
+
+			maxIndexNumber = max(maxIndexNumber, record.FileInfo.IndexNumber);
+
+			nodeIndices.emplace(&node, plan.Records.size());
+			plan.Records.push_back(record);
+			plan.RecordNodes.push_back(&node);
+			node.Reference();
+		};
+
+		for (const auto& [name, node] : this->fileMap) {
+			if (node->IsLink()) {
+				links.push_back(node);
+				continue;
+			}
+
+			// Main nodes sort before their streams
+			addRecord(*node, SnapshotNodeKind::Named, node->IsMainNode() ? SNAPSHOT_NO_INDEX : nodeIndices.at(node->GetMainNode()));
+		}
+
+		for (FileNode* link : links) {
+			if (!nodeIndices.contains(link->GetLinkTarget())) {
+				addRecord(*link->GetLinkTarget(), SnapshotNodeKind::Hidden, SNAPSHOT_NO_INDEX);
+			}
+		}
+
+		for (FileNode* link : links) {
+			addRecord(*link, SnapshotNodeKind::Link, nodeIndices.at(link->GetLinkTarget()));
+		}
+	} catch (std::bad_alloc&) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	SnapshotHeader& header = plan.Header;
+	header.Magic = SnapshotData::SectorTables == contents ? HOT_RESTART_MAGIC : SNAPSHOT_MAGIC;
+	header.Version = SNAPSHOT_VERSION;
+	header.SectorSize = FULL_SECTOR_SIZE;
+	header.NodeCount = plan.Records.size();
+	header.SecurityCount = plan.SecurityRecords.size();
+	header.NodesOffset = AlignSection(sizeof(SnapshotHeader));
+	header.SecurityOffset = AlignSection(header.NodesOffset + plan.Records.size() * sizeof(SnapshotNode));
+	header.BlobOffset = AlignSection(header.SecurityOffset + plan.SecurityRecords.size() * sizeof(SnapshotSecurity));
+	header.BlobSize = plan.Blob.size();
+	header.DataOffset = AlignSection(header.BlobOffset + plan.Blob.size());
+	header.DataSize = dataSize;
+	header.MaxIndexNumber = maxIndexNumber;
+	header.CheckpointSequence = checkpointSequence;
+	wcsncpy_s(header.VolumeLabel, this->volumeLabel.c_str(), _TRUNCATE);
+
+	plan.Contents = contents;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS MemFs::WriteSnapshot(const std::wstring& path, const SnapshotPlan& plan) {
+	const SnapshotHeader& header = plan.Header;
+
+	// Written next to the image and moved over it at the end, so that a failed save never destroys the last image
+	const std::wstring temporaryPath = path + L".tmp";
+	const HANDLE file = CreateFileW(temporaryPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	bool success;
+	try {
+		SnapshotWriter writer(file);
+		success = writer.Write(&header, sizeof(SnapshotHeader))
+			&& writer.PadTo(header.NodesOffset) && writer.Write(plan.Records.data(), plan.Records.size() * sizeof(SnapshotNode))
+			&& writer.PadTo(header.SecurityOffset) && writer.Write(plan.SecurityRecords.data(), plan.SecurityRecords.size() * sizeof(SnapshotSecurity))
+			&& writer.PadTo(header.BlobOffset) && writer.Write(plan.Blob.data(), plan.Blob.size())
+			&& writer.PadTo(header.DataOffset);
+
+		if (SnapshotData::SectorTables == plan.Contents) {
+			success = success && writer.Write(plan.SectorSlots.data(), plan.SectorSlots.size() * sizeof(UINT64));
+		} else {
+			std::vector<byte> chunk(SnapshotWriter::BUFFER_SIZE);
+			for (size_t i = 0; success && i < plan.Records.size(); i++) {
+				const SnapshotNode& record = plan.Records[i];
+				if (record.Kind == SnapshotNodeKind::Link || record.FileInfo.FileSize == 0) {
+					continue;
+				}
+
+				for (UINT64 offset = 0; success && offset < record.FileInfo.FileSize; offset += chunk.size()) {
+					const size_t copyNow = (size_t)min((UINT64)chunk.size(), record.FileInfo.FileSize - offset);
+
+					// A file that shrank since its size was recorded is padded with zeros; Contents, which are not hydrated yet, do not grow the working set
+					if (!this->ReadContents(*plan.RecordNodes[i], chunk.data(), copyNow, offset)) {
+						memset(chunk.data(), 0, copyNow);
+					}
+
+					success = writer.Write(chunk.data(), copyNow);
+				}
+
+				success = success && writer.PadTo(header.DataOffset + record.DataOffset + SectorManager::AlignSize(record.FileInfo.FileSize));
+			}
+		}
+
+		success = success && writer.Flush() && FlushFileBuffers(file);
+	} catch (std::bad_alloc&) {
+		success = false;
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+	}
+
+	const DWORD error = GetLastError();
+	CloseHandle(file);
+
+	if (!success || !MoveFileExW(temporaryPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		const NTSTATUS result = FspNtStatusFromWin32(success ? GetLastError() : error);
+		DeleteFileW(temporaryPath.c_str());
+		return result;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS MemFs::SaveSnapshot(const std::wstring& path, const UINT64 checkpointSequence, const SnapshotData contents) {
+	SnapshotPlan plan;
+	const NTSTATUS result = this->PrepareSnapshot(plan, checkpointSequence, contents);
+	return NT_SUCCESS(result) ? this->WriteSnapshot(path, plan) : result;
+}
+
+NTSTATUS MemFs::LoadSnapshot(const std::wstring& path, const SnapshotData contents) {
+	const HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || (UINT64)fileSize.QuadPart < sizeof(SnapshotHeader)) {
+		CloseHandle(file);
+		return STATUS_FILE_CORRUPT_ERROR;
+	}
+
+	const HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (mapping == nullptr) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	const byte* image = static_cast<const byte*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	CloseHandle(mapping);
+	if (image == nullptr) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	const NTSTATUS result = this->LoadSnapshot(image, (UINT64)fileSize.QuadPart, contents);
+	UnmapViewOfFile(image);
+
+	return result;
+}
+
+NTSTATUS MemFs::LoadSnapshot(const byte* image, const UINT64 imageSize, const SnapshotData contents) {
+	const SnapshotHeader& header = *reinterpret_cast<const SnapshotHeader*>(image);
+	const bool attachSectors = SnapshotData::SectorTables == contents;
+
+	// Every offset is checked once up front, so that a damaged image cannot make the restore read outside of the mapping
+	const auto inImage = [imageSize](const UINT64 offset, const UINT64 count, const UINT64 size) {
+		return offset <= imageSize && count <= (imageSize - offset) / size;
+	};
+
+	if (header.Magic != (attachSectors ? HOT_RESTART_MAGIC : SNAPSHOT_MAGIC) || header.Version != SNAPSHOT_VERSION || header.SectorSize != FULL_SECTOR_SIZE
+		|| !inImage(header.NodesOffset, header.NodeCount, sizeof(SnapshotNode))
+		|| !inImage(header.SecurityOffset, header.SecurityCount, sizeof(SnapshotSecurity))
+		|| !inImage(header.BlobOffset, header.BlobSize, 1) || !inImage(header.DataOffset, header.DataSize, 1)) {
+		return STATUS_FILE_CORRUPT_ERROR;
+	}
+
+	const SnapshotNode* records = reinterpret_cast<const SnapshotNode*>(image + header.NodesOffset);
+	const SnapshotSecurity* securityRecords = reinterpret_cast<const SnapshotSecurity*>(image + header.SecurityOffset);
+	const byte* blob = image + header.BlobOffset;
+	const byte* data = image + header.DataOffset;
+
+	const auto inBlob = [&header](const UINT64 offset, const UINT64 length) {
+		return offset <= header.BlobSize && length <= header.BlobSize - offset;
+	};
+
+	// Sector tables list every allocated sector, file data only covers the file size
+	const auto dataLength = [attachSectors](const SnapshotNode& record) {
+		return attachSectors ? SectorManager::GetSectorAmount(record.FileInfo.AllocationSize) * sizeof(UINT64) : SectorManager::AlignSize(record.FileInfo.FileSize);
+	};
+
+	// The whole image is validated before the tree is touched, so that a damaged image leaves the volume as it was
+	for (UINT64 i = 0; i < header.SecurityCount; i++) {
+		if (!inBlob(securityRecords[i].Offset, securityRecords[i].Length)) {
+			return STATUS_FILE_CORRUPT_ERROR;
+		}
+	}
+
+	UINT64 neededBytes = 0;
+	for (UINT64 i = 0; i < header.NodeCount; i++) {
+		const SnapshotNode& record = records[i];
+		const bool hasMain = record.MainIndex != SNAPSHOT_NO_INDEX;
+
+		if (!inBlob(record.NameOffset, record.NameLength * sizeof(WCHAR)) || !inBlob(record.EaOffset, record.EaLength) || !inBlob(record.ReparseOffset, record.ReparseLength)
+			|| (hasMain && record.MainIndex >= i) || (record.Kind == SnapshotNodeKind::Link && !hasMain)
+			// Streams and links only ever refer to a main node
+			|| (hasMain && (records[record.MainIndex].Kind == SnapshotNodeKind::Link || records[record.MainIndex].MainIndex != SNAPSHOT_NO_INDEX))
+			|| (record.SecurityIndex != SNAPSHOT_NO_INDEX && record.SecurityIndex >= header.SecurityCount)
+			|| !FileNode::IsValidName(std::wstring_view(reinterpret_cast<const wchar_t*>(blob + record.NameOffset), record.NameLength))
+			|| (!hasMain && !IsValidSnapshotEaChain(blob + record.EaOffset, record.EaLength))
+			|| (record.Kind != SnapshotNodeKind::Link && (record.DataOffset > header.DataSize || dataLength(record) > header.DataSize - record.DataOffset))
+			|| (SnapshotData::Copied == contents && record.Kind != SnapshotNodeKind::Link && record.FileInfo.FileSize > record.FileInfo.AllocationSize)
+			|| (attachSectors && (0 != record.FileInfo.AllocationSize % FULL_SECTOR_SIZE || record.FileInfo.FileSize > record.FileInfo.AllocationSize || 0 != record.DataOffset % sizeof(UINT64)))) {
+			return STATUS_FILE_CORRUPT_ERROR;
+		}
+
+		if (attachSectors && record.Kind != SnapshotNodeKind::Link) {
+			const UINT64* slots = reinterpret_cast<const UINT64*>(data + record.DataOffset);
+			for (UINT64 s = 0; s < SectorManager::GetSectorAmount(record.FileInfo.AllocationSize); s++) {
+				if (this->sectors.GetArena()->GetSector(slots[s]) == nullptr) {
+					return STATUS_FILE_CORRUPT_ERROR;
+				}
+			}
+		}
+
+		if (record.Kind != SnapshotNodeKind::Link) {
+			neededBytes += SectorManager::AlignSize(record.FileInfo.AllocationSize);
+		}
+	}
+
+	// Lazy and attached contents do not take any new memory
+	if (SnapshotData::Copied == contents && neededBytes > this->CalculateAvailableTotalSize()) {
+		return STATUS_DISK_FULL;
+	}
+
+	try {
+		std::vector<SharedSecurityDescriptor> securityDescriptors;
+		securityDescriptors.reserve(header.SecurityCount);
+		for (UINT64 i = 0; i < header.SecurityCount; i++) {
+			const SnapshotSecurity& securityRecord = securityRecords[i];
+			securityDescriptors.push_back(this->securityDescriptors.Intern((PSECURITY_DESCRIPTOR)(blob + securityRecord.Offset), securityRecord.Length));
+		}
+
+		// The image replaces the whole tree, including the root
+		std::vector<FileNode*> existingNodes;
+		for (const auto& [name, node] : this->fileMap) {
+			existingNodes.push_back(node);
+		}
+		for (FileNode* node : existingNodes) {
+			this->RemoveNode(*node);
+		}
+
+		std::vector<FileNode*> nodes(header.NodeCount);
+		std::vector<FileNodePtr> hiddenNodes; // Owned here until the links reference them
+		std::vector<UINT64> dataRecords;
+
+		for (UINT64 i = 0; i < header.NodeCount; i++) {
+			const SnapshotNode& record = records[i];
+			const std::wstring_view name(reinterpret_cast<const wchar_t*>(blob + record.NameOffset), record.NameLength);
+
+			if (record.Kind == SnapshotNodeKind::Link) {
+				FileNodePtr linkPtr = FileNode::CreateLink(name, *nodes[record.MainIndex]);
+				linkPtr->fileInfo.IndexNumber = record.FileInfo.IndexNumber;
+
+				const auto [insertResult, link] = this->InsertNode(std::move(linkPtr));
+				if (!NT_SUCCESS(insertResult)) {
+					return insertResult;
+				}
+
+				nodes[i] = &link;
+				continue;
+			}
+
+			FileNodePtr nodePtr = FileNode::Create(name, this->metadata);
+			FileNode& node = *nodePtr;
+
+			if (record.MainIndex != SNAPSHOT_NO_INDEX) {
+				node.SetMainNode(nodes[record.MainIndex]);
+			}
+			ApplySnapshotMetadata(node, record, blob, record.SecurityIndex != SNAPSHOT_NO_INDEX ? &securityDescriptors[record.SecurityIndex] : nullptr);
+
+			if (attachSectors) {
+				if (0 != record.FileInfo.AllocationSize) {
+					SectorNode& sectorNode = node.GetSectorNode();
+					if (!this->sectors.AttachSectors(sectorNode, reinterpret_cast<const UINT64*>(data + record.DataOffset), SectorManager::GetSectorAmount(record.FileInfo.AllocationSize))) {
+						return STATUS_FILE_CORRUPT_ERROR;
+					}
+				}
+			} else if (SnapshotData::Lazy == contents) {
+				// Only hydrated on first access (overlay.h)
+				if (0 != record.FileInfo.FileSize) {
+					node.SetLowerSource(header.DataOffset + record.DataOffset);
+				}
+			} else {
+				if (0 != node.fileInfo.AllocationSize && !this->sectors.ReAllocate(node.GetSectorNode(), node.fileInfo.AllocationSize)) {
+					return STATUS_INSUFFICIENT_RESOURCES;
+				}
+				if (0 != record.FileInfo.FileSize) {
+					dataRecords.push_back(i);
+				}
+			}
+
+			if (record.Kind == SnapshotNodeKind::Hidden) {
+				nodes[i] = &node;
+				hiddenNodes.push_back(std::move(nodePtr));
+				continue;
+			}
+
+			const auto [insertResult, insertedNode] = this->InsertNode(std::move(nodePtr));
+			if (!NT_SUCCESS(insertResult)) {
+				return insertResult;
+			}
+
+			nodes[i] = &insertedNode;
+		}
+
+		for (FileNodePtr& hiddenNode : hiddenNodes) {
+			if (hiddenNode->GetReferenceCount() > 0) {
+				hiddenNode.release(); // Kept alive by its links
+			}
+		}
+
+		if (attachSectors) {
+			this->sectors.FinishAttach();
+		}
+
+		// The file data is copied by all cores, so that the restore is bound by the memory bandwidth
+		std::atomic<size_t> nextDataRecord{0};
+		std::atomic<bool> dataCopied{true};
+		const auto copyData = [&] {
+			for (size_t j = nextDataRecord++; j < dataRecords.size(); j = nextDataRecord++) {
+				const SnapshotNode& record = records[dataRecords[j]];
+				FileNode& node = *nodes[dataRecords[j]];
+
+				if (!SectorManager::ReadWrite<false>(node.GetSectorNode(), (void*)(data + record.DataOffset), record.FileInfo.FileSize, 0)) {
+					dataCopied = false;
+				}
+			}
+		};
+
+		std::vector<std::thread> copyThreads;
+		const unsigned int threadCount = max(1u, std::thread::hardware_concurrency());
+		for (unsigned int t = 1; t < threadCount; t++) {
+			try {
+				copyThreads.emplace_back(copyData);
+			} catch (std::system_error&) {
+				break; // The remaining threads do the work
+			}
+		}
+		copyData();
+		for (std::thread& copyThread : copyThreads) {
+			copyThread.join();
+		}
+
+		if (!dataCopied) {
+			return STATUS_FILE_CORRUPT_ERROR; // A file size beyond its allocation size
+		}
+
+		FileNode::ReserveIndexNumbers(header.MaxIndexNumber);
+		this->volumeLabel = std::wstring(header.VolumeLabel, wcsnlen(header.VolumeLabel, _countof(header.VolumeLabel)));
+		this->restoredCheckpointSequence = header.CheckpointSequence;
+		this->negativeLookups.Clear();
+	} catch (FileNameTooLongException&) {
+		return STATUS_FILE_CORRUPT_ERROR;
+	} catch (CreateException& ex) {
+		return ex.Which();
+	} catch (std::bad_alloc&) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+void MemFs::SetSnapshotPath(const std::wstring& path) {
+	this->snapshotPath = path;
+}
+
+const std::wstring& MemFs::GetSnapshotPath() const {
+	return this->snapshotPath;
+}
+
+UINT64 MemFs::GetRestoredCheckpointSequence() const {
+	return this->restoredCheckpointSequence;
+}
+
+void MemFs::EnableCheckpoints(const DWORD intervalSeconds) {
+	this->checkpoints = std::make_unique<CheckpointLog>(*this, intervalSeconds);
+	this->sectors.EnableDirtyTracking();
+}
+
+NTSTATUS MemFs::RestoreSnapshotImage() {
+	NTSTATUS result = this->LoadSnapshot(this->snapshotPath);
+	if (STATUS_OBJECT_NAME_NOT_FOUND == result) {
+		result = STATUS_SUCCESS; // First start; The image is created on stop or by the first checkpoint
+	} else if (NT_SUCCESS(result) && this->checkpoints) {
+		result = this->checkpoints->Replay();
+	}
+
+	if (NT_SUCCESS(result) && this->checkpoints) {
+		result = this->checkpoints->Start();
+	}
+
+	return result;
+}
+
+NTSTATUS MemFs::SaveSnapshotImage() {
+	if (this->checkpoints) {
+		return this->checkpoints->Compact();
+	}
+
+	SnapshotPlan plan;
+	{
+		Interface::OperationGuard guard(this->fileSystem.get(), false);
+		const NTSTATUS result = this->PrepareSnapshot(plan);
+		if (!NT_SUCCESS(result)) {
+			return result;
+		}
+	}
+
+	// Creating, renaming and deleting files only wait until the metadata is collected
+	return this->WriteSnapshot(this->snapshotPath, plan);
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "globalincludes.h"
+
+namespace Memfs {
+	class FileNode;
+	class SharedSecurityDescriptor;
+
+	/*
+	 * Layout of a snapshot image. Every section starts at a multiple of SNAPSHOT_SECTION_ALIGNMENT, so that the image can be mapped and copied in large sequential runs:
+	 * Header | Node records | Security descriptor records | Blob (names, EAs, reparse data, security descriptors) | File data
+	 */
+	static constexpr UINT64 SNAPSHOT_MAGIC = 0x31474D4953464D4DULL; // "MMFSIMG1"
+	static constexpr UINT64 HOT_RESTART_MAGIC = 0x31544F4853464D4DULL; // "MMFSHOT1"; Same layout, but the data section holds sector tables
+	static constexpr UINT32 SNAPSHOT_VERSION = 2;
+	static constexpr UINT64 SNAPSHOT_SECTION_ALIGNMENT = 64 * 1024;
+	static constexpr UINT64 SNAPSHOT_NO_INDEX = ~0ULL;
+
+	struct SnapshotHeader {
+		UINT64 Magic;
+		UINT32 Version;
+		UINT32 SectorSize; // FULL_SECTOR_SIZE; File data is aligned to it
+		UINT64 NodeCount;
+		UINT64 SecurityCount;
+		UINT64 NodesOffset;
+		UINT64 SecurityOffset;
+		UINT64 BlobOffset;
+		UINT64 BlobSize;
+		UINT64 DataOffset;
+		UINT64 DataSize;
+		UINT64 MaxIndexNumber;
+		UINT64 CheckpointSequence; // Last checkpoint of the log (checkpoint.h) that the image already contains
+		WCHAR VolumeLabel[32];
+	};
+
+	enum class SnapshotNodeKind : UINT32 {
+		Named = 0, // Main node or named stream, which is inserted under its name
+		Hidden = 1, // Node whose own name was deleted, but which is still reachable through hard links
+		Link = 2 // Hard link entry; Only its name and the target are stored
+	};
+
+	struct SnapshotNode {
+		FSP_FSCTL_FILE_INFO FileInfo;
+		SnapshotNodeKind Kind;
+		UINT32 NameLength; // In characters, without a null terminator
+		UINT64 NameOffset; // In the blob
+		UINT64 MainIndex; // Main node of a stream or target of a link, which always precedes this record
+		UINT64 SecurityIndex;
+		UINT64 EaOffset; // Chained FILE_FULL_EA_INFORMATION entries in the blob
+		UINT64 EaLength;
+		UINT64 ReparseOffset;
+		UINT64 ReparseLength;
+		UINT64 DataOffset; // In the data section; FileInfo.FileSize bytes, padded to the sector size, or the sector table (SnapshotData::SectorTables)
+	};
+
+	// What the data section of an image holds and how it is restored
+	enum class SnapshotData : UINT32 {
+		Copied = 0, // File data, which is copied into new sectors
+		Lazy = 1, // File data, which is left in the mapped image until it is hydrated (overlay.h)
+		SectorTables = 2 // Per file one UINT64 slot of the sector arena (sectorarena.h) per allocated sector, which is attached without copying
+	};
+
+	struct SnapshotSecurity {
+		UINT64 Offset; // In the blob
+		UINT64 Length;
+	};
+
+	// Everything of an image but the file contents, collected by MemFs::PrepareSnapshot under the operation guard; The contents are only read by MemFs::WriteSnapshot
+	struct SnapshotPlan {
+		SnapshotPlan() = default;
+		~SnapshotPlan();
+
+		SnapshotPlan(const SnapshotPlan& other) = delete;
+		SnapshotPlan& operator=(const SnapshotPlan& other) = delete;
+
+		SnapshotHeader Header{};
+		SnapshotData Contents{SnapshotData::Copied};
+		std::vector<SnapshotNode> Records;
+		std::vector<FileNode*> RecordNodes; // Referenced, so that nodes, which are deleted meanwhile, can still be read
+		std::vector<SnapshotSecurity> SecurityRecords;
+		std::vector<byte> Blob;
+		std::vector<UINT64> SectorSlots; // The sector tables of all records one after another (SnapshotData::SectorTables)
+	};
+
+	// Collects small writes to a file into large sequential ones
+	class SnapshotWriter {
+	public:
+		static constexpr size_t BUFFER_SIZE = 4 * 1024 * 1024;
+
+		/**
+		 * \throws std::bad_alloc If the buffer could not be allocated
+		 */
+		explicit SnapshotWriter(const HANDLE file);
+
+		// Writes zeros if data is nullptr
+		bool Write(const void* data, size_t size);
+		bool PadTo(const UINT64 offset);
+		bool Flush();
+		[[nodiscard]] UINT64 GetPosition() const;
+
+	private:
+		HANDLE file;
+		std::vector<byte> buffer;
+		size_t used{0};
+		UINT64 position{0};
+	};
+
+	// Appends 8-byte aligned, because EAs and security descriptors are used in place
+	void AppendSnapshotBlob(std::vector<byte>& blob, const void* data, const size_t size, UINT64& offset, UINT64& length);
+	// Appends the EAs of a main node as chained FILE_FULL_EA_INFORMATION entries
+	void AppendSnapshotEas(FileNode& node, std::vector<byte>& blob, UINT64& offset, UINT64& length);
+	// Whether every chained entry, including its name and value, lies within the length
+	[[nodiscard]] bool IsValidSnapshotEaChain(const byte* eas, const UINT64 length);
+	/**
+	 * \brief Replaces the metadata of a node with the one of a record, whose offsets point into the blob; The sector storage is left alone
+	 * \throws CreateException With STATUS_FILE_CORRUPT_ERROR for a broken EA chain or STATUS_INSUFFICIENT_RESOURCES
+	 */
+	void ApplySnapshotMetadata(FileNode& node, const SnapshotNode& record, const byte* blob, const SharedSecurityDescriptor* security);
+}
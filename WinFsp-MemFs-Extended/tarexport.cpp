@@ -0,0 +1,313 @@
+#include "globalincludes.h"
+#include "tarexport.h"
+
+#include "memfs.h"
+#include "snapshot.h"
+
+using namespace Memfs;
+
+static constexpr char TAR_TYPE_FILE = '0';
+static constexpr char TAR_TYPE_HARD_LINK = '1';
+static constexpr char TAR_TYPE_DIRECTORY = '5';
+static constexpr char TAR_TYPE_PAX = 'x';
+static constexpr UINT64 TAR_MAX_HEADER_SIZE = 077777777777; // 11 octal digits
+static constexpr UINT64 UNIX_EPOCH_FILETIME = 116444736000000000;
+
+// ustar header; Numbers are octal strings
+struct TarHeader {
+	char Name[100];
+	char Mode[8];
+	char Uid[8];
+	char Gid[8];
+	char Size[12];
+	char Mtime[12];
+	char Checksum[8];
+	char Typeflag;
+	char Linkname[100];
+	char Magic[6];
+	char Version[2];
+	char Uname[32];
+	char Gname[32];
+	char Devmajor[8];
+	char Devminor[8];
+	char Prefix[155];
+	char Padding[12];
+};
+static_assert(sizeof(TarHeader) == TarExporter::BLOCK_SIZE);
+
+static void WriteOctal(char* field, const size_t length, const UINT64 value) {
+	snprintf(field, length, "%0*llo", (int)(length - 1), (unsigned long long)value);
+}
+
+// Only plain ASCII names are stored in the header itself, everything else goes into a pax record, which is UTF-8 by definition
+static bool FitsHeader(const std::string& name) {
+	return name.length() <= sizeof(TarHeader::Name) && std::all_of(name.begin(), name.end(), [](const char c) { return (unsigned char)c < 0x80; });
+}
+
+static void AppendPaxRecord(std::string& records, const char* key, const std::string& value) {
+	// The length prefix counts its own digits
+	const size_t baseLength = strlen(key) + value.length() + 3; // " ", "=" and "\n"
+	size_t length = baseLength + 1;
+	while (length != baseLength + std::to_string(length).length()) {
+		length = baseLength + std::to_string(length).length();
+	}
+
+	records += std::to_string(length) + " " + key + "=" + value + "\n";
+}
+
+static std::string ToArchiveName(const std::wstring_view& relativeName, const bool isDirectory) {
+	std::string name;
+	if (!relativeName.empty()) {
+		const int length = WideCharToMultiByte(CP_UTF8, 0, relativeName.data(), (int)relativeName.length(), nullptr, 0, nullptr, nullptr);
+		name.resize(length);
+		WideCharToMultiByte(CP_UTF8, 0, relativeName.data(), (int)relativeName.length(), name.data(), length, nullptr, nullptr);
+	}
+
+	std::replace(name.begin(), name.end(), '\\', '/');
+	if (isDirectory) {
+		name += '/';
+	}
+
+	return name;
+}
+
+static TarHeader CreateHeader(const std::string& name, const char type, const std::string& linkName, const FileNode& node, const UINT64 size) {
+	TarHeader header{};
+	// Without a terminator for names, which use the whole field, as ustar allows
+	memcpy(header.Name, name.c_str(), min(name.length(), sizeof(header.Name)));
+	memcpy(header.Linkname, linkName.c_str(), min(linkName.length(), sizeof(header.Linkname)));
+
+	const DWORD attributes = node.fileInfo.FileAttributes;
+	WriteOctal(header.Mode, sizeof(header.Mode), (attributes & FILE_ATTRIBUTE_DIRECTORY) ? 0755 : (attributes & FILE_ATTRIBUTE_READONLY) ? 0444 : 0644);
+	WriteOctal(header.Uid, sizeof(header.Uid), 0);
+	WriteOctal(header.Gid, sizeof(header.Gid), 0);
+	WriteOctal(header.Size, sizeof(header.Size), size);
+
+	const UINT64 lastWriteTime = node.fileInfo.LastWriteTime;
+	WriteOctal(header.Mtime, sizeof(header.Mtime), lastWriteTime > UNIX_EPOCH_FILETIME ? (lastWriteTime - UNIX_EPOCH_FILETIME) / 10000000 : 0);
+
+	header.Typeflag = type;
+	memcpy(header.Magic, "ustar", sizeof(header.Magic)); // With its null terminator
+	memcpy(header.Version, "00", sizeof(header.Version));
+
+	// Summed up with the checksum field itself set to spaces
+	memset(header.Checksum, ' ', sizeof(header.Checksum));
+	unsigned int checksum = 0;
+	for (size_t i = 0; i < sizeof(TarHeader); i++) {
+		checksum += reinterpret_cast<const unsigned char*>(&header)[i];
+	}
+	snprintf(header.Checksum, sizeof(header.Checksum), "%06o", checksum);
+	header.Checksum[7] = ' ';
+
+	return header;
+}
+
+static bool PadBlock(SnapshotWriter& writer) {
+	constexpr UINT64 BLOCK_SIZE = TarExporter::BLOCK_SIZE;
+	return writer.PadTo((writer.GetPosition() + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE);
+}
+
+TarExporter::TarExporter(MemFs& memfs, const std::wstring& hostPath) : memfs(memfs), hostPath(hostPath) {}
+
+bool TarExporter::IsValidArchiveName(const std::wstring_view& name) {
+	if (name.empty() || name.length() > MEMFS_MAX_COMPONENT_LENGTH || name == L"." || name == L"..") {
+		return false;
+	}
+
+	if (std::wstring_view::npos != name.find_first_of(L"\\/:*?\"<>|")) {
+		return false;
+	}
+	// Win32 strips trailing dots and spaces, so the archive would get another name than the one asked for
+	if (L'.' == name.back() || L' ' == name.back()) {
+		return false;
+	}
+
+	// Device names open the device instead of a file in the export directory, even with an extension
+	std::wstring_view base = name.substr(0, name.find(L'.'));
+	base = base.substr(0, base.find_last_not_of(L' ') + 1);
+	for (const wchar_t* device : {L"CON", L"PRN", L"AUX", L"NUL", L"CONIN$", L"CONOUT$"}) {
+		if (base.length() == wcslen(device) && 0 == _wcsnicmp(base.data(), device, base.length())) {
+			return false;
+		}
+	}
+	if (4 == base.length() && (0 == _wcsnicmp(base.data(), L"COM", 3) || 0 == _wcsnicmp(base.data(), L"LPT", 3))) {
+		const wchar_t digit = base[3];
+		if ((L'1' <= digit && digit <= L'9') || L'\u00b9' == digit || L'\u00b2' == digit || L'\u00b3' == digit) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void MemFs::SetExportDirectory(const std::wstring& path) {
+	this->exportDirectory = path;
+}
+
+const std::wstring& MemFs::GetExportDirectory() const {
+	return this->exportDirectory;
+}
+
+TarExporter::~TarExporter() {
+	for (FileNode* node : this->referenced) {
+		node->Dereference();
+	}
+}
+
+NTSTATUS TarExporter::Collect(const std::wstring_view& directory) {
+	const auto rootNode = this->memfs.FindFile(directory);
+	if (!rootNode.has_value()) {
+		return STATUS_OBJECT_PATH_NOT_FOUND;
+	}
+	FileNode& root = rootNode.value();
+	if (!(root.fileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		return STATUS_NOT_A_DIRECTORY;
+	}
+
+	const bool fromVolumeRoot = 1 == root.fileName.length();
+	const bool withVolumeSnapshots = this->memfs.IsInVolumeSnapshots(root.fileName.c_str());
+
+	try {
+		this->referenced = this->memfs.EnumerateDescendants(root, true);
+		this->entries.reserve(this->referenced.size());
+
+		for (FileNode* node : this->referenced) {
+			if (node == &root) {
+				continue;
+			}
+			if (!node->IsMainNode()) {
+				this->statistics.Skipped++;
+				continue;
+			}
+			// Volume snapshots are only exported on their own, otherwise every snapshot would be archived again
+			if (!withVolumeSnapshots && this->memfs.IsInVolumeSnapshots(node->fileName.c_str())) {
+				continue;
+			}
+
+			const FileNode& contentNode = node->IsLink() ? *node->GetLinkTarget() : *node;
+			std::wstring_view relativeName(node->fileName.c_str(), node->fileName.length());
+			relativeName.remove_prefix(fromVolumeRoot ? 1 : root.fileName.length() + 1);
+
+			this->entries.push_back(Entry{node, ToArchiveName(relativeName, contentNode.fileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)});
+		}
+	} catch (std::bad_alloc&) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS TarExporter::Write(ExportStatistics& statistics) {
+	const ULONGLONG startTicks = GetTickCount64();
+
+	const HANDLE file = CreateFileW(this->hostPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	NTSTATUS result = STATUS_SUCCESS;
+	try {
+		SnapshotWriter writer(file);
+		std::vector<byte> buffer(READ_BUFFER_SIZE);
+		std::unordered_map<const FileNode*, const std::string*> archivedFiles;
+
+		for (const Entry& entry : this->entries) {
+			result = this->WriteEntry(writer, entry, buffer, archivedFiles);
+			if (!NT_SUCCESS(result)) {
+				break;
+			}
+		}
+
+		// Two zero blocks end the archive
+		if (NT_SUCCESS(result) && !(writer.Write(nullptr, 2 * BLOCK_SIZE) && writer.Flush())) {
+			result = FspNtStatusFromWin32(GetLastError());
+		}
+	} catch (std::bad_alloc&) {
+		result = STATUS_INSUFFICIENT_RESOURCES;
+	}
+	CloseHandle(file);
+
+	if (!NT_SUCCESS(result)) {
+		DeleteFileW(this->hostPath.c_str());
+		return result;
+	}
+
+	this->statistics.Milliseconds = GetTickCount64() - startTicks;
+	statistics = this->statistics;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS TarExporter::WriteEntry(SnapshotWriter& writer, const Entry& entry, std::vector<byte>& buffer, std::unordered_map<const FileNode*, const std::string*>& archivedFiles) {
+	FileNode& node = entry.Node->IsLink() ? *entry.Node->GetLinkTarget() : *entry.Node;
+
+	if (node.fileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+		this->statistics.Directories++;
+		return this->WriteHeader(writer, entry.Name, TAR_TYPE_DIRECTORY, {}, node, 0);
+	}
+
+	// Further names of a file only refer to the first one, which holds the contents
+	const auto [iter, inserted] = archivedFiles.emplace(&node, &entry.Name);
+	if (!inserted) {
+		this->statistics.Files++;
+		return this->WriteHeader(writer, entry.Name, TAR_TYPE_HARD_LINK, *iter->second, node, 0);
+	}
+
+	// From here on, writers copy the sectors they change, so that the shared contents stay the ones of this moment
+	const FileNodePtr contents = FileNode::Create(L"", this->memfs.GetMetadata());
+	if (!this->memfs.ShareContents(node, *contents)) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	const UINT64 size = contents->fileInfo.FileSize;
+
+	NTSTATUS result = this->WriteHeader(writer, entry.Name, TAR_TYPE_FILE, {}, node, size);
+	if (!NT_SUCCESS(result)) {
+		return result;
+	}
+
+	for (UINT64 offset = 0; offset < size; offset += buffer.size()) {
+		const size_t readNow = (size_t)min((UINT64)buffer.size(), size - offset);
+
+		// The size was taken with the contents, so a read only fails if the lower layer could not be read
+		if (!this->memfs.ReadContents(*contents, buffer.data(), readNow, offset)) {
+			return STATUS_UNEXPECTED_IO_ERROR;
+		}
+		if (!writer.Write(buffer.data(), readNow)) {
+			return FspNtStatusFromWin32(GetLastError());
+		}
+	}
+
+	if (!PadBlock(writer)) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	this->statistics.Files++;
+	this->statistics.Bytes += size;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS TarExporter::WriteHeader(SnapshotWriter& writer, const std::string& name, const char type, const std::string& linkName, const FileNode& node, const UINT64 size) {
+	std::string paxRecords;
+	if (!FitsHeader(name)) {
+		AppendPaxRecord(paxRecords, "path", name);
+	}
+	if (!FitsHeader(linkName)) {
+		AppendPaxRecord(paxRecords, "linkpath", linkName);
+	}
+	if (size > TAR_MAX_HEADER_SIZE) {
+		AppendPaxRecord(paxRecords, "size", std::to_string(size));
+	}
+
+	if (!paxRecords.empty()) {
+		const TarHeader paxHeader = CreateHeader("././@PaxHeader", TAR_TYPE_PAX, {}, node, paxRecords.length());
+		if (!writer.Write(&paxHeader, sizeof(TarHeader)) || !writer.Write(paxRecords.data(), paxRecords.length()) || !PadBlock(writer)) {
+			return FspNtStatusFromWin32(GetLastError());
+		}
+	}
+
+	const TarHeader header = CreateHeader(name, type, linkName, node, size > TAR_MAX_HEADER_SIZE ? 0 : size);
+	if (!writer.Write(&header, sizeof(TarHeader))) {
+		return FspNtStatusFromWin32(GetLastError());
+	}
+
+	return STATUS_SUCCESS;
+}
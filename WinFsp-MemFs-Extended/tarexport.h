@@ -0,0 +1,65 @@
+#pragma once
+
+#include "globalincludes.h"
+
+#include "nodes.h"
+
+namespace Memfs {
+	class MemFs;
+	class SnapshotWriter;
+
+	// Output of the export IOCTL; Fields are only ever appended
+	struct ExportStatistics {
+		UINT64 Directories;
+		UINT64 Files;
+		UINT64 Bytes;
+		UINT64 Skipped; // Named streams, which tar cannot hold
+		UINT64 Milliseconds;
+	};
+
+	/**
+	 * \brief Streams a directory of the volume as a POSIX (pax) tar archive into a file of the export directory (-E), while the volume stays online.
+	 * The names are collected under the operation guard; Afterwards the contents of each file are shared copy-on-write and read without any lock,
+	 * so that every file is archived as it was at one point in time and writers are never stopped.
+	 */
+	class TarExporter {
+	public:
+		static constexpr size_t BLOCK_SIZE = 512;
+		static constexpr size_t READ_BUFFER_SIZE = 1024 * 1024;
+
+		TarExporter(MemFs& memfs, const std::wstring& hostPath);
+		~TarExporter();
+
+		// A single file name, which is no device name, so that an archive never leaves the export directory
+		static bool IsValidArchiveName(const std::wstring_view& name);
+
+		TarExporter(const TarExporter& other) = delete;
+		TarExporter(TarExporter&& other) noexcept = delete;
+		TarExporter& operator=(const TarExporter& other) = delete;
+		TarExporter& operator=(TarExporter&& other) noexcept = delete;
+
+		/**
+		 * \brief References everything below the directory; The caller holds the operation guard (shared)
+		 */
+		NTSTATUS Collect(const std::wstring_view& directory);
+		// Writes the archive without the operation guard
+		NTSTATUS Write(ExportStatistics& statistics);
+
+	private:
+		struct Entry {
+			FileNode* Node;
+			std::string Name; // UTF-8 with slashes, relative to the exported directory
+		};
+
+		NTSTATUS WriteEntry(SnapshotWriter& writer, const Entry& entry, std::vector<byte>& buffer, std::unordered_map<const FileNode*, const std::string*>& archivedFiles);
+		// Precedes the header with a pax header, if the names or the size do not fit into it
+		NTSTATUS WriteHeader(SnapshotWriter& writer, const std::string& name, const char type, const std::string& linkName, const FileNode& node, const UINT64 size);
+
+		MemFs& memfs;
+		std::wstring hostPath;
+
+		std::vector<FileNode*> referenced; // Kept alive until the archive is written, even if they are deleted meanwhile
+		std::vector<Entry> entries;
+		ExportStatistics statistics{};
+	};
+}
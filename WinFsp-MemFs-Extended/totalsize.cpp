@@ -1,45 +1,37 @@
 #include "globalincludes.h"
 #include "memfs.h"
+#include "memfs-interface.h"
+#include "accounting.h"
 
 using namespace Memfs;
 
-// memefs: Approximates the all file sizes and the node map size
-UINT64 MemFs::GetUsedTotalSize() {
-	const ULONG nodeMapSize = (ULONG)this->fileMap.size() * (256 * sizeof(wchar_t) + sizeof(FileNode));
-	// EA node map is ignored, because it is insignificant
+void MemFs::UseMemoryBudget(MemoryBudget* budget) {
+	this->budget = budget;
+	this->sectors.UseBudget(budget);
+}
 
-	const SIZE_T sectorSizes = this->sectors.GetAllocatedSectors() * (sizeof(Sector) + sizeof(Sector*));
-	return nodeMapSize + sectorSizes;
+void MemFs::SetInlineFileLimit(const UINT32 bytes) {
+	this->sectors.SetInlineLimit(bytes);
+}
+
+// memefs: Sums up the sectors and the node metadata of this volume, which is accounted where it is allocated; Other volumes only count against the budget (-B)
+UINT64 MemFs::GetUsedTotalSize() {
+	const UINT64 sectorSizes = this->sectors.GetAllocatedSectors() * sizeof(Sector) + this->sectors.GetInlineBytes();
+	return this->metadata.Sum() + sectorSizes;
 }
 
 
 // memefs: This is required to update the maximum total size according to the available RAM that is left
 UINT64 MemFs::CalculateMaxTotalSize() {
-	if (this->maxFsSize != 0) {
-		return this->maxFsSize;
-	}
-
-	const UINT64 usedSize = this->GetUsedTotalSize();
-	const UINT64 currentTicks = GetTickCount64();
-
-	// Limit calls to GlobalMemoryStatusEx with a 100ms cooldown to improve performance
-	if (currentTicks - this->lastCacheTime < 100) {
-		return this->cachedMaxFsSize + usedSize;
-	}
+	// Sampled in the background, including job object limits
+	const UINT64 maxTotalSize = this->maxFsSize != 0 ? this->maxFsSize : this->memoryMonitor.GetAvailableBytes() + this->GetUsedTotalSize();
 
-	MEMORYSTATUSEX memoryStatus{};
-	memoryStatus.dwLength = sizeof(MEMORYSTATUSEX);
-	if (!GlobalMemoryStatusEx(&memoryStatus)) {
-		return 0;
+	// Whatever the other volumes reserved is not available to this one
+	if (this->budget != nullptr) {
+		return min(maxTotalSize, this->GetUsedTotalSize() + this->budget->GetAvailableBytes());
 	}
 
-	// TODO: Check whether it should be limited by physical or virtual memory
-	const UINT64 availMemorySize = min(memoryStatus.ullAvailPhys, memoryStatus.ullAvailVirtual);
-
-	this->cachedMaxFsSize = availMemorySize;
-	this->lastCacheTime = currentTicks;
-
-	return availMemorySize + usedSize;
+	return maxTotalSize;
 }
 
 UINT64 MemFs::CalculateAvailableTotalSize() {
@@ -52,3 +44,25 @@ UINT64 MemFs::CalculateAvailableTotalSize() {
 
 	return totalSize - usedSize;
 }
+
+bool MemFs::IsMemoryCritical() const {
+	return this->memoryMonitor.GetPressureLevel() == MemoryPressureLevel::Critical;
+}
+
+// memefs: Runs on the memory monitor thread, so only state with its own synchronization may be touched
+void MemFs::ReclaimMemory(const MemoryPressureLevel level) {
+	FILE_NODE_POOL.Trim();
+	this->sectors.Compact();
+
+	// Caches are rebuilt on demand; Lookups and listings read them under the shared operation guard
+	if (this->fileSystem) {
+		Interface::OperationGuard guard(this->fileSystem.get(), true);
+		this->negativeLookups.Clear();
+		{
+			std::lock_guard lock(this->dirCursorsMutex);
+			this->dirCursors.clear();
+		}
+
+		this->ReleaseDirectoryBuffers();
+	}
+}
@@ -0,0 +1,282 @@
+#include "globalincludes.h"
+#include "exceptions.h"
+#include "memfs.h"
+#include "utils.h"
+
+using namespace Memfs;
+
+// Like NTFS, which also rejects these characters in names
+static bool IsValidSnapshotName(const std::wstring_view& name) {
+	if (name.empty() || name.length() > MEMFS_MAX_COMPONENT_LENGTH || name == L"." || name == L"..") {
+		return false;
+	}
+
+	return std::wstring_view::npos == name.find_first_of(L"\\/:*?\"<>|");
+}
+
+// Copies everything but the file ID and the contents
+static void CopyNodeMetadata(FileNode& source, FileNode& target) {
+	const UINT64 indexNumber = target.fileInfo.IndexNumber;
+	target.fileInfo = source.fileInfo;
+	target.fileInfo.IndexNumber = indexNumber;
+	target.fileInfo.EaSize = 0; // Summed up again by SetEa
+	target.fileSecurity = source.fileSecurity;
+
+	if (source.IsMainNode() && target.IsMainNode()) {
+		target.DeleteEas();
+		source.GetEas().ForEach([&target](const FILE_FULL_EA_INFORMATION* ea) {
+			target.SetEa(const_cast<PFILE_FULL_EA_INFORMATION>(ea));
+			return true;
+		});
+	}
+
+	const DynamicStruct<byte>& sourceReparseData = source.GetReparseData();
+	DynamicStruct<byte> reparseData;
+	if (sourceReparseData.HoldsStruct()) {
+		reparseData = DynamicStruct<byte>(sourceReparseData.WantedByteSize());
+		memcpy(reparseData.Struct(), sourceReparseData.Struct(), sourceReparseData.WantedByteSize());
+	}
+	target.SetReparseData(std::move(reparseData));
+}
+
+bool MemFs::IsInVolumeSnapshots(const PCWSTR fileName) const {
+	return Utils::FileNameHasPrefix(fileName, VOLUME_SNAPSHOTS_DIRECTORY, this->IsCaseInsensitive());
+}
+
+NTSTATUS MemFs::TakeVolumeSnapshot(const std::wstring_view& name) {
+	if (!IsValidSnapshotName(name)) {
+		return STATUS_OBJECT_NAME_INVALID;
+	}
+
+	try {
+		// Hidden like the root directories of other snapshotting file systems, so that it does not show up in listings
+		const auto snapshotsDirectory = this->FindFile(VOLUME_SNAPSHOTS_DIRECTORY);
+		if (snapshotsDirectory.has_value() && !(snapshotsDirectory.value().get().fileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+			return STATUS_OBJECT_NAME_COLLISION;
+		}
+		if (!snapshotsDirectory.has_value()) {
+			FileNodePtr directoryPtr = FileNode::Create(VOLUME_SNAPSHOTS_DIRECTORY, this->metadata);
+			directoryPtr->fileInfo.FileAttributes = FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_HIDDEN;
+			directoryPtr->fileSecurity = this->FindFile(L"\\").value().get().fileSecurity;
+
+			const auto [insertResult, _] = this->InsertNode(std::move(directoryPtr));
+			if (!NT_SUCCESS(insertResult)) {
+				return insertResult;
+			}
+		}
+
+		const std::wstring snapshotRoot = std::wstring(VOLUME_SNAPSHOTS_DIRECTORY) + L"\\" + std::wstring(name);
+		if (this->FindFile(snapshotRoot).has_value()) {
+			return STATUS_OBJECT_NAME_COLLISION;
+		}
+
+		TreeClone clone;
+		this->CloneTree(this->FindFile(L"\\").value(), snapshotRoot, clone);
+
+		const NTSTATUS result = this->InsertClones(clone);
+		if (!NT_SUCCESS(result)) {
+			this->DeleteVolumeSnapshot(name); // Nothing of a partial snapshot is kept
+		}
+
+		return result;
+	} catch (FileNameTooLongException&) {
+		this->DeleteVolumeSnapshot(name);
+		return STATUS_OBJECT_NAME_INVALID;
+	} catch (CreateException& ex) {
+		this->DeleteVolumeSnapshot(name);
+		return ex.Which();
+	} catch (std::bad_alloc&) {
+		this->DeleteVolumeSnapshot(name);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+}
+
+NTSTATUS MemFs::DeleteVolumeSnapshot(const std::wstring_view& name) {
+	if (!IsValidSnapshotName(name)) {
+		return STATUS_OBJECT_NAME_INVALID;
+	}
+
+	try {
+		const auto snapshotRoot = this->FindFile(std::wstring(VOLUME_SNAPSHOTS_DIRECTORY) + L"\\" + std::wstring(name));
+		if (!snapshotRoot.has_value()) {
+			return STATUS_OBJECT_NAME_NOT_FOUND;
+		}
+
+		// Open handles keep their nodes alive, like after any other delete
+		for (FileNode* node : this->EnumerateDescendants(snapshotRoot.value(), false)) {
+			this->RemoveNode(*node);
+		}
+	} catch (std::bad_alloc&) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS MemFs::RollbackVolumeSnapshot(const std::wstring_view& name) {
+	if (!IsValidSnapshotName(name)) {
+		return STATUS_OBJECT_NAME_INVALID;
+	}
+
+	try {
+		const auto snapshotRoot = this->FindFile(std::wstring(VOLUME_SNAPSHOTS_DIRECTORY) + L"\\" + std::wstring(name));
+		if (!snapshotRoot.has_value()) {
+			return STATUS_OBJECT_NAME_NOT_FOUND;
+		}
+
+		FileNode& root = this->FindFile(L"\\").value();
+		TreeClone clone;
+		this->CloneTree(snapshotRoot.value(), L"\\", clone);
+
+		// The removed nodes are held like clones, so that they can be inserted again if inserting the clones fails
+		TreeClone removed;
+		for (FileNode* node : this->EnumerateDescendants(root, false)) {
+			if (node != &root && !this->IsInVolumeSnapshots(node->fileName.c_str())) {
+				removed.Nodes.push_back(node);
+				node->Reference();
+			}
+		}
+
+		for (FileNode* node : removed.Nodes) {
+			this->RemoveNode(*node);
+		}
+
+		const NTSTATUS result = this->InsertClones(clone);
+		if (!NT_SUCCESS(result)) {
+			// Removing the clones first gives back the memory, which the map entries of the removed nodes need
+			for (FileNode* node : clone.Nodes) {
+				this->RemoveNode(*node);
+			}
+			for (FileNode* node : removed.Nodes) {
+				this->InsertNode(node);
+			}
+		} else {
+			// The root itself stays, because it cannot be deleted and may be open
+			CopyNodeMetadata(snapshotRoot.value(), root);
+		}
+
+		root.BumpChildrenGeneration();
+		root.InvalidateDirectoryBuffer();
+		this->negativeLookups.Clear();
+		return result;
+	} catch (FileNameTooLongException&) {
+		return STATUS_OBJECT_NAME_INVALID;
+	} catch (CreateException& ex) {
+		return ex.Which();
+	} catch (std::bad_alloc&) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+}
+
+void MemFs::CloneTree(FileNode& sourceRoot, const std::wstring& targetRoot, TreeClone& clone) {
+	const bool fromVolumeRoot = 1 == sourceRoot.fileName.length();
+	const bool toVolumeRoot = L"\\" == targetRoot;
+
+	// Relative names are empty for the source root, start with a colon for its streams and with a backslash below it
+	const auto targetName = [&](const FileNode& node) {
+		std::wstring_view relativeName(node.fileName.c_str(), node.fileName.length());
+		relativeName.remove_prefix(fromVolumeRoot ? 1 : sourceRoot.fileName.length());
+		if (fromVolumeRoot && !relativeName.empty() && L':' != relativeName[0]) {
+			relativeName = std::wstring_view(node.fileName.c_str(), node.fileName.length());
+		}
+
+		if (toVolumeRoot) {
+			return relativeName.empty() || L':' == relativeName[0] ? L"\\" + std::wstring(relativeName) : std::wstring(relativeName);
+		}
+		return targetRoot + std::wstring(relativeName);
+	};
+
+	std::unordered_map<const FileNode*, FileNode*> clones;
+	std::vector<FileNode*> links;
+	if (toVolumeRoot) {
+		clones.emplace(&sourceRoot, &this->FindFile(L"\\").value().get());
+	}
+
+	// Listed before the reference is taken, so that a failing list frees the clone
+	const auto keepClone = [](std::vector<FileNode*>& list, FileNodePtr&& clonePtr) {
+		list.push_back(clonePtr.get());
+		FileNode* clone = clonePtr.release();
+		clone->Reference();
+		return clone;
+	};
+
+	const auto cloneNode = [&](FileNode& node, const std::wstring& name) {
+		FileNodePtr clonePtr = FileNode::Create(name, this->metadata);
+		FileNode& clone = *clonePtr;
+
+		if (!node.IsMainNode()) {
+			clone.SetMainNode(clones.at(node.GetMainNode()));
+		}
+		CopyNodeMetadata(node, clone);
+
+		if (!(node.fileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !this->ShareContents(node, clone)) {
+			throw std::bad_alloc();
+		}
+
+		return clonePtr;
+	};
+
+	for (FileNode* node : this->EnumerateDescendants(sourceRoot, false)) {
+		// The root of the volume already exists; Snapshots are not part of snapshots
+		if ((toVolumeRoot && node == &sourceRoot) || (fromVolumeRoot && this->IsInVolumeSnapshots(node->fileName.c_str()))) {
+			continue;
+		}
+
+		if (node->IsLink()) {
+			links.push_back(node);
+			continue;
+		}
+
+		clones.emplace(node, keepClone(clone.Nodes, cloneNode(*node, targetName(*node))));
+	}
+
+	for (FileNode* link : links) {
+		FileNode* target = link->GetLinkTarget();
+		if (!clones.contains(target)) {
+			// Only reachable through links, so the clone has no name of its own either
+			clones.emplace(target, keepClone(clone.HiddenNodes, cloneNode(*target, targetName(*link))));
+		}
+
+		keepClone(clone.Nodes, FileNode::CreateLink(targetName(*link), *clones.at(target)));
+	}
+}
+
+NTSTATUS MemFs::InsertClones(const TreeClone& clone) {
+	for (FileNode* node : clone.Nodes) {
+		const auto [insertResult, insertedNode] = this->InsertNode(node);
+		if (!NT_SUCCESS(insertResult)) {
+			return insertResult;
+		}
+		if (insertedNode != node) {
+			return STATUS_OBJECT_NAME_COLLISION;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+MemFs::TreeClone::~TreeClone() {
+	// Inserted nodes stay referenced by the map, hidden ones by their links
+	for (FileNode* node : this->Nodes) {
+		node->Dereference();
+	}
+	for (FileNode* node : this->HiddenNodes) {
+		node->Dereference();
+	}
+}
+
+bool MemFs::ShareContents(FileNode& source, FileNode& target) {
+	if (this->overlay) {
+		return this->overlay->Share(source, target);
+	}
+
+	try {
+		if (0 == source.fileInfo.AllocationSize) {
+			target.fileInfo.FileSize = 0;
+			return true;
+		}
+		return this->sectors.Share(source.GetSectorNode(), target.GetSectorNode(), source.fileInfo.FileSize, target.fileInfo.FileSize);
+	} catch (std::bad_alloc&) {
+		return false;
+	}
+}